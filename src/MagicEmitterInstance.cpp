@@ -0,0 +1,1282 @@
+#include "MagicEmitterInstance.h"
+#include "MagicParticleEffect.h"
+#include "MagicParticleUtils.h"
+#include "MagicParticleTimeline.h"
+#include "MagicParticleEventStream.h"
+#include "MagicParticleArena.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+//----------------------------------------------------------------------------------------------------
+
+MP_BUFFER::MP_BUFFER()
+{
+    max_length=0;
+    length=0;
+}
+
+MP_BUFFER::~MP_BUFFER()
+{
+    Destroy();
+}
+
+void MP_BUFFER::Create(int new_length)
+{
+    Destroy();
+    max_length=new_length;
+}
+
+void MP_BUFFER::Destroy()
+{
+    max_length=0;
+    length=0;
+}
+
+void MP_BUFFER::SetLength(int new_length)
+{
+    if (max_length<new_length)
+        Create(new_length);
+    length=new_length;
+}
+
+void MP_BUFFER::Shrink(int new_max_length)
+{
+    if (GetCapacity()<=new_max_length)
+        return;
+
+    if (new_max_length>0)
+        Create(new_max_length);
+    else
+        Destroy();
+}
+
+//----------------------------------------------------------------------------------------------------
+
+
+MP_BUFFER_RAM::MP_BUFFER_RAM() : MP_BUFFER()
+{
+    buffer=nullptr;
+}
+
+MP_BUFFER_RAM::~MP_BUFFER_RAM()
+{
+    Destroy();
+}
+
+void MP_BUFFER_RAM::Create(int new_length)
+{
+    MP_BUFFER::Create(new_length);
+    buffer=new char[new_length];
+}
+
+void MP_BUFFER_RAM::Destroy()
+{
+    MP_BUFFER::Destroy();
+
+    if (buffer)
+    {
+        delete []buffer;
+        buffer=nullptr;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------
+
+/// Arena frame of buffers using own memory.
+static const unsigned NO_ARENA_FRAME = M_MAX_UNSIGNED;
+
+MP_BUFFER_ARENA::MP_BUFFER_ARENA(MagicParticleArena* frame_arena) : MP_BUFFER_RAM()
+{
+    arena=frame_arena;
+    owned=nullptr;
+    owned_length=0;
+    frame=NO_ARENA_FRAME;
+}
+
+MP_BUFFER_ARENA::~MP_BUFFER_ARENA()
+{
+    // before MP_BUFFER_RAM destructor, buffer may point to the arena
+    Destroy();
+}
+
+void MP_BUFFER_ARENA::SetLength(int new_length)
+{
+    // contents are only needed until upload : a fresh block every fill
+    void* memory=arena ? arena->Allocate(new_length) : nullptr;
+    if (memory)
+    {
+        buffer=(char*)memory;
+        frame=arena->GetFrame();
+    }
+    else
+    {
+        if (owned_length<new_length)
+            Create(new_length);
+        buffer=owned;
+        frame=NO_ARENA_FRAME;
+    }
+
+    max_length=new_length;
+    length=new_length;
+}
+
+void MP_BUFFER_ARENA::Create(int new_length)
+{
+    Destroy();
+    owned=new char[new_length];
+    owned_length=new_length;
+    buffer=owned;
+    max_length=new_length;
+}
+
+void MP_BUFFER_ARENA::Destroy()
+{
+    MP_BUFFER::Destroy();
+
+    delete []owned;
+    owned=nullptr;
+    owned_length=0;
+    buffer=nullptr;
+    frame=NO_ARENA_FRAME;
+}
+
+bool MP_BUFFER_ARENA::IsExpired() const
+{
+    // arena blocks are reset two frames after their allocations
+    return frame!=NO_ARENA_FRAME && arena->GetFrame()-frame>1;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+MagicEmitterInstance::MagicEmitterInstance(MagicParticleEffect* effect, int index) :
+    _effect(effect)
+    , _index(index)
+    , _emitter(0)
+    , _vertexData(nullptr)
+    , _indexData(nullptr)
+    , _timeAccumulator(0.0)
+    , _numSteps(0)
+    , _templateSortMode(MAGIC_NOSORT)
+    , _sortMode(MAGIC_NOSORT)
+    , _blendMask(0)
+    , _fillBlendMask(0)
+    , _alive(true)
+    , _ownerID(0)
+    , _version(0)
+    , _scale(0.0f)
+    , _fillVersion(0)
+    , _fillKeyed(false)
+    , _index32(false)
+    , _fillIndex32(false)
+    , _peakVertexLength(0)
+    , _peakIndexLength(0)
+{
+    _graphics = effect->GetSubsystem<Graphics>();
+    _stats = effect->GetSubsystem<MagicParticleStats>();
+    _events = effect->GetSubsystem<MagicParticleEventStream>();
+    _arena = effect->GetSubsystem<MagicParticleArena>();
+    _vertexData = new MP_BUFFER_ARENA(_arena);
+    _indexData = new MP_BUFFER_ARENA(_arena);
+    _materialsCreated = 0;
+    memset(&_renderingStart, 0, sizeof(MAGIC_RENDERING_START));
+    memset(&_position, 0, sizeof(MAGIC_POSITION));
+    memset(&_direction, 0, sizeof(MAGIC_DIRECTION));
+    memset(&_fillCamera, 0, sizeof(MAGIC_CAMERA));
+
+    // Create new emitter, none if template is not loaded (benchmarks drive render paths without emitter)
+    HM_EMITTER emitter = effect->GetEmitter(index);
+    _emitter = emitter ? Magic_DuplicateEmitter(emitter) : 0;
+
+    // Calculating bounding box every frame
+    if (_emitter > 0)
+    {
+        Magic_SetBBoxPeriod(_emitter, 1);
+        _templateSortMode = _sortMode = Magic_GetSortingMode(_emitter);
+    }
+}
+
+MagicEmitterInstance::~MagicEmitterInstance()
+{
+    if (_emitter > 0)
+        Magic_UnloadEmitter(_emitter);
+
+    _vertexData->Destroy();
+    _indexData->Destroy();
+
+    delete _vertexData;
+    delete _indexData;
+
+    for (unsigned i = 0; i < _storedFills.Size(); ++i)
+    {
+        delete _storedFills[i].vertexData;
+        delete _storedFills[i].indexData;
+    }
+}
+
+void MagicEmitterInstance::Reset()
+{
+    if (_emitter > 0)
+    {
+        Magic_Stop(_emitter);
+        Magic_SetInterrupt(_emitter, false);
+        Magic_SetLoopMode(_emitter, Magic_GetLoopMode(_effect->GetEmitter(_index)));
+
+        // next owner may use another sorting policy, blendings of the template are kept
+        if (_sortMode != _templateSortMode)
+        {
+            Magic_SetSortingMode(_emitter, _templateSortMode);
+            _sortMode = _templateSortMode;
+        }
+    }
+
+    _timeAccumulator = 0.0;
+    _alive = true;
+    ++_version;
+
+    // next owner transform is always applied
+    _scale = 0.0f;
+
+    ClearRendering();
+}
+
+void MagicEmitterInstance::Restart(const MAGIC_POSITION& position)
+{
+    if (_emitter <= 0)
+        return;
+
+    Magic_SetInterrupt(_emitter, false);
+    Magic_Restart(_emitter);
+
+    // start emitter to interval 1
+    if (Magic_IsInterval1(_emitter))
+    {
+        MAGIC_POSITION pos = position;
+        Magic_SetEmitterPosition(_emitter, &pos);
+        _position = position;
+
+        // restore prewarmed particles, simulate only if no snapshot
+        if (!_effect->RestoreSnapshot(_index, _emitter))
+        {
+            Magic_EmitterToInterval1(_emitter, 1.f, 0);
+
+            // prewarm events are not part of the frame
+            if (_events)
+                _events->Discard();
+        }
+    }
+
+    _alive = true;
+    ++_version;
+}
+
+void MagicEmitterInstance::Stop()
+{
+    if (_emitter > 0)
+        Magic_Stop(_emitter);
+
+    ++_version;
+    ClearFill();
+}
+
+void MagicEmitterInstance::Spawn(const MAGIC_POSITION& position, const MAGIC_DIRECTION& direction)
+{
+    // one-shots never move: place them once, particles are independent from emitter
+    Magic_SetEmitterPositionMode(_emitter, false);
+    Magic_SetEmitterDirectionMode(_emitter, false);
+
+    // play timeline once so that looping emitters also finish
+    Magic_SetLoopMode(_emitter, MAGIC_NOLOOP);
+    Magic_Restart(_emitter);
+
+    MAGIC_POSITION pos = position;
+    Magic_SetEmitterPosition(_emitter, &pos);
+    MAGIC_DIRECTION dir = direction;
+    Magic_SetEmitterDirection(_emitter, &dir);
+    _position = position;
+    _direction = direction;
+
+    _alive = true;
+    ++_version;
+}
+
+void MagicEmitterInstance::SetTransform(const MAGIC_POSITION& position, const MAGIC_DIRECTION* direction, float scale)
+{
+    // set every update by emitters : only a real move changes the geometry
+    bool moved = memcmp(&position, &_position, sizeof(MAGIC_POSITION)) || scale != _scale ||
+            (direction && memcmp(direction, &_direction, sizeof(MAGIC_DIRECTION)));
+    if (!moved)
+        return;
+
+    _position = position;
+    _scale = scale;
+    if (direction)
+        _direction = *direction;
+    ++_version;
+
+    MAGIC_POSITION pos = position;
+    Magic_SetEmitterPosition(_emitter, &pos);
+
+    if (direction)
+    {
+        MAGIC_DIRECTION dir = *direction;
+        Magic_SetEmitterDirection(_emitter, &dir);
+    }
+
+    Magic_SetScale(_emitter, scale);
+}
+
+void MagicEmitterInstance::ClearRendering()
+{
+    ClearFill();
+    ClearViews();
+}
+
+void MagicEmitterInstance::ClearFill()
+{
+    memset(&_renderingStart, 0, sizeof(MAGIC_RENDERING_START));
+    _drawBatches.Clear();
+    _batchStates.Clear();
+    _renderStates.Clear();
+    _materials.Clear();
+
+    for (unsigned i = 0; i < _storedFills.Size(); ++i)
+        _storedFills[i].stored = false;
+}
+
+void MagicEmitterInstance::ClearViews()
+{
+    for (unsigned i = 0; i < _views.Size(); ++i)
+    {
+        _views[i].numBatches = 0;
+        _views[i].materials.Clear();
+        _views[i].fillKeyed = false;
+    }
+}
+
+/// Seed of render state sequence keys.
+static const unsigned long long MP_STATE_KEY_SEED = 0xcbf29ce484222325ULL;
+/// Translated render state sequences kept per emitter template.
+static const unsigned MP_STATE_CACHE_SIZE = 256;
+
+/// Chain a value in a render state sequence key (FNV-1a step).
+static inline unsigned long long ChainStateKey(unsigned long long key, unsigned value)
+{
+    return (key ^ value) * 0x100000001b3ULL;
+}
+
+/// Relative cost of sorting modes.
+static int GetSortCost(MAGIC_SORT_ENUM mode)
+{
+    switch (mode)
+    {
+    case MAGIC_NOSORT:
+        return 0;
+    case MAGIC_SORT_MIX:
+    case MAGIC_SORT_MIX_INV:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+MAGIC_SORT_ENUM MagicEmitterInstance::GetSortMode(MP_SORT_MODE mode, float distance) const
+{
+    if (mode == MP_SORT_TEMPLATE)
+        return _templateSortMode;
+    if (mode != MP_SORT_AUTO)
+        return (MAGIC_SORT_ENUM)(mode - MP_SORT_NONE);
+
+    // blendings are known after the first fill
+    if (!_effect->GetAutoSorting() || !_blendMask)
+        return _templateSortMode;
+
+    // additive and opaque batches do not depend on drawing order
+    if (!(_blendMask & (1 << MAGIC_BLENDING_NORMAL)))
+        return MAGIC_NOSORT;
+
+    // distant camera sorting is not worth its cost, cheaper modes chosen in the .ptc file are kept
+    if (GetSortCost(_templateSortMode) > GetSortCost(_effect->GetFarSortMode()) && distance > _effect->GetSortingDistance())
+        return _effect->GetFarSortMode();
+
+    return _templateSortMode;
+}
+
+void MagicEmitterInstance::ApplySorting(MP_SORT_MODE mode, float distance)
+{
+    if (_emitter <= 0)
+        return;
+
+    MAGIC_SORT_ENUM sortMode = GetSortMode(mode, distance);
+    if (sortMode != _sortMode)
+    {
+        Magic_SetSortingMode(_emitter, sortMode);
+        _sortMode = sortMode;
+        ++_version;
+    }
+}
+
+bool MagicEmitterInstance::Update(double time)
+{
+    URHO3D_PROFILE(MagicSimulate);
+
+    HiresTimer timer;
+    _counters.Reset();
+
+    _alive = Simulate(time);
+
+    // Magic event queue is global : drain it before next emitter updates
+    if (_events)
+        _events->Drain(_emitter, _ownerID);
+
+    MP_COUNTERS counters;
+    counters.updateTime = timer.GetUSec(false);
+    AddCounters(counters);
+
+    return _alive;
+}
+
+bool MagicEmitterInstance::Simulate(double time)
+{
+    double step = _effect->GetFixedTimeStep();
+
+    if (step <= 0.0)
+    {
+        // variable step : frame time goes straight to the simulation
+        _numSteps = 1;
+        if (time > 0.0)
+            ++_version;
+
+        MP_TIMELINE_SCOPE("Magic_Update", _emitter);
+        if (Magic_Update(_emitter, time) == false)
+            return false;
+    }
+    else
+    {
+        // fixed step : drop time exceeding max catch up, then consume whole steps
+        _timeAccumulator += Min(time, _effect->GetMaxCatchUp());
+        _numSteps = 0;
+
+        unsigned maxSubSteps = _effect->GetMaxSubSteps();
+        while (_timeAccumulator >= step && _numSteps < maxSubSteps)
+        {
+            _timeAccumulator -= step;
+            ++_numSteps;
+
+            MP_TIMELINE_SCOPE("Magic_Update", _emitter);
+            if (Magic_Update(_emitter, step) == false)
+                return false;
+        }
+
+        // sub-steps exhausted : forget the remaining whole steps, keep the fraction
+        if (_timeAccumulator >= step)
+            _timeAccumulator = fmod(_timeAccumulator, step);
+
+        if (!_numSteps)
+            return true;
+
+        ++_version;
+    }
+
+    // set bounding box
+
+    MAGIC_BBOX bbox;
+    Magic_GetBBox(_emitter, &bbox);
+    _boundingBox.Define( MagicToUrho3D(bbox.corner1), MagicToUrho3D(bbox.corner2) );
+
+    return true;
+}
+
+unsigned MagicEmitterInstance::Fill(const MAGIC_CAMERA* camera)
+{
+    unsigned batchCount = FillArrays(camera);
+    ResolveMaterials();
+    return batchCount;
+}
+
+bool MagicEmitterInstance::IsFillCurrent(unsigned view, const MAGIC_CAMERA& camera) const
+{
+    if (view >= _views.Size() || !_views[view].fillKeyed || _views[view].fillVersion != _version)
+        return false;
+
+    // GPU buffers lost their contents (device lost) : geometry must be filled and uploaded again
+    const MP_VIEW_GEOMETRY& geometry = _views[view];
+    if ((geometry.vertexBuffer && geometry.vertexBuffer->IsDataLost()) || (geometry.indexBuffer && geometry.indexBuffer->IsDataLost()))
+        return false;
+    for (unsigned i = 0; i < geometry.chunkVertexBuffers.Size(); ++i)
+    {
+        if (geometry.chunkVertexBuffers[i] && geometry.chunkVertexBuffers[i]->IsDataLost())
+            return false;
+    }
+
+    // only camera facing particles depend on camera position and direction, both in Magic space
+    if (!_effect->IsCameraFacing(_index))
+        return true;
+
+    const MAGIC_CAMERA& fillCamera = _views[view].fillCamera;
+    Vector3 move(camera.pos.x - fillCamera.pos.x, camera.pos.y - fillCamera.pos.y, camera.pos.z - fillCamera.pos.z);
+    Vector3 direction(camera.dir.x, camera.dir.y, camera.dir.z);
+    Vector3 fillDirection(fillCamera.dir.x, fillCamera.dir.y, fillCamera.dir.z);
+
+    float distance = _effect->GetRefillDistance() * SCALE_URHO3D_TO_MAGIC;
+    if (move.LengthSquared() > distance * distance)
+        return false;
+    if (direction != fillDirection && direction.Angle(fillDirection) > _effect->GetRefillAngle())
+        return false;
+
+    return true;
+}
+
+bool MagicEmitterInstance::SkipFill(unsigned view, const MAGIC_CAMERA& camera)
+{
+    if (!IsFillCurrent(view, camera))
+        return false;
+
+    MP_COUNTERS counters;
+    counters.fillsSkipped = 1;
+    counters.particles = _views[view].particles;
+    AddCounters(counters);
+
+    return true;
+}
+
+unsigned MagicEmitterInstance::FillArrays(const MAGIC_CAMERA* camera)
+{
+    URHO3D_PROFILE(MagicFill);
+
+    HiresTimer timer;
+    MP_COUNTERS counters;
+
+    // key of the filled geometry, kept by views it is uploaded to
+    _fillVersion = _version;
+    _fillKeyed = camera != nullptr;
+    if (camera)
+        _fillCamera = *camera;
+
+    // clear draw batches
+    _drawBatches.Clear();
+    _batchStates.Clear();
+    _renderStates.Clear();
+    _fillBlendMask = 0;
+
+    MAGIC_RENDERING_START start;
+    MAGIC_ARGB_ENUM color_mode = MAGIC_ARGB;
+    int max_array_streams = 0;
+
+    // prepares the information about render arrays and fill start structure,
+    // with 16 bits indices unless previous fills did not fit them
+    bool index32 = _index32;
+    void* context;
+    {
+        MP_TIMELINE_SCOPE("Magic_PrepareRenderArrays", _emitter);
+        context = Magic_PrepareRenderArrays(_emitter, &start, max_array_streams, color_mode, index32);
+    }
+
+    if (!index32 && start.vertices > MP_MAX_VERTICES_16)
+    {
+        // outgrew 16 bits since last fill : prepare again, indices are split in chunks at upload
+        MP_TIMELINE_SCOPE("Magic_PrepareRenderArrays", _emitter);
+        index32 = true;
+        context = Magic_PrepareRenderArrays(_emitter, &start, max_array_streams, color_mode, index32);
+    }
+
+    // go back to 16 bits with a margin, an emitter around the limit does not switch every frame
+    _index32 = start.vertices > (index32 ? MP_MAX_VERTICES_16 * 3 / 4 : MP_MAX_VERTICES_16);
+    _fillIndex32 = index32;
+
+    if (start.arrays)
+    {
+        // save start infos
+        SaveAttributes(&start);
+
+        // set vertex format
+        _vertexElements.Clear();
+        _vertexElements.Push(VertexElement(TYPE_VECTOR3, SEM_POSITION));
+        _vertexElements.Push(VertexElement(TYPE_UBYTE4_NORM, SEM_COLOR));
+        for(int i=0; i<start.format.UVs; ++i)
+            _vertexElements.Push(VertexElement(TYPE_VECTOR2, SEM_TEXCOORD, i));
+
+        // returns info about render arrays
+        MAGIC_ARRAY_INFO vertex_info, index_info;
+        Magic_GetRenderArrayData(context, 0, &vertex_info);
+        Magic_GetRenderArrayData(context, 1, &index_info);
+
+        // map index and vertex buffers
+        MapBuffers(&vertex_info, &index_info);
+
+        // set render array
+        MP_ARRAY_INFO* array_info_vertex = &_m_array_info[0];
+        Magic_SetRenderArrayData(context, array_info_vertex->stage, array_info_vertex->buffer, array_info_vertex->offset, array_info_vertex->stride);
+        MP_ARRAY_INFO* array_info_index = &_m_array_info[1];
+        Magic_SetRenderArrayData(context, array_info_index->stage, array_info_index->buffer, array_info_index->offset, array_info_index->stride);
+
+        // Fills the render buffers by info about vertices
+        {
+            MP_TIMELINE_SCOPE("Magic_FillRenderArrays", _emitter);
+            Magic_FillRenderArrays(context);
+        }
+        counters.fillTime = timer.GetUSec(true);
+
+        // fill draw batches, states are only collected : materials are resolved from their sequence
+
+        {
+            URHO3D_PROFILE(MagicCollectStates);
+            MP_TIMELINE_SCOPE("RenderStates", _emitter);
+
+            // Magic sends state changes since previous batch : the key of the whole sequence identifies batch states
+            unsigned long long stateKey = MP_STATE_KEY_SEED;
+
+            MAGIC_RENDER_VERTICES vrts;
+            MAGIC_RENDER_STATE state;
+            while (Magic_GetVertices(context, &vrts) == MAGIC_SUCCESS)
+            {
+                while (Magic_GetNextRenderState(context, &state) == MAGIC_SUCCESS)
+                {
+                    stateKey = ChainStateKey(ChainStateKey(ChainStateKey(stateKey, state.state), state.value), state.index);
+                    if (state.state == MAGIC_RENDER_STATE_BLENDING)
+                        _fillBlendMask |= 1 << state.value;
+                    _renderStates.Push(state);
+                }
+
+                BATCH_STATE batchState;
+                batchState.material = vrts.material;
+                batchState.stateKey = ChainStateKey(stateKey, vrts.material);
+                batchState.stateEnd = _renderStates.Size();
+                _batchStates.Push(batchState);
+
+                _drawBatches.Push(vrts);
+            }
+        }
+
+        counters.stateTime = timer.GetUSec(false);
+        counters.particles = start.particles;
+        counters.vertices = start.vertices;
+        counters.indices = start.indexes;
+        counters.batches = _drawBatches.Size();
+        if (GetSortCost(_sortMode) < GetSortCost(_templateSortMode))
+            counters.sortSkipped = start.particles;
+
+        if (_fillBlendMask)
+            _blendMask = _fillBlendMask;
+    }
+    else
+        counters.fillTime = timer.GetUSec(false);
+
+    AddCounters(counters);
+
+    return _drawBatches.Size();
+}
+
+void MagicEmitterInstance::ResolveMaterials()
+{
+    URHO3D_PROFILE(MagicTranslateStates);
+
+    HiresTimer timer;
+
+    _materials.Clear();
+    _materialsCreated = 0;
+
+    // sequences already translated by an instance of the template are a lookup, others are replayed
+    // from fill start : states of a batch are the changes applied to those of previous batches
+    MP_STATE_CACHE* cache = _index >= 0 ? _effect->GetStateCache(_index) : nullptr;
+    unsigned translated = 0;
+    bool translating = false;
+
+    for (unsigned i = 0; i < _batchStates.Size(); ++i)
+    {
+        const BATCH_STATE& batchState = _batchStates[i];
+
+        if (cache)
+        {
+            MP_STATE_CACHE::ConstIterator it = cache->Find(batchState.stateKey);
+            if (it != cache->End())
+            {
+                _materials.Push(it->second_);
+                continue;
+            }
+        }
+
+        if (!translating)
+        {
+            ResetStates();
+            translating = true;
+        }
+
+        for (; translated < batchState.stateEnd; ++translated)
+            SetRenderState(&_renderStates[translated]);
+
+        Material* material = GetRenderMaterial(batchState.material);
+        _materials.Push(SharedPtr<Material>(material));
+
+        if (cache)
+        {
+            // emitters producing endless sequences do not grow the cache
+            if (cache->Size() >= MP_STATE_CACHE_SIZE)
+                cache->Clear();
+            (*cache)[batchState.stateKey] = material;
+        }
+    }
+
+    MP_COUNTERS counters;
+    counters.stateTime = timer.GetUSec(false);
+    counters.materialsCreated = _materialsCreated;
+    AddCounters(counters);
+}
+
+void MagicEmitterInstance::StoreFill(unsigned view)
+{
+    if (view >= _storedFills.Size())
+        _storedFills.Resize(view + 1);
+
+    STORED_FILL& fill = _storedFills[view];
+    if (!fill.vertexData)
+    {
+        fill.vertexData = new MP_BUFFER_ARENA(_arena);
+        fill.indexData = new MP_BUFFER_ARENA(_arena);
+    }
+
+    SwapFill(fill);
+    fill.stored = true;
+}
+
+bool MagicEmitterInstance::Present(unsigned view)
+{
+    if (!TakeFill(view))
+        return false;
+
+    Upload(view);
+
+    return true;
+}
+
+bool MagicEmitterInstance::TakeFill(unsigned view)
+{
+    if (view >= _storedFills.Size() || !_storedFills[view].stored)
+        return false;
+
+    STORED_FILL& fill = _storedFills[view];
+    fill.stored = false;
+
+    // stored too long ago, its frame arena block has been reused
+    if (fill.vertexData->IsExpired() || fill.indexData->IsExpired())
+        return false;
+
+    SwapFill(fill);
+
+    ResolveMaterials();
+
+    return true;
+}
+
+void MagicEmitterInstance::SwapFill(STORED_FILL& fill)
+{
+    Swap(_vertexData, fill.vertexData);
+    Swap(_indexData, fill.indexData);
+    Swap(_renderingStart, fill.renderingStart);
+    Swap(_fillIndex32, fill.index32);
+    Swap(_fillVersion, fill.version);
+    Swap(_fillCamera, fill.camera);
+    Swap(_fillKeyed, fill.keyed);
+    _vertexElements.Swap(fill.vertexElements);
+    _drawBatches.Swap(fill.drawBatches);
+    _batchStates.Swap(fill.batchStates);
+    _renderStates.Swap(fill.renderStates);
+}
+
+void MagicEmitterInstance::MarkMerged(unsigned view)
+{
+    if (view >= _views.Size())
+        _views.Resize(view + 1);
+
+    MP_VIEW_GEOMETRY& geometry = _views[view];
+    geometry.particles = _renderingStart.particles;
+    geometry.fillVersion = _fillVersion;
+    geometry.fillCamera = _fillCamera;
+    geometry.fillKeyed = _fillKeyed;
+}
+
+bool MagicEmitterInstance::Upload(unsigned view)
+{
+    // 32 bits fill : rebase indices in 16 bits vertex chunks, a draw batch may span several chunks
+    bool split = _fillIndex32;
+    if (split)
+        SplitChunks();
+
+    unsigned batchCount = split ? _drawRanges.Size() : _drawBatches.Size();
+
+    // buffers of a view are created the first time it sees the instance
+    if (view >= _views.Size())
+        _views.Resize(view + 1);
+
+    MP_VIEW_GEOMETRY& geometry = _views[view];
+    geometry.numBatches = 0;
+    geometry.particles = _renderingStart.particles;
+    geometry.fillVersion = _fillVersion;
+    geometry.fillCamera = _fillCamera;
+    geometry.fillKeyed = false;
+
+    geometry.geometries.Resize(batchCount);
+
+    // nothing to draw is a valid geometry too
+    if(batchCount == 0)
+    {
+        geometry.fillKeyed = _fillKeyed;
+        return false;
+    }
+
+    unsigned totalIndexCount = split ? _chunkIndices.Size() : _renderingStart.indexes;
+    unsigned totalVertexCount = _renderingStart.vertices;
+
+    if(_graphics->IsDeviceLost())
+        return false;
+
+    // set index buffer
+
+    URHO3D_PROFILE(MagicUpload);
+    MP_TIMELINE_SCOPE("Upload", _emitter);
+
+    HiresTimer timer;
+
+    if (!geometry.vertexBuffer)
+    {
+        geometry.vertexBuffer = new VertexBuffer(_effect->GetContext());
+        geometry.indexBuffer = new IndexBuffer(_effect->GetContext());
+    }
+
+    // rewritten every fill : dynamic, without shadow copy
+    geometry.indexBuffer->SetSize(totalIndexCount, false, true);
+    MP_BUFFER_RAM* ib = reinterpret_cast<MP_BUFFER_RAM*>(_indexData);
+    geometry.indexBuffer->SetData(split ? (const void*)&_chunkIndices[0] : ib->buffer);
+    geometry.indexBuffer->ClearDataLost();
+
+    // set vertex buffers, one per chunk
+
+    MP_BUFFER_RAM* vb = reinterpret_cast<MP_BUFFER_RAM*>(_vertexData);
+    unsigned vertexSize = VertexBuffer::GetVertexSize(_vertexElements);
+    unsigned numChunks = split ? _chunks.Size() : 1;
+    unsigned long long bytesUploaded = totalIndexCount * sizeof(unsigned short);
+
+    if (geometry.chunkVertexBuffers.Size() < numChunks - 1)
+        geometry.chunkVertexBuffers.Resize(numChunks - 1);
+
+    for (unsigned i = 0; i < numChunks; ++i)
+    {
+        unsigned vertexStart = split ? _chunks[i].vertexStart : 0;
+        unsigned vertexCount = split ? _chunks[i].vertexEnd - vertexStart : totalVertexCount;
+
+        SharedPtr<VertexBuffer>& buffer = i ? geometry.chunkVertexBuffers[i - 1] : geometry.vertexBuffer;
+        if (!buffer)
+            buffer = new VertexBuffer(_effect->GetContext());
+
+        buffer->SetSize(vertexCount, _vertexElements, true);
+        buffer->SetData(vb->buffer + vertexStart * vertexSize);
+        buffer->ClearDataLost();
+        bytesUploaded += vertexCount * vertexSize;
+    }
+
+    // set geometries draw ranges
+
+    geometry.materials.Resize(batchCount);
+
+    for (unsigned i = 0; i < batchCount; ++i)
+    {
+        SharedPtr<Geometry>& batchGeometry = geometry.geometries[i];
+        if (!batchGeometry)
+        {
+            batchGeometry = new Geometry(_effect->GetContext());
+            batchGeometry->SetIndexBuffer(geometry.indexBuffer);
+        }
+
+        if (split)
+        {
+            const DRAW_RANGE& range = _drawRanges[i];
+            const VERTEX_CHUNK& chunk = _chunks[range.chunk];
+            batchGeometry->SetVertexBuffer(0, range.chunk ? geometry.chunkVertexBuffers[range.chunk - 1] : geometry.vertexBuffer);
+            batchGeometry->SetDrawRange(TRIANGLE_LIST, range.indexStart, range.indexCount, 0, chunk.vertexEnd - chunk.vertexStart, false);
+            geometry.materials[i] = _materials[range.batch];
+        }
+        else
+        {
+            batchGeometry->SetVertexBuffer(0, geometry.vertexBuffer);
+            batchGeometry->SetDrawRange(TRIANGLE_LIST, _drawBatches[i].starting_index, _drawBatches[i].indexes_count, true);
+            geometry.materials[i] = _materials[i];
+        }
+    }
+
+    geometry.numBatches = batchCount;
+    geometry.fillKeyed = _fillKeyed;
+
+    MP_COUNTERS counters;
+    counters.bytesUploaded = bytesUploaded;
+    counters.uploadTime = timer.GetUSec(false);
+    AddCounters(counters);
+
+    return true;
+}
+
+void MagicEmitterInstance::SplitChunks()
+{
+    _chunkIndices.Clear();
+    _chunks.Clear();
+    _drawRanges.Clear();
+
+    const unsigned* indices = reinterpret_cast<const unsigned*>(reinterpret_cast<MP_BUFFER_RAM*>(_indexData)->buffer);
+
+    for (unsigned b = 0; b < _drawBatches.Size(); ++b)
+    {
+        unsigned end = _drawBatches[b].starting_index + _drawBatches[b].indexes_count;
+
+        for (unsigned i = _drawBatches[b].starting_index; i + 2 < end; i += 3)
+        {
+            unsigned low = Min(Min(indices[i], indices[i + 1]), indices[i + 2]);
+            unsigned high = Max(Max(indices[i], indices[i + 1]), indices[i + 2]) + 1;
+
+            // particles vertices are mostly in order : open a chunk when the triangle is out of reach of the current one
+            if (_chunks.Empty() || low < _chunks.Back().vertexStart || high - _chunks.Back().vertexStart > MP_MAX_VERTICES_16)
+            {
+                VERTEX_CHUNK chunk;
+                chunk.vertexStart = low;
+                chunk.vertexEnd = high;
+                _chunks.Push(chunk);
+            }
+
+            VERTEX_CHUNK& chunk = _chunks.Back();
+            chunk.vertexEnd = Max(chunk.vertexEnd, high);
+
+            // one draw range per batch and chunk
+            unsigned chunkIndex = _chunks.Size() - 1;
+            if (_drawRanges.Empty() || _drawRanges.Back().batch != b || _drawRanges.Back().chunk != chunkIndex)
+            {
+                DRAW_RANGE range;
+                range.batch = b;
+                range.chunk = chunkIndex;
+                range.indexStart = _chunkIndices.Size();
+                range.indexCount = 0;
+                _drawRanges.Push(range);
+            }
+
+            for (unsigned k = 0; k < 3; ++k)
+                _chunkIndices.Push((unsigned short)(indices[i + k] - chunk.vertexStart));
+            _drawRanges.Back().indexCount += 3;
+        }
+    }
+}
+
+MP_MEMORY MagicEmitterInstance::GetMemoryUse() const
+{
+    // frame arena blocks are not owned by instances
+    MP_MEMORY memory;
+    memory.instances = 1;
+    memory.buffers = _vertexData->GetCapacity() + _indexData->GetCapacity();
+
+    for (unsigned i = 0; i < _storedFills.Size(); ++i)
+    {
+        if (_storedFills[i].vertexData)
+            memory.buffers += _storedFills[i].vertexData->GetCapacity() + _storedFills[i].indexData->GetCapacity();
+    }
+
+    memory.buffers += _chunkIndices.Capacity() * sizeof(unsigned short) + _chunks.Capacity() * sizeof(VERTEX_CHUNK) +
+            _drawRanges.Capacity() * sizeof(DRAW_RANGE);
+
+    for (unsigned i = 0; i < _views.Size(); ++i)
+    {
+        const MP_VIEW_GEOMETRY& geometry = _views[i];
+
+        if (geometry.vertexBuffer)
+            memory.gpuBuffers += geometry.vertexBuffer->GetVertexCount() * geometry.vertexBuffer->GetVertexSize();
+        if (geometry.indexBuffer)
+            memory.gpuBuffers += geometry.indexBuffer->GetIndexCount() * geometry.indexBuffer->GetIndexSize();
+
+        for (unsigned j = 0; j < geometry.chunkVertexBuffers.Size(); ++j)
+        {
+            if (geometry.chunkVertexBuffers[j])
+                memory.gpuBuffers += geometry.chunkVertexBuffers[j]->GetVertexCount() * geometry.chunkVertexBuffers[j]->GetVertexSize();
+        }
+    }
+
+    return memory;
+}
+
+void MagicEmitterInstance::Trim(bool all)
+{
+    // filled geometry has been uploaded already, only stored fills waiting for presentation are kept
+    int vertexLength = all ? 0 : _peakVertexLength;
+    int indexLength = all ? 0 : _peakIndexLength;
+
+    _vertexData->Shrink(vertexLength);
+    _indexData->Shrink(indexLength);
+
+    for (unsigned i = 0; i < _storedFills.Size(); ++i)
+    {
+        STORED_FILL& fill = _storedFills[i];
+        if (fill.vertexData && !fill.stored)
+        {
+            fill.vertexData->Shrink(vertexLength);
+            fill.indexData->Shrink(indexLength);
+        }
+    }
+
+    // split arrays are only needed by 32 bits fills
+    if (all || !_index32)
+    {
+        _chunkIndices.Clear();
+        _chunkIndices.Compact();
+        _chunks.Clear();
+        _chunks.Compact();
+        _drawRanges.Clear();
+        _drawRanges.Compact();
+    }
+
+    if (all)
+    {
+        // pooled : next owner creates the views it needs
+        _views.Clear();
+    }
+    else
+    {
+        // geometries and chunk vertex buffers not drawn anymore, views gather batches again before rendering
+        for (unsigned i = 0; i < _views.Size(); ++i)
+        {
+            MP_VIEW_GEOMETRY& geometry = _views[i];
+            geometry.geometries.Resize(geometry.numBatches);
+
+            unsigned used = 0;
+            for (unsigned j = 0; j < geometry.numBatches; ++j)
+            {
+                for (unsigned k = 0; k < geometry.chunkVertexBuffers.Size(); ++k)
+                {
+                    if (geometry.geometries[j]->GetVertexBuffer(0) == geometry.chunkVertexBuffers[k])
+                        used = Max(used, k + 1);
+                }
+            }
+            geometry.chunkVertexBuffers.Resize(used);
+        }
+    }
+
+    _peakVertexLength = 0;
+    _peakIndexLength = 0;
+}
+
+void MagicEmitterInstance::AddCounters(const MP_COUNTERS& counters)
+{
+    _counters += counters;
+    if (_stats)
+        _stats->Add(counters);
+}
+
+void MagicEmitterInstance::MapBuffers(MAGIC_ARRAY_INFO* vertex_info, MAGIC_ARRAY_INFO* index_info)
+{
+    MP_ARRAY_INFO* info;
+    int new_length;
+    int stage=0;
+
+    // indices
+    *((MAGIC_ARRAY_INFO*)&(_m_array_info[0]))=*vertex_info;
+    info=&(_m_array_info[0]);
+    info->stage=stage;
+    stage++;
+    new_length=vertex_info->length*vertex_info->bytes_per_one;
+    _vertexData->SetLength(new_length);
+    _peakVertexLength=Max(_peakVertexLength, new_length);
+    info->offset=0;
+    info->stride=vertex_info->bytes_per_one;
+    info->buffer=_vertexData->Map(info->stride);
+
+    // vertices
+    *((MAGIC_ARRAY_INFO*)&(_m_array_info[1]))=*index_info;
+    info=&(_m_array_info[1]);
+    info->stage=stage;
+    stage++;
+    new_length=index_info->length*index_info->bytes_per_one;
+    _indexData->SetLength(new_length);
+    _peakIndexLength=Max(_peakIndexLength, new_length);
+    info->offset=0;
+    info->stride=index_info->bytes_per_one;
+    info->buffer=_indexData->Map(info->stride);
+}
+
+void MagicEmitterInstance::SaveAttributes(MAGIC_RENDERING_START* start)
+{
+    _renderingStart = *start;
+}
+
+unsigned MagicEmitterInstance::ApplyRenderStates(MAGIC_RENDER_STATE* states, unsigned count)
+{
+    ResetStates();
+    for (unsigned i = 0; i < count; ++i)
+        SetRenderState(&states[i]);
+
+    return _stateHashKey;
+}
+
+void MagicEmitterInstance::ResetStates()
+{
+    // Reset all states to default.
+
+    // Textures
+    for (unsigned i=0; i<MAX_TEX_STAGE; i++)
+    {
+        TEX_STAGE* s = &(stages[i]);
+        s->address_u = MAX_ADDRESSMODES;
+        s->address_v = MAX_ADDRESSMODES;
+        s->uTexture = nullptr;
+    }
+
+    // Blending
+    STATE_BLENDING = MAX_BLENDMODES;
+
+    // Depth write on/off
+    STATE_ZWRITE = true;
+
+    // State hash key
+    _stateHashKey = 0;
+}
+
+void MagicEmitterInstance::SetRenderNothing(MAGIC_RENDER_STATE* s)
+{
+    // use this for non implemented states.
+}
+
+extern unsigned int hash(unsigned int x);
+void MagicEmitterInstance::SetRenderTexture(MAGIC_RENDER_STATE* s)
+{
+    // state = MAGIC_RENDER_STATE_TEXTURE - setting of texture.
+    // value = index of textural atlas, which was created by API.
+    // index = index of stage for the setting of textural atlas.
+
+    TEX_STAGE* stage = &(stages[s->index]);
+    stage->uTexture = _effect->GetTexture(s->value);  
+
+    // compute hash key using texture value and index (see : MagicParticleEffect::GetMaterial)
+    //_stateHashKey += hash(s->value);
+    //_stateHashKey += hash(s->index);
+    _stateHashKey += stage->uTexture->GetNameHash().ToHash();
+}
+
+BlendMode URHO_BLEND_MODE[] = { BLEND_ALPHA, BLEND_ADDALPHA, BLEND_REPLACE };
+void MagicEmitterInstance::SetRenderBlending(MAGIC_RENDER_STATE* s)
+{
+    // state = MAGIC_RENDER_STATE_BLENDING - blending.
+    // value = 0 - usual blending.
+    // value = 1 - additional blending.
+    // value = 2 - without blending.
+
+    STATE_BLENDING = URHO_BLEND_MODE[s->value];
+
+    // compute hash key using blending value (see : MagicParticleEffect::GetMaterial)
+    _stateHashKey += hash(s->value);	
+}
+
+TextureAddressMode URHO_ADDRESS_UV_MODE[] = { ADDRESS_WRAP, ADDRESS_MIRROR, ADDRESS_CLAMP, ADDRESS_BORDER };
+void MagicEmitterInstance::SetRenderAddressU(MAGIC_RENDER_STATE* s)
+{
+    // state = MAGIC_RENDER_STATE_ADDRESS_U - setting of addressing of textural U-coordinate.
+    // value = way of addressing (MAGIC_TEXADDRESS_WRAP, MAGIC_TEXADDRESS_MIRROR, MAGIC_TEXADDRESS_CLAMP, MAGIC_TEXADDRESS_BORDER).
+    // index = index of stage of texture for setting.
+
+    TEX_STAGE* stage = &(stages[s->index]);
+    stage->address_u = URHO_ADDRESS_UV_MODE[s->value];
+
+    //_stateHashKey += hash(s->index);
+    //_stateHashKey += hash(s->value);
+}
+
+void MagicEmitterInstance::SetRenderZWrite(MAGIC_RENDER_STATE* s)
+{
+    // state = MAGIC_RENDER_STATE_ZWRITE - disable/enable the change of Z-buffer
+    // value = 0 (enable) / 1 (disable).
+
+    STATE_ZWRITE = s->value;
+}
+
+void MagicEmitterInstance::SetRenderAddressV(MAGIC_RENDER_STATE* s)
+{
+    // state = MAGIC_RENDER_STATE_ADDRESS_V - setting of addressing of textural V-coordinate.
+    // value = way of addressing (MAGIC_TEXADDRESS_WRAP, MAGIC_TEXADDRESS_MIRROR, MAGIC_TEXADDRESS_CLAMP, MAGIC_TEXADDRESS_BORDER).
+    // index = index of stage of texture for setting.
+
+    TEX_STAGE* stage = &(stages[s->index]);
+    stage->address_v = URHO_ADDRESS_UV_MODE[s->value];
+
+    //_stateHashKey += hash(s->index);
+    //_stateHashKey += hash(s->value);
+}
+
+// Init array of poinet to function with adresses of functions for all MAGIC states.
+MagicEmitterInstance::StateFuncPtr MagicEmitterInstance::_stateFuncPointer[] = {
+    &MagicEmitterInstance::SetRenderBlending,   // MAGIC_RENDER_STATE_BLENDING
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_TEXTURE_COUNT
+    &MagicEmitterInstance::SetRenderTexture,    // MAGIC_RENDER_STATE_TEXTURE
+    &MagicEmitterInstance::SetRenderAddressU,   // MAGIC_RENDER_STATE_ADDRESS_U
+    &MagicEmitterInstance::SetRenderAddressV,   // MAGIC_RENDER_STATE_ADDRESS_V
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_OPERATION_RGB
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_ARGUMENT1_RGB
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_ARGUMENT2_RGB
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_OPERATION_ALPHA
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_ARGUMENT1_ALPHA
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_ARGUMENT2_ALPHA
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_ZENABLE
+    &MagicEmitterInstance::SetRenderZWrite,     // MAGIC_RENDER_STATE_ZWRITE
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_ALPHATEST_INIT
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_ALPHATEST
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_TECHNIQUE_ON
+    &MagicEmitterInstance::SetRenderNothing,    // MAGIC_RENDER_STATE_TECHNIQUE_OFF
+};
+
+void MagicEmitterInstance::SetRenderState(MAGIC_RENDER_STATE* state)
+{
+    MP_ASSERT(state->state != MAGIC_RENDER_STATE__ERROR || state->state != MAGIC_RENDER_STATE__MAX);
+
+    // use a pointer to function to call the right state.
+    (this->*_stateFuncPointer[state->state])(state);
+}
+
+Material* MagicEmitterInstance::GetRenderMaterial(int material)
+{
+    MP_TIMELINE_SCOPE("GetRenderMaterial", _emitter);
+
+    bool newMaterial;
+
+    // get material from magic material index and texture hash value
+    Material* mat = _effect->GetMaterial(material, _stateHashKey, newMaterial);
+    MP_ASSERT(mat);
+
+    // Assign textures and states to material if new one has been created.
+    if(newMaterial)
+    {
+        ++_materialsCreated;
+
+        // Textures.
+        for (unsigned i=0; i<MAX_TEX_STAGE; i++)
+        {
+            const TEX_STAGE* s=&(stages[i]);
+            if(s->uTexture != 0)
+            {
+                // check if uv address mode have been set for this texture
+                MP_ASSERT(s->address_u != MAX_ADDRESSMODES);
+                MP_ASSERT(s->address_v != MAX_ADDRESSMODES);
+
+                // assign adress coord mode
+                s->uTexture->SetAddressMode(COORD_U, s->address_u);
+                s->uTexture->SetAddressMode(COORD_V, s->address_v);
+
+                // assign textures
+                mat->SetTexture(TextureUnit(i), s->uTexture);
+            }
+        }
+
+        Pass* pass = mat->GetPass(0, "alpha");
+
+        // Blending.
+        MP_ASSERT(STATE_BLENDING != MAX_BLENDMODES);
+        pass->SetBlendMode(STATE_BLENDING);
+
+        // Depth write.
+        pass->SetDepthWrite(STATE_ZWRITE);
+    }
+
+    return mat;
+}
+
+}
@@ -0,0 +1,432 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+#include "Magic.h"
+#include "MagicParticleStats.h"
+#include "MagicParticleEffect.h"
+
+namespace Urho3D
+{
+
+class MagicParticleEffect;
+class MagicParticleEventStream;
+class MagicParticleArena;
+
+/// structure for description of one array of attribute.
+struct MP_ARRAY_INFO : public MAGIC_ARRAY_INFO
+{
+    int stage;
+    void* buffer;
+    int offset;
+    int stride;
+};
+
+/// Base buffer structure for vertex and index buffers.
+struct MP_BUFFER
+{
+    int max_length;
+    int length;
+
+    MP_BUFFER();
+    virtual ~MP_BUFFER();
+
+    virtual void SetLength(int new_length);
+    /// Reallocate to a smaller capacity, contents are lost. Nothing is done if capacity is already below.
+    void Shrink(int new_max_length);
+    virtual void Create(int new_length);
+    virtual void Destroy();
+    virtual void* Map(int stride) { return nullptr; }
+    /// Return bytes owned by the buffer.
+    virtual int GetCapacity() const { return max_length; }
+    /// Return true if contents were recycled since set (frame arena).
+    virtual bool IsExpired() const { return false; }
+};
+
+/// GPU geometry of an emitter instance for one view.
+struct MP_VIEW_GEOMETRY
+{
+    /// Vertex buffer.
+    SharedPtr<VertexBuffer> vertexBuffer;
+    /// Index buffer, always 16 bits.
+    SharedPtr<IndexBuffer> indexBuffer;
+    /// Vertex buffers of the next vertex chunks, when the fill does not fit 16 bits indices.
+    Vector<SharedPtr<VertexBuffer> > chunkVertexBuffers;
+    /// Geometries of draw batches.
+    Vector<SharedPtr<Geometry> > geometries;
+    /// Materials of draw batches.
+    Vector<SharedPtr<Material> > materials;
+    /// Number of uploaded draw batches.
+    unsigned numBatches;
+    /// Particles of uploaded geometry.
+    unsigned particles;
+    /// Simulation version of uploaded geometry.
+    unsigned fillVersion;
+    /// Camera of uploaded geometry.
+    MAGIC_CAMERA fillCamera;
+    /// Uploaded geometry is known to match fill version and camera.
+    bool fillKeyed;
+
+    MP_VIEW_GEOMETRY() : numBatches(0), particles(0), fillVersion(0), fillKeyed(false) { }
+};
+
+/// Buffer data for vertex and index buffers.
+struct MP_BUFFER_RAM : public MP_BUFFER
+{
+    char* buffer;
+
+    MP_BUFFER_RAM();
+    virtual ~MP_BUFFER_RAM();
+
+    virtual void Create(int new_length);
+    virtual void Destroy();
+    virtual void* Map(int stride) { return buffer; }
+};
+
+/// Buffer data sub-allocated from the frame arena at each fill, own memory when the arena is disabled or full.
+struct MP_BUFFER_ARENA : public MP_BUFFER_RAM
+{
+    MagicParticleArena* arena;
+    char* owned;
+    int owned_length;
+    unsigned frame;
+
+    MP_BUFFER_ARENA(MagicParticleArena* frame_arena);
+    virtual ~MP_BUFFER_ARENA();
+
+    virtual void SetLength(int new_length);
+    virtual void Create(int new_length);
+    virtual void Destroy();
+    virtual int GetCapacity() const { return owned_length; }
+    virtual bool IsExpired() const;
+};
+
+
+
+///-------------------------------------------------------------------------------------------------
+/// Pooled instance of a Magic emitter template.
+/// Holds a duplicated emitter together with the CPU and GPU buffers used to render it,
+/// so that spawning and despawning an emitter only resets state instead of reallocating.
+/// Also fills render arrays and translates Magic render states to Urho materials, so it can be
+/// drawn by any drawable (MagicParticleEmitter component or MagicParticleSystem one-shots).
+///-------------------------------------------------------------------------------------------------
+class MagicEmitterInstance
+{
+public:
+    /// Construct. Duplicate the emitter template at index and create its buffers.
+    MagicEmitterInstance(MagicParticleEffect* effect, int index);
+    /// Destruct. Unload the duplicated emitter.
+    ~MagicEmitterInstance();
+
+    /// Reset emitter state before the instance goes back to the pool.
+    void Reset();
+    /// Restart emitter. Emitters starting at interval 1 are placed at position and prewarmed.
+    void Restart(const MAGIC_POSITION& position);
+    /// Stop emitter and clear filled geometry. GPU geometry of views is kept.
+    void Stop();
+    /// Place and play emitter once as a one-shot, particles do not follow the emitter.
+    void Spawn(const MAGIC_POSITION& position, const MAGIC_DIRECTION& direction);
+    /// Set emitter position, direction if not null, and scale.
+    void SetTransform(const MAGIC_POSITION& position, const MAGIC_DIRECTION* direction, float scale);
+    /// Update emitter simulation (time in milliseconds), in fixed sub-steps if the effect uses a fixed time step. Return false when the emitter has finished.
+    bool Update(double time);
+    /// Fill render arrays and collect draw batches for current Magic camera, pushed from camera if known. Return number of batches.
+    unsigned Fill(const MAGIC_CAMERA* camera = nullptr);
+    /// Fill render arrays and collect render states of draw batches, without touching Urho objects. Camera pushed for the fill is
+    /// recorded if known, so unchanged refills can be skipped. Return number of batches.
+    unsigned FillArrays(const MAGIC_CAMERA* camera = nullptr);
+    /// Return true if geometry uploaded or merged for view was filled since last change of the emitter, from a camera within refill
+    /// distance and angle of this one unless the emitter has no camera facing particles, and its GPU buffers kept their data.
+    bool IsFillCurrent(unsigned view, const MAGIC_CAMERA& camera) const;
+    /// Return true, and count a skipped fill, if geometry of view is current (see IsFillCurrent) : it can be drawn again without fill nor upload.
+    bool SkipFill(unsigned view, const MAGIC_CAMERA& camera);
+    /// Record filled geometry as merged into shared buffers of a view, so that an unchanged refill of the view can be skipped.
+    void MarkMerged(unsigned view);
+    /// Translate collected render states to materials. Main thread only.
+    void ResolveMaterials();
+    /// Upload filled vertices and indices to GPU buffers of a view and set its geometries draw ranges. Return true if successful.
+    bool Upload(unsigned view = 0);
+    /// Keep filled geometry for a view until it is presented, the fill buffers are exchanged, not copied.
+    void StoreFill(unsigned view);
+    /// Translate materials and upload geometry stored for a view. Main thread only. Return false if nothing was stored.
+    bool Present(unsigned view);
+    /// Make geometry stored for a view the filled geometry and translate its materials, without upload. Main thread only. Return false if nothing was stored.
+    bool TakeFill(unsigned view);
+    /// Clear rendering infos.
+    void ClearRendering();
+    /// Clear GPU geometry of all views. Main thread only.
+    void ClearViews();
+    /// Apply particles sorting mode before update, camera distance is used by MP_SORT_AUTO.
+    void ApplySorting(MP_SORT_MODE mode, float distance);
+    /// Set ID of the node owning the instance, reported with its particle events. Reset clears it.
+    void SetOwnerID(unsigned id) { _ownerID = id; }
+    /// Release CPU buffers above the peak filled since last trim and unused GPU buffers, or all buffers and views of a pooled instance. Main thread only, no fill running.
+    void Trim(bool all);
+    /// Map vertex and index buffers to the lengths of Magic render arrays, as a fill does.
+    void MapBuffers(MAGIC_ARRAY_INFO* vertex_info, MAGIC_ARRAY_INFO* index_info);
+    /// Reset render states and apply a sequence of count Magic render states, as a fill does before a draw batch. Return the state hash key.
+    unsigned ApplyRenderStates(MAGIC_RENDER_STATE* states, unsigned count);
+
+    /// Return emitter template index.
+    int GetIndex() const { return _index; }
+    /// Return duplicated emitter.
+    HM_EMITTER GetEmitter() const { return _emitter; }
+    /// Return buffer data for vertices.
+    MP_BUFFER* GetVertexData() const { return _vertexData; }
+    /// Return buffer data for indices.
+    MP_BUFFER* GetIndexData() const { return _indexData; }
+    /// Return number of views having GPU geometry.
+    unsigned GetNumViews() const { return _views.Size(); }
+    /// Return vertex buffer of view.
+    VertexBuffer* GetVertexBuffer(unsigned view = 0) const { return view < _views.Size() ? _views[view].vertexBuffer : 0; }
+    /// Return index buffer of view.
+    IndexBuffer* GetIndexBuffer(unsigned view = 0) const { return view < _views.Size() ? _views[view].indexBuffer : 0; }
+    /// Return local bounding box computed at last update.
+    const BoundingBox& GetBoundingBox() const { return _boundingBox; }
+    /// Return counters of the current frame (reset on update).
+    const MP_COUNTERS& GetCounters() const { return _counters; }
+    /// Return number of simulation steps done at last update.
+    unsigned GetNumSteps() const { return _numSteps; }
+    /// Return number of draw batches uploaded for view.
+    unsigned GetNumBatches(unsigned view = 0) const { return view < _views.Size() ? _views[view].numBatches : 0; }
+    /// Return geometry of draw batch of view.
+    Geometry* GetBatchGeometry(unsigned i, unsigned view = 0) const { return _views[view].geometries[i]; }
+    /// Return material of draw batch of view.
+    Material* GetBatchMaterial(unsigned i, unsigned view = 0) const { return _views[view].materials[i]; }
+    /// Return the number of the drawing particles.
+    int GetParticlesCount() const { return _renderingStart.particles; }
+    /// Return current particles sorting mode.
+    MAGIC_SORT_ENUM GetSortMode() const { return _sortMode; }
+    /// Return false once last update has finished the emitter.
+    bool IsAlive() const { return _alive; }
+    /// Return ID of the node owning the instance.
+    unsigned GetOwnerID() const { return _ownerID; }
+    /// Return memory used by CPU render arrays, stored fills and GPU buffers of views.
+    MP_MEMORY GetMemoryUse() const;
+    /// Return number of draw batches of filled geometry.
+    unsigned GetNumFillBatches() const { return _drawBatches.Size(); }
+    /// Return draw batch of filled geometry.
+    const MAGIC_RENDER_VERTICES& GetFillBatch(unsigned i) const { return _drawBatches[i]; }
+    /// Return material of draw batch of filled geometry, once resolved.
+    Material* GetFillMaterial(unsigned i) const { return _materials[i]; }
+    /// Return vertex elements of filled geometry.
+    const PODVector<VertexElement>& GetFillVertexElements() const { return _vertexElements; }
+    /// Return number of vertices of filled geometry.
+    unsigned GetFillVertexCount() const { return _renderingStart.vertices; }
+    /// Return whether indices of filled geometry are 32 bits.
+    bool IsFillIndex32() const { return _fillIndex32; }
+
+private:
+    /// Save attributes rendering.
+    void SaveAttributes(MAGIC_RENDERING_START* start);
+
+    /// Run simulation steps and compute bounding box.
+    bool Simulate(double time);
+    /// Add counters to instance and global stats.
+    void AddCounters(const MP_COUNTERS& counters);
+    /// Reset all states.
+    void ResetStates();
+    /// Set render state.
+    void SetRenderState(MAGIC_RENDER_STATE* state);
+    /// Fake state.
+    void SetRenderNothing(MAGIC_RENDER_STATE* s);
+    /// Texture state.
+    void SetRenderTexture(MAGIC_RENDER_STATE* s);
+    /// Blending state.
+    void SetRenderBlending(MAGIC_RENDER_STATE* s);
+    /// Texture coord adresse mode.
+    void SetRenderAddressU(MAGIC_RENDER_STATE* s);
+    /// Texture coord adresse mode.
+    void SetRenderAddressV(MAGIC_RENDER_STATE* s);
+    /// Enable/Disable Depth write.
+    void SetRenderZWrite(MAGIC_RENDER_STATE* s);
+    /// Clear filled geometry.
+    void ClearFill();
+    /// Return sorting mode to apply.
+    MAGIC_SORT_ENUM GetSortMode(MP_SORT_MODE mode, float distance) const;
+
+    /// Owner effect.
+    MagicParticleEffect* _effect;
+    /// Emitter template index.
+    int _index;
+    /// Duplicated emitter.
+    HM_EMITTER _emitter;
+    /// Buffer data for vertices.
+    MP_BUFFER* _vertexData;
+    /// Buffer data for indices.
+    MP_BUFFER* _indexData;
+    /// GPU geometry per view.
+    Vector<MP_VIEW_GEOMETRY> _views;
+    /// Materials of draw batches collected at last fill.
+    Vector<SharedPtr<Material> > _materials;
+    /// Vertex elements used to define vertex format.
+    PODVector<VertexElement> _vertexElements;
+    /// Batch indices to render.
+    PODVector<MAGIC_RENDER_VERTICES> _drawBatches;
+    /// Array info for vertex and index buffers.
+    MP_ARRAY_INFO _m_array_info[2];
+    /// Rendering infos.
+    MAGIC_RENDERING_START _renderingStart;
+    /// Local bounding box.
+    BoundingBox _boundingBox;
+    /// Simulation time not yet consumed by fixed steps (milliseconds).
+    double _timeAccumulator;
+    /// Number of simulation steps done at last update.
+    unsigned _numSteps;
+    /// Graphics subsystem pointer.
+    Graphics* _graphics;
+    /// Global stats subsystem pointer.
+    MagicParticleStats* _stats;
+    /// Particle events subsystem pointer.
+    MagicParticleEventStream* _events;
+    /// Frame arena subsystem pointer.
+    MagicParticleArena* _arena;
+    /// Counters of the current frame.
+    MP_COUNTERS _counters;
+    /// Materials created during current fill.
+    unsigned _materialsCreated;
+    /// Sorting mode of emitter template.
+    MAGIC_SORT_ENUM _templateSortMode;
+    /// Current sorting mode.
+    MAGIC_SORT_ENUM _sortMode;
+    /// Magic blendings used by last filled batches, one bit per MAGIC_BLENDING value, 0 if never filled.
+    unsigned _blendMask;
+    /// Magic blendings used during current fill.
+    unsigned _fillBlendMask;
+    /// Emitter not finished at last update.
+    bool _alive;
+    /// ID of owner node.
+    unsigned _ownerID;
+    /// Simulation version, changes when the emitter advances, restarts, moves or changes sorting.
+    unsigned _version;
+    /// Emitter position set by last transform.
+    MAGIC_POSITION _position;
+    /// Emitter direction set by last transform.
+    MAGIC_DIRECTION _direction;
+    /// Emitter scale set by last transform.
+    float _scale;
+    /// Simulation version of filled geometry.
+    unsigned _fillVersion;
+    /// Camera of filled geometry.
+    MAGIC_CAMERA _fillCamera;
+    /// Camera of filled geometry is known.
+    bool _fillKeyed;
+
+    /// Define pointer to function type for render state pointer to functions.
+    typedef void (MagicEmitterInstance::*StateFuncPtr)(MAGIC_RENDER_STATE* s);
+    /// Array of pointers to functions to collect render states.
+    static StateFuncPtr _stateFuncPointer[];
+
+    /// Texture state structure.
+    struct TEX_STAGE
+    {
+        /// Texture adress mode.
+        TextureAddressMode address_u, address_v;
+        /// Pointer to texture.
+        Texture2D* uTexture;
+    };
+
+    /// Max textures per stage.
+    static const unsigned int MAX_TEX_STAGE = 16;
+    /// Array of texture stage.
+    TEX_STAGE stages[MAX_TEX_STAGE];
+    /// Blending state.
+    BlendMode STATE_BLENDING;
+    /// Render state hash key used to identify states.
+    unsigned _stateHashKey;
+
+    bool STATE_ZWRITE;
+
+    /// Render states of a draw batch, translated to a material on main thread.
+    struct BATCH_STATE
+    {
+        /// Magic material index.
+        int material;
+        /// Key of the render state sequence since fill start and of the material index.
+        unsigned long long stateKey;
+        /// End of the batch render states in the render states of the fill.
+        unsigned stateEnd;
+    };
+
+    /// Filled geometry of a view waiting to be presented.
+    struct STORED_FILL
+    {
+        /// Buffer data for vertices.
+        MP_BUFFER* vertexData;
+        /// Buffer data for indices.
+        MP_BUFFER* indexData;
+        /// Vertex elements.
+        PODVector<VertexElement> vertexElements;
+        /// Batch indices to render.
+        PODVector<MAGIC_RENDER_VERTICES> drawBatches;
+        /// Render states of draw batches.
+        PODVector<BATCH_STATE> batchStates;
+        /// Magic render states drained during the fill.
+        PODVector<MAGIC_RENDER_STATE> renderStates;
+        /// Rendering infos.
+        MAGIC_RENDERING_START renderingStart;
+        /// Simulation version.
+        unsigned version;
+        /// Camera of the fill.
+        MAGIC_CAMERA camera;
+        /// Camera of the fill is known.
+        bool keyed;
+        /// Indices are 32 bits.
+        bool index32;
+        /// Filled since last presented.
+        bool stored;
+
+        STORED_FILL() : vertexData(nullptr), indexData(nullptr), version(0), keyed(false), index32(false), stored(false) { }
+    };
+
+    /// Vertex range addressed by 16 bits indices.
+    struct VERTEX_CHUNK
+    {
+        /// First vertex.
+        unsigned vertexStart;
+        /// Vertex after the last one.
+        unsigned vertexEnd;
+    };
+
+    /// Part of a draw batch within one vertex chunk.
+    struct DRAW_RANGE
+    {
+        /// Draw batch.
+        unsigned batch;
+        /// Vertex chunk.
+        unsigned chunk;
+        /// First index in 16 bits index data.
+        unsigned indexStart;
+        /// Number of indices.
+        unsigned indexCount;
+    };
+
+    /// Get material of Magic material index from current render states.
+    Material* GetRenderMaterial(int material);
+    /// Exchange filled geometry with a stored fill.
+    void SwapFill(STORED_FILL& fill);
+    /// Rebase 32 bits indices of filled draw batches into 16 bits vertex chunks.
+    void SplitChunks();
+
+    /// Render states of draw batches collected at last fill.
+    PODVector<BATCH_STATE> _batchStates;
+    /// Magic render states drained at last fill, translated only when their sequence is not cached.
+    PODVector<MAGIC_RENDER_STATE> _renderStates;
+    /// Filled geometry per view waiting to be presented.
+    Vector<STORED_FILL> _storedFills;
+    /// Magic fills 32 bits indices, chosen from vertex count of previous fills.
+    bool _index32;
+    /// Indices of filled geometry are 32 bits.
+    bool _fillIndex32;
+    /// Rebased 16 bits indices of a split fill.
+    PODVector<unsigned short> _chunkIndices;
+    /// Vertex chunks of a split fill.
+    PODVector<VERTEX_CHUNK> _chunks;
+    /// Draw ranges of a split fill.
+    PODVector<DRAW_RANGE> _drawRanges;
+    /// Largest vertex data filled since last trim, in bytes.
+    int _peakVertexLength;
+    /// Largest index data filled since last trim, in bytes.
+    int _peakIndexLength;
+};
+
+}
@@ -0,0 +1,160 @@
+#include "MagicParticleArena.h"
+#include "MagicParticleSimulation.h"
+#include <Urho3D/Urho3DAll.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace Urho3D
+{
+
+/// Alignment of allocations, enough for SIMD copies of vertices.
+static const unsigned ARENA_ALIGNMENT = 16;
+/// Blocks are sized in multiples of a huge page.
+static const unsigned ARENA_GRANULARITY = 2 * 1024 * 1024;
+
+MagicParticleArena::MagicParticleArena(Context* context) :
+    Object(context)
+    , _current(0)
+    , _frame(0)
+    , _framePeak(0)
+    , _numOverflows(0)
+    , _enabled(false)
+{
+    for (unsigned i = 0; i < 2; ++i)
+    {
+        _blocks[i].memory = nullptr;
+        _blocks[i].capacity = 0;
+        _blocks[i].used = 0;
+    }
+}
+
+MagicParticleArena::~MagicParticleArena()
+{
+    SetEnabled(false);
+}
+
+void MagicParticleArena::SetEnabled(bool enable)
+{
+    if (enable == _enabled)
+        return;
+
+    // blocks may be read by pipelined fills
+    MagicParticleSimulation* simulation = GetSubsystem<MagicParticleSimulation>();
+    if (simulation)
+        simulation->Wait();
+
+    _enabled = enable;
+
+    if (enable)
+    {
+        SubscribeToEvent(E_BEGINFRAME, URHO3D_HANDLER(MagicParticleArena, HandleBeginFrame));
+        return;
+    }
+
+    UnsubscribeFromEvent(E_BEGINFRAME);
+
+    // buffers still pointing to the blocks are expired by the frame counter
+    for (unsigned i = 0; i < 2; ++i)
+    {
+        FreeBlock(_blocks[i].memory, _blocks[i].capacity);
+        _blocks[i].memory = nullptr;
+        _blocks[i].capacity = 0;
+        _blocks[i].used = 0;
+    }
+    _frame += 2;
+}
+
+void* MagicParticleArena::Allocate(unsigned size)
+{
+    if (!_enabled)
+        return nullptr;
+
+    ARENA_BLOCK& block = _blocks[_current];
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    unsigned offset = block.used.fetch_add(size, std::memory_order_relaxed);
+    if (offset + size > block.capacity)
+    {
+        _numOverflows.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    return block.memory + offset;
+}
+
+void MagicParticleArena::NextFrame()
+{
+    _framePeak = _blocks[_current].used.load(std::memory_order_relaxed);
+    _current ^= 1;
+    ++_frame;
+
+    // block of two frames ago : its fills have been uploaded
+    ARENA_BLOCK& block = _blocks[_current];
+    unsigned peak = Max(_framePeak, block.used.load(std::memory_order_relaxed));
+    if (peak > block.capacity)
+    {
+        unsigned capacity = (peak + peak / 4 + ARENA_GRANULARITY - 1) / ARENA_GRANULARITY * ARENA_GRANULARITY;
+        FreeBlock(block.memory, block.capacity);
+        block.memory = AllocateBlock(capacity);
+        block.capacity = block.memory ? capacity : 0;
+
+        if (!block.memory)
+            URHO3D_LOGERROR("Could not allocate particle frame arena of " + String(capacity) + " bytes");
+    }
+
+    block.used.store(0, std::memory_order_relaxed);
+}
+
+void MagicParticleArena::HandleBeginFrame(StringHash eventType, VariantMap& eventData)
+{
+    // fills of the pipelined job started at last post update
+    MagicParticleSimulation* simulation = GetSubsystem<MagicParticleSimulation>();
+    if (simulation)
+        simulation->Wait();
+
+    NextFrame();
+}
+
+unsigned char* MagicParticleArena::AllocateBlock(unsigned size)
+{
+#if defined(_WIN32)
+    // large pages need the lock pages privilege, fall back to regular pages
+    SIZE_T largePage = GetLargePageMinimum();
+    void* memory = nullptr;
+    if (largePage && size % largePage == 0)
+        memory = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (!memory)
+        memory = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    return (unsigned char*)memory;
+#elif defined(__linux__)
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return nullptr;
+#ifdef MADV_HUGEPAGE
+    madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    return (unsigned char*)memory;
+#else
+    return new unsigned char[size];
+#endif
+}
+
+void MagicParticleArena::FreeBlock(unsigned char* memory, unsigned size)
+{
+    if (!memory)
+        return;
+
+#if defined(_WIN32)
+    VirtualFree(memory, 0, MEM_RELEASE);
+#elif defined(__linux__)
+    munmap(memory, size);
+#else
+    delete[] memory;
+#endif
+}
+
+}
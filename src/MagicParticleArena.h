@@ -0,0 +1,81 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+
+#include <atomic>
+
+namespace Urho3D
+{
+
+///-------------------------------------------------------------------------------------------------
+/// Frame arena for the CPU staging buffers of emitter instances (disabled by default).
+/// Render arrays are only read between their fill and their upload, which happens in the same
+/// frame, or at next update when the simulation is pipelined. The arena has two blocks used by
+/// alternate frames : a block is reset at frame begin, one frame after its last allocations.
+/// Allocation is a lock-free bump of an offset, so concurrent fills on worker threads share it.
+/// Fills not fitting the block use the buffer own memory, and the block grows to the frame peak
+/// at its next reset. Total staging memory is the peak of a frame instead of the sum of every
+/// emitter peak. Blocks ask for transparent huge pages on Linux and large pages on Windows.
+///-------------------------------------------------------------------------------------------------
+class URHO3D_API MagicParticleArena : public Object
+{
+    URHO3D_OBJECT(MagicParticleArena, Object)
+
+public:
+    /// Construct.
+    MagicParticleArena(Context* context);
+    /// Destruct. Free blocks.
+    virtual ~MagicParticleArena();
+
+    /// Enable or disable allocations from the arena. Blocks are freed when disabled.
+    void SetEnabled(bool enable);
+    /// Return whether allocations come from the arena.
+    bool IsEnabled() const { return _enabled; }
+    /// Allocate bytes from the block of current frame. Thread-safe. Return null if disabled or the block is full.
+    void* Allocate(unsigned size);
+    /// Switch to the block of next frame and reset it, growing it to its last peak. Called at frame begin.
+    void NextFrame();
+
+    /// Return arena frame counter, incremented by NextFrame.
+    unsigned GetFrame() const { return _frame; }
+    /// Return capacity of both blocks in bytes.
+    unsigned long long GetCapacity() const { return (unsigned long long)_blocks[0].capacity + _blocks[1].capacity; }
+    /// Return bytes requested during last frame, overflowed ones included.
+    unsigned GetFramePeak() const { return _framePeak; }
+    /// Return number of allocations that did not fit their block since start.
+    unsigned GetNumOverflows() const { return _numOverflows.load(std::memory_order_relaxed); }
+
+private:
+    /// Handle frame begin : wait for pipelined fills and switch blocks.
+    void HandleBeginFrame(StringHash eventType, VariantMap& eventData);
+    /// Allocate memory of a block, with huge pages if possible.
+    static unsigned char* AllocateBlock(unsigned size);
+    /// Free memory of a block.
+    static void FreeBlock(unsigned char* memory, unsigned size);
+
+    /// Memory block of a frame.
+    struct ARENA_BLOCK
+    {
+        /// Memory.
+        unsigned char* memory;
+        /// Capacity in bytes.
+        unsigned capacity;
+        /// Bytes requested since reset, may exceed capacity.
+        std::atomic<unsigned> used;
+    };
+
+    /// Blocks of alternate frames.
+    ARENA_BLOCK _blocks[2];
+    /// Block of current frame.
+    unsigned _current;
+    /// Frame counter.
+    unsigned _frame;
+    /// Bytes requested during last frame.
+    unsigned _framePeak;
+    /// Allocations that did not fit their block.
+    std::atomic<unsigned> _numOverflows;
+    /// Enabled flag.
+    bool _enabled;
+};
+
+}
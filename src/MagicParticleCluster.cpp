@@ -0,0 +1,403 @@
+#include "MagicParticleCluster.h"
+#include "MagicParticleUtils.h"
+#include "MagicParticleTimeline.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+extern const char* GEOMETRY_CATEGORY;
+
+MagicParticleCluster::MagicParticleCluster(Context* context) :
+    Drawable(context, DRAWABLE_GEOMETRY)
+{
+    _simulation = GetSubsystem<MagicParticleSimulation>();
+    _stats = GetSubsystem<MagicParticleStats>();
+}
+
+MagicParticleCluster::~MagicParticleCluster()
+{
+    ClearEmitters();
+}
+
+void MagicParticleCluster::RegisterObject(Context* context)
+{
+    context->RegisterFactory<MagicParticleCluster>(GEOMETRY_CATEGORY);
+
+    URHO3D_COPY_BASE_ATTRIBUTES(Drawable);
+}
+
+void MagicParticleCluster::OnSceneSet(Scene* scene)
+{
+    Drawable::OnSceneSet(scene);
+
+    if (scene)
+        SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(MagicParticleCluster, HandleUpdate));
+    else
+        UnsubscribeFromEvent(E_UPDATE);
+}
+
+void MagicParticleCluster::OnWorldBoundingBoxUpdate()
+{
+    worldBoundingBox_ = boundingBox_;
+}
+
+void MagicParticleCluster::UpdateBatches(const FrameInfo& frame)
+{
+    distance_ = frame.camera_->GetDistance(GetWorldBoundingBox().Center());
+
+    batches_.Clear();
+
+    if (frame.camera_->GetFrustum().IsInsideFast(GetWorldBoundingBox()) == OUTSIDE)
+        return;
+
+    // geometry of this view was merged at update, from its camera of previous frame
+    unsigned slot = _views.Add(frame.camera_, frame.frameNumber_, distance_);
+
+    if (!_views.IsFilled(slot) || slot >= _geometries.Size())
+        return;
+
+    _geometries[slot].GetBatches(batches_, frame.camera_, slot);
+}
+
+void MagicParticleCluster::DrawDebugGeometry(DebugRenderer* debug, bool depthTest)
+{
+    if (debug && IsEnabledEffective())
+    {
+        for (unsigned i = 0; i < _members.Size(); ++i)
+            debug->AddBoundingBox(_members[i].instance->GetBoundingBox(), Color::GRAY, depthTest);
+
+        debug->AddBoundingBox(worldBoundingBox_, Color::CYAN, depthTest);
+    }
+}
+
+int MagicParticleCluster::AddEmitter(MagicParticleEffect* effect, int emitterIndex, const Vector3& position, const Quaternion& rotation)
+{
+    if (!effect || emitterIndex < 0)
+        return -1;
+
+    MagicEmitterInstance* instance = effect->AcquireInstance(emitterIndex);
+    if (!instance)
+        return -1;
+
+    instance->SetOwnerID(node_ ? node_->GetID() : 0);
+
+    // members never move : placed once, then restarted (prewarmed at their position)
+    MP_SIM_COMMAND transform(MP_SIM_TRANSFORM, instance);
+    transform.position = Urho3DToMagic(position);
+    transform.direction = Urho3DToMagic(rotation);
+    transform.flag = true;
+    transform.value = 1.0f;
+
+    MP_SIM_COMMAND restart(MP_SIM_RESTART, instance);
+    restart.position = transform.position;
+
+    if (_simulation)
+    {
+        _simulation->Post(transform);
+        _simulation->Post(restart);
+    }
+    else
+    {
+        MagicParticleSimulation::Execute(transform);
+        MagicParticleSimulation::Execute(restart);
+    }
+
+    CLUSTER_MEMBER member;
+    member.effect = effect;
+    member.instance = instance;
+    member.position = position;
+    member.distance = 0.0f;
+    member.filled = false;
+    _members.Push(member);
+    _order.Clear();
+
+    if (!_effects.Contains(SharedPtr<MagicParticleEffect>(effect)))
+        _effects.Push(SharedPtr<MagicParticleEffect>(effect));
+
+    // cluster must be in the octree to be seen, and simulated, before its particles exist
+    boundingBox_.Merge(position);
+    if (node_)
+        OnMarkedDirty(node_);
+
+    return _members.Size() - 1;
+}
+
+void MagicParticleCluster::RemoveEmitter(unsigned index)
+{
+    if (index >= _members.Size())
+        return;
+
+    MagicEmitterInstance* instance = _members[index].instance;
+    MagicParticleEffect* effect = _members[index].effect;
+
+    // released instance must not be drawn anymore
+    for (unsigned i = 0; i < _geometries.Size(); ++i)
+        _geometries[i].RemoveInstance(instance);
+    batches_.Clear();
+
+    effect->ReleaseInstance(instance);
+    _members.EraseSwap(index);
+    _order.Clear();
+
+    // effect is kept alive while a member uses it
+    for (unsigned i = 0; i < _members.Size(); ++i)
+    {
+        if (_members[i].effect == effect)
+            return;
+    }
+    _effects.Remove(SharedPtr<MagicParticleEffect>(effect));
+}
+
+void MagicParticleCluster::ClearEmitters()
+{
+    for (unsigned i = 0; i < _members.Size(); ++i)
+        _members[i].effect->ReleaseInstance(_members[i].instance);
+
+    _members.Clear();
+    _order.Clear();
+    _effects.Clear();
+    _geometries.Clear();
+    _views.Clear();
+    batches_.Clear();
+    boundingBox_.Clear();
+}
+
+int MagicParticleCluster::GetParticlesCount() const
+{
+    int count = 0;
+    for (unsigned i = 0; i < _members.Size(); ++i)
+        count += _members[i].instance->GetParticlesCount();
+    return count;
+}
+
+void MagicParticleCluster::HandleUpdate(StringHash eventType, VariantMap& eventData)
+{
+    if (_members.Empty())
+        return;
+
+    URHO3D_PROFILE(UpdateMagicCluster);
+
+    using namespace Update;
+    double time = 1000.0 * eventData[P_TIMESTEP].GetFloat();
+
+    // views that rendered the cluster in previous frame
+    unsigned frameNumber = GetSubsystem<Time>()->GetFrameNumber();
+    unsigned nearest = _views.GetNearest(frameNumber);
+    bool visible = nearest != MagicViewList::NO_VIEW;
+    bool pipelined = _simulation && _simulation->IsPipelined();
+
+    // pipelined : present results of last simulation job
+    if (pipelined)
+        PresentPipelined();
+
+    // occluded clusters are simulated without fill, clusters out of view are frozen
+    bool occluded = !visible && _views.IsOccluded(this, frameNumber);
+    bool hidden = _simulation && _simulation->IsSimulateHidden();
+    if (!visible && !occluded && !hidden)
+        return;
+
+    if (occluded && _stats)
+    {
+        MP_COUNTERS counters;
+        counters.occluded = _members.Size();
+        _stats->Add(counters);
+    }
+
+    if (visible)
+        SortMembers(_views.GetCameraPosition(nearest));
+
+    if (pipelined)
+    {
+        PostPipelined(time, frameNumber, nearest, visible);
+        return;
+    }
+
+    // simulate all members in one loop, once for all views from the nearest camera
+    if (visible)
+        _views.SetMagicCamera(nearest);
+
+    for (unsigned i = 0; i < _members.Size(); ++i)
+    {
+        MagicEmitterInstance* instance = _members[i].instance;
+        instance->ApplySorting(MP_SORT_AUTO, _members[i].distance);
+        instance->Update(time);
+    }
+
+    // update octree placement when members grew or shrank
+    if (UpdateMembers())
+        OnMarkedDirty(node_);
+
+    // fill members and merge their geometry for each view, batches are set in UpdateBatches
+
+    if (visible)
+    {
+        bool ordered = _order.Size() == _members.Size();
+        _mergeOrder.Resize(_members.Size());
+        for (unsigned k = 0; k < _members.Size(); ++k)
+            _mergeOrder[k] = _members[ordered ? _order[k] : k].instance;
+    }
+
+    for (unsigned v = 0; visible && v < _views.Size(); ++v)
+    {
+        MAGIC_CAMERA camera;
+        if (!_views.IsActive(v, frameNumber) || !_views.GetMagicCamera(v, camera))
+            continue;
+
+        // no member advanced nor came or left, camera did not move : merged geometry is kept
+        if (v < _geometries.Size() && _geometries[v].SkipMerge(v, camera, _mergeOrder))
+        {
+            _views.SetFilled(v);
+            continue;
+        }
+
+        // pushed for every view : an earlier view may have replaced the camera of the nearest one
+        Magic_SetCamera(&camera);
+
+        for (unsigned i = 0; i < _members.Size(); ++i)
+        {
+            _members[i].instance->Fill(&camera);
+            _members[i].filled = true;
+        }
+
+        Merge(v);
+        _views.SetFilled(v);
+    }
+}
+
+void MagicParticleCluster::PresentPipelined()
+{
+    if (UpdateMembers())
+        OnMarkedDirty(node_);
+
+    for (unsigned v = 0; v < _views.Size(); ++v)
+    {
+        bool presented = false;
+        for (unsigned i = 0; i < _members.Size(); ++i)
+        {
+            _members[i].filled = _members[i].instance->TakeFill(v);
+            presented |= _members[i].filled;
+        }
+
+        if (presented)
+        {
+            Merge(v);
+            _views.SetFilled(v);
+        }
+    }
+}
+
+void MagicParticleCluster::PostPipelined(double time, unsigned frameNumber, unsigned nearest, bool visible)
+{
+    // simulated after update, presented next frame
+    MP_SIM_COMMAND update(MP_SIM_UPDATE, nullptr);
+    update.time = time;
+    update.sortMode = MP_SORT_AUTO;
+    update.hasCamera = visible && _views.GetMagicCamera(nearest, update.camera);
+
+    for (unsigned i = 0; i < _members.Size(); ++i)
+    {
+        update.instance = _members[i].instance;
+        update.value = _members[i].distance;
+        _simulation->Post(update);
+        update.hasCamera = false;
+    }
+
+    for (unsigned v = 0; visible && v < _views.Size(); ++v)
+    {
+        if (!_views.IsActive(v, frameNumber))
+            continue;
+
+        MP_SIM_COMMAND fill(MP_SIM_FILL, nullptr);
+        fill.view = v;
+        fill.hasCamera = _views.GetMagicCamera(v, fill.camera);
+
+        for (unsigned i = 0; i < _members.Size(); ++i)
+        {
+            fill.instance = _members[i].instance;
+            _simulation->Post(fill);
+            fill.hasCamera = false;
+        }
+    }
+}
+
+bool MagicParticleCluster::UpdateMembers()
+{
+    BoundingBox box;
+
+    // retire finished members (non looping emitters), last one takes its place
+    for (unsigned i = 0; i < _members.Size();)
+    {
+        if (!_members[i].instance->IsAlive())
+        {
+            RemoveEmitter(i);
+            continue;
+        }
+
+        box.Merge(_members[i].instance->GetBoundingBox());
+        box.Merge(_members[i].position);
+        ++i;
+    }
+
+    if (box == boundingBox_)
+        return false;
+
+    boundingBox_ = box;
+    return true;
+}
+
+void MagicParticleCluster::SortMembers(const Vector3& cameraPosition)
+{
+    if (_order.Size() != _members.Size())
+    {
+        _order.Resize(_members.Size());
+        for (unsigned i = 0; i < _order.Size(); ++i)
+            _order[i] = i;
+    }
+
+    for (unsigned i = 0; i < _members.Size(); ++i)
+    {
+        const BoundingBox& box = _members[i].instance->GetBoundingBox();
+        _members[i].distance = ((box.Defined() ? box.Center() : _members[i].position) - cameraPosition).Length();
+    }
+
+    // back to front, order barely changes between frames : insertion sort is close to linear
+    for (unsigned i = 1; i < _order.Size(); ++i)
+    {
+        unsigned member = _order[i];
+        unsigned j = i;
+        for (; j > 0 && _members[_order[j - 1]].distance < _members[member].distance; --j)
+            _order[j] = _order[j - 1];
+        _order[j] = member;
+    }
+}
+
+void MagicParticleCluster::Merge(unsigned view)
+{
+    URHO3D_PROFILE(MagicClusterMerge);
+    MP_TIMELINE_SCOPE("ClusterMerge", 0);
+
+    if (view >= _geometries.Size())
+        _geometries.Resize(view + 1);
+
+    MagicMergedGeometry& geometry = _geometries[view];
+    geometry.Begin();
+
+    bool ordered = _order.Size() == _members.Size();
+
+    for (unsigned k = 0; k < _members.Size(); ++k)
+    {
+        CLUSTER_MEMBER& member = _members[ordered ? _order[k] : k];
+        if (!member.filled)
+            continue;
+
+        member.filled = false;
+
+        const BoundingBox& box = member.instance->GetBoundingBox();
+        geometry.Add(member.instance, view, box.Defined() ? box.Center() : member.position);
+    }
+
+    geometry.End(context_, _stats);
+}
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "MagicParticleEffect.h"
+#include "MagicEmitterInstance.h"
+#include "MagicParticleView.h"
+#include "MagicParticleSimulation.h"
+#include "MagicParticleMerge.h"
+#include "Magic.h"
+
+namespace Urho3D
+{
+
+///-------------------------------------------------------------------------------------------------
+/// Cluster of static Magic emitters sharing one drawable (torches, braziers, steam vents...).
+/// Create it on a node per spatial cell and add the emitters of the cell with their world
+/// placement, without any node, component or event subscription per emitter. The cluster is
+/// culled as a whole, its members are simulated in one loop from the nearest camera, and their
+/// filled geometry is merged back to front into shared buffers (see MagicMergedGeometry), so
+/// members alternating materials (flame and smoke) merge less.
+///-------------------------------------------------------------------------------------------------
+class URHO3D_API MagicParticleCluster : public Drawable
+{
+    URHO3D_OBJECT(MagicParticleCluster, Drawable)
+
+public:
+    /// Construct.
+    MagicParticleCluster(Context* context);
+    /// Destruct.
+    virtual ~MagicParticleCluster();
+    /// Register object factory.
+    static void RegisterObject(Context* context);
+
+    /// Calculate distance and prepare batches for rendering. May be called from worker thread(s), possibly re-entrantly.
+    virtual void UpdateBatches(const FrameInfo& frame);
+    /// Visualize the component as debug geometry.
+    virtual void DrawDebugGeometry(DebugRenderer* debug, bool depthTest);
+    /// Return whether a geometry update is necessary, and if it can happen in a worker thread.
+    virtual UpdateGeometryType GetUpdateGeometryType() { return UPDATE_NONE; }
+
+    /// Add a static emitter using emitter at index, placed in world space. Return its member index, -1 if failed.
+    int AddEmitter(MagicParticleEffect* effect, int emitterIndex, const Vector3& position, const Quaternion& rotation = Quaternion::IDENTITY);
+    /// Remove member at index, last member takes its place.
+    void RemoveEmitter(unsigned index);
+    /// Remove all members.
+    void ClearEmitters();
+    /// Return number of members.
+    unsigned GetNumEmitters() const { return _members.Size(); }
+    /// Return the number of the drawing particles of members.
+    int GetParticlesCount() const;
+
+private:
+    /// Handle scene being assigned.
+    virtual void OnSceneSet(Scene* scene);
+    /// Recalculate the world-space bounding box.
+    virtual void OnWorldBoundingBoxUpdate();
+    /// Handle members update, create and render geometries.
+    void HandleUpdate(StringHash eventType, VariantMap& eventData);
+    /// Present and merge results of last simulation job (pipelined mode).
+    void PresentPipelined();
+    /// Post simulation and fill of members (pipelined mode).
+    void PostPipelined(double time, unsigned frameNumber, unsigned nearest, bool visible);
+    /// Release finished members and merge their bounding boxes. Return true if the cluster box changed.
+    bool UpdateMembers();
+    /// Compute members distance to camera and back to front merge order.
+    void SortMembers(const Vector3& cameraPosition);
+    /// Merge filled geometry of members into shared buffers of a view and upload it.
+    void Merge(unsigned view);
+
+    /// Static emitter of the cluster.
+    struct CLUSTER_MEMBER
+    {
+        /// Effect owning the pooled instance.
+        MagicParticleEffect* effect;
+        /// Pooled emitter instance.
+        MagicEmitterInstance* instance;
+        /// World position.
+        Vector3 position;
+        /// Distance to nearest camera at last update.
+        float distance;
+        /// Geometry filled for the view being merged.
+        bool filled;
+    };
+
+    /// Members.
+    PODVector<CLUSTER_MEMBER> _members;
+    /// Member indices, back to front.
+    PODVector<unsigned> _order;
+    /// Effects referenced by members.
+    Vector<SharedPtr<MagicParticleEffect> > _effects;
+    /// Cameras rendering the cluster.
+    MagicViewList _views;
+    /// Instances of members in merge order, to skip unchanged merges.
+    PODVector<MagicEmitterInstance*> _mergeOrder;
+    /// Merged GPU geometry per view.
+    Vector<MagicMergedGeometry> _geometries;
+    /// Simulation subsystem.
+    MagicParticleSimulation* _simulation;
+    /// Global stats subsystem.
+    MagicParticleStats* _stats;
+};
+
+}
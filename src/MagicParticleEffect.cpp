@@ -1,4 +1,11 @@
 #include "MagicParticleEffect.h"
+#include "MagicEmitterInstance.h"
+#include "MagicParticleUtils.h"
+#include "MagicParticleTimeline.h"
+#include "MagicParticleSimulation.h"
+#include "MagicParticleEventStream.h"
+#include "MagicParticleArena.h"
+#include "MagicParticleInstancing.h"
 #include <Urho3D/Urho3DAll.h>
 
 #include <fstream>
@@ -6,12 +13,7 @@
 namespace Urho3D
 {
 
-/// Generate vertex and pixel shaders files at runtime for Urho3D using MAGIC_MATERIAL description.
-/// Shader files are written to disk in binary CoreData/Shaders folder.
-static String VsGenerate(MAGIC_MATERIAL* m, String fileName);
-static String PsGenerate(MAGIC_MATERIAL* m, String fileName);
-
-/// Path where to write shaders relative to binary.
+/// Path where to write generated shaders relative to binary.
 #ifdef URHO3D_OPENGL
 static const char* URHO_SHADER_DIRECTORY = "CoreData/Shaders/GLSL/MagicParticles/";
 #else
@@ -51,16 +53,109 @@ MP_MAT_HASHKEY getMagicMaterialHashKey(MAGIC_MATERIAL* material)
     return hashKey;
 }
 
+/// Load phases names.
+static const char* LOAD_PHASE_NAMES[] =
+{
+    "File read",
+    "Open file",
+    "Emitters",
+    "Atlas",
+    "Image decode",
+    "Texture upload",
+    "Shader generate",
+    "Shader write",
+    "Materials"
+};
+
+/// Add elapsed time of a scope to a load phase.
+class LoadPhaseTimer
+{
+public:
+    LoadPhaseTimer(MP_LOAD_PHASE& phase, unsigned count = 1, unsigned long long bytes = 0) :
+        phase_(phase)
+    {
+        phase_.count += count;
+        phase_.bytes += bytes;
+    }
+
+    ~LoadPhaseTimer()
+    {
+        phase_.time += timer_.GetUSec(false);
+    }
+
+private:
+    MP_LOAD_PHASE& phase_;
+    HiresTimer timer_;
+};
+
+/// Return true if a particles type of emitter is oriented from the camera. Emitters with child emitters are assumed to be.
+static bool HasCameraFacingParticles(HM_EMITTER emitter)
+{
+    if (Magic_GetEmitterCount(emitter) > 0)
+        return true;
+
+    int count = Magic_GetParticlesTypeCount(emitter);
+    for (int i = 0; i < count; ++i)
+    {
+        MAGIC_ORIENTATION orientation;
+        Magic_LockParticlesType(emitter, i);
+        int result = Magic_GetOrientation(&orientation);
+        Magic_UnlockParticlesType();
+
+        if (result != MAGIC_SUCCESS)
+            return true;
+
+        switch (orientation.orientation)
+        {
+        case MAGIC_ORIENTATION_CAMERA:
+        case MAGIC_ORIENTATION_CAMERA_X:
+        case MAGIC_ORIENTATION_CAMERA_Y:
+        case MAGIC_ORIENTATION_CAMERA_Z:
+        case MAGIC_ORIENTATION_CAMERA_AXIS:
+            return true;
+        default:
+            break;
+        }
+    }
+
+    return false;
+}
+
 //----------------------------------------------------------------------------------------------------
 
 MagicParticleEffect::MagicParticleEffect(Context* context) :
     Resource(context),
-    _dataSize(0)
+    _dataSize(0),
+    _fixedTimeStep(0.0),
+    _maxSubSteps(4),
+    _maxCatchUp(100.0),
+    _interpolation(true),
+    _randomMode(true),
+    _autoSorting(true),
+    _sortingDistance(30.0f),
+    _farSortMode(MAGIC_SORT_MIX),
+    _refillDistance(0.0f),
+    _refillAngle(0.0f),
+    _snapshotsEnabled(true),
+    _snapshotsPersistent(false),
+    _trimInterval(10.0f),
+    _trimTimer(0.0f)
 {
+    memset(_loadPhases, 0, sizeof(_loadPhases));
+    _loadTime = 0;
 }
 
 MagicParticleEffect::~MagicParticleEffect()
 {
+    MagicParticleSimulation* simulation = GetSubsystem<MagicParticleSimulation>();
+
+    for (unsigned i = 0; i < _instances.Size(); ++i)
+    {
+        if (simulation)
+            simulation->Discard(_instances[i]);
+        delete _instances[i];
+    }
+
     for (unsigned i = 0; i < _emitters.Size(); ++i)
         Magic_UnloadEmitter(_emitters[i]);
 
@@ -76,6 +171,30 @@ void MagicParticleEffect::RegisterObject(Context* context)
 {
     context->RegisterFactory<MagicParticleEffect>();
 
+    // counters of all emitter instances
+    if (!context->GetSubsystem<MagicParticleStats>())
+        context->RegisterSubsystem(new MagicParticleStats(context));
+
+    // timeline of pipeline phases
+    if (!context->GetSubsystem<MagicParticleTimeline>())
+        context->RegisterSubsystem(new MagicParticleTimeline(context));
+
+    // simulation commands, optionally run on a dedicated thread
+    if (!context->GetSubsystem<MagicParticleSimulation>())
+        context->RegisterSubsystem(new MagicParticleSimulation(context));
+
+    // batched particle events
+    if (!context->GetSubsystem<MagicParticleEventStream>())
+        context->RegisterSubsystem(new MagicParticleEventStream(context));
+
+    // frame arena of CPU staging buffers, disabled by default
+    if (!context->GetSubsystem<MagicParticleArena>())
+        context->RegisterSubsystem(new MagicParticleArena(context));
+
+    // shared masters of instanced emitters
+    if (!context->GetSubsystem<MagicParticleInstancing>())
+        context->RegisterSubsystem(new MagicParticleInstancing(context));
+
     bool filters[MAGIC_RENDER_STATE__MAX];
     for (int i=0;i<MAGIC_RENDER_STATE__MAX;i++)
         filters[i]=false;
@@ -95,15 +214,23 @@ void MagicParticleEffect::RegisterObject(Context* context)
 
 bool MagicParticleEffect::BeginLoad(Deserializer& source)
 {
+    HiresTimer timer;
+    memset(_loadPhases, 0, sizeof(_loadPhases));
+    _loadFolders.Clear();
+
     _dataSize = source.GetSize();
     _data = new char[_dataSize];
-    if (source.Read(_data, _dataSize) != _dataSize)
     {
-        URHO3D_LOGERROR("Could not load data");
-        _data = 0;
-        return false;
+        LoadPhaseTimer phase(_loadPhases[MP_LOAD_READ], 1, _dataSize);
+        if (source.Read(_data, _dataSize) != _dataSize)
+        {
+            URHO3D_LOGERROR("Could not load data");
+            _data = 0;
+            return false;
+        }
     }
 
+    _loadTime = timer.GetUSec(false);
     return true;
 }
 
@@ -112,7 +239,15 @@ bool MagicParticleEffect::EndLoad()
     if (!_data)
         return false;
 
-    HM_FILE file = Magic_OpenFileInMemory(_data);
+    WaitSimulation();
+
+    HiresTimer timer;
+
+    HM_FILE file;
+    {
+        LoadPhaseTimer phase(_loadPhases[MP_LOAD_OPEN], 1, _dataSize);
+        file = Magic_OpenFileInMemory(_data);
+    }
     if (file <= 0)
     {
         URHO3D_LOGERROR("Could not open file");
@@ -123,24 +258,69 @@ bool MagicParticleEffect::EndLoad()
     LoadFolder(file, "");
 
     bool success = false;
-    if (Magic_HasTextures(file))
-        success = CreateAtlasTexture(file);
-    else
-        RefreshAtlas();
+    {
+        LoadPhaseTimer phase(_loadPhases[MP_LOAD_ATLAS], 0);
+        if (Magic_HasTextures(file))
+            success = CreateAtlasTexture(file);
+        else
+            RefreshAtlas();
+    }
 
     success = _textures.Size() > 0;
 
     Magic_CloseFile(file);
     _data = 0;
-    SetMemoryUse(GetMemoryUse() + _dataSize);
 
-    CreateAllMaterials();
+    {
+        LoadPhaseTimer phase(_loadPhases[MP_LOAD_MATERIALS], 0);
+        CreateAllMaterials();
+    }
+
+    UpdateMemoryUse();
+    SetTrimInterval(_trimInterval);
+
+    _loadTime += timer.GetUSec(false);
+    LogLoadStats();
 
     return success;
 }
 
+const char* MagicParticleEffect::GetLoadPhaseName(MP_LOAD_PHASE_ENUM phase)
+{
+    return phase < MP_LOAD_PHASE_MAX ? LOAD_PHASE_NAMES[phase] : "";
+}
+
+void MagicParticleEffect::LogLoadStats() const
+{
+    URHO3D_LOGINFO("Loaded " + GetName() + " in " + String(_loadTime / 1000.0f) + " ms");
+
+    for (unsigned i = 0; i < MP_LOAD_PHASE_MAX; ++i)
+    {
+        const MP_LOAD_PHASE& phase = _loadPhases[i];
+        URHO3D_LOGINFO(String("  ") + LOAD_PHASE_NAMES[i] + " : " + String(phase.time / 1000.0f) + " ms, " +
+                       String(phase.count) + " items, " + String(phase.bytes) + " bytes");
+    }
+
+    for (unsigned i = 0; i < _loadFolders.Size(); ++i)
+    {
+        const MP_LOAD_FOLDER& folder = _loadFolders[i];
+        URHO3D_LOGINFO("  Folder " + (folder.path.Empty() ? String("/") : folder.path) + " : " +
+                       String(folder.time / 1000.0f) + " ms, " + String(folder.emitters) + " emitters");
+    }
+}
+
 void MagicParticleEffect::LoadFolder(HM_FILE file, const char* path)
 {
+    HiresTimer timer;
+
+    // folder stats, filled when done as subfolders are added meanwhile
+    String parentPath = _loadFolderPath;
+    if (*path)
+        _loadFolderPath += "/" + String(path);
+    unsigned folderIndex = _loadFolders.Size();
+    _loadFolders.Resize(folderIndex + 1);
+    unsigned numEmitters = _emitters.Size();
+
     Magic_SetCurrentFolder(file, path);
 
     MAGIC_FIND_DATA find;
@@ -156,20 +336,45 @@ void MagicParticleEffect::LoadFolder(HM_FILE file, const char* path)
     }
 
     Magic_SetCurrentFolder(file, "..");
+
+    MP_LOAD_FOLDER& folder = _loadFolders[folderIndex];
+    folder.path = _loadFolderPath;
+    folder.time = timer.GetUSec(false);
+    folder.emitters = _emitters.Size() - numEmitters;
+    for (unsigned i = folderIndex + 1; i < _loadFolders.Size(); ++i)
+    {
+        if (_loadFolders[i].path.StartsWith(_loadFolderPath + "/"))
+            folder.emitters -= _loadFolders[i].emitters;
+    }
+
+    _loadFolderPath = parentPath;
 }
 
 void MagicParticleEffect::LoadEmitter(HM_FILE file, const char* path)
 {
-    HM_EMITTER emitter = Magic_LoadEmitter(file, path);
+    HM_EMITTER emitter;
+    {
+        LoadPhaseTimer phase(_loadPhases[MP_LOAD_EMITTERS]);
+        emitter = Magic_LoadEmitter(file, path);
+    }
     if (emitter)
     {
-        Magic_SetInterpolationMode(emitter, true);
+        Magic_SetInterpolationMode(emitter, _interpolation);
+        Magic_SetRandomMode(emitter, _randomMode);
         Magic_Stop(emitter);
 
         Magic_SetEmitterPositionMode(emitter,true);
         Magic_SetEmitterDirectionMode(emitter,true);
 
         _emitters.Push(emitter);
+        _instancePool.Resize(_emitters.Size());
+        _prewarmCounts.Push(0);
+        _cameraFacing.Push(HasCameraFacingParticles(emitter));
+
+        MP_SNAPSHOT snapshot;
+        snapshot.built = false;
+        snapshot.position = 0.0;
+        _snapshots.Push(snapshot);
     }
 }
 
@@ -183,6 +388,8 @@ bool MagicParticleEffect::CreateAtlasTexture(HM_FILE file)
         switch (atlas.type)
         {
         case MAGIC_CHANGE_ATLAS_CREATE:
+            _loadPhases[MP_LOAD_ATLAS].count++;
+            _loadPhases[MP_LOAD_ATLAS].bytes += atlas.width * atlas.height * 4;
             if (!CreateTexture(atlas))
                 return false;
             break;
@@ -217,7 +424,10 @@ bool MagicParticleEffect::CreateTexture(const MAGIC_CHANGE_ATLAS& atlas)
     
     SharedArrayPtr<unsigned char> data(new unsigned char[atlas.width * atlas.height * 4]);
     memset(&data[0], 0, atlas.width * atlas.height * 4);
-    texture->SetData(0, 0, 0, atlas.width, atlas.height, data);
+    {
+        LoadPhaseTimer phase(_loadPhases[MP_LOAD_TEXTURE_UPLOAD], 1, atlas.width * atlas.height * 4);
+        texture->SetData(0, 0, 0, atlas.width, atlas.height, data);
+    }
 
     if (_textures.Size() < (unsigned)atlas.index + 1)
         _textures.Resize(atlas.index + 1);
@@ -238,6 +448,7 @@ bool MagicParticleEffect::LoadAtlasData(const MAGIC_CHANGE_ATLAS& atlas)
     {
         // Load image from memory
         MemoryBuffer buffer(atlas.data, atlas.length);
+        LoadPhaseTimer phase(_loadPhases[MP_LOAD_IMAGE_DECODE], 1, atlas.length);
         if (!image.Load(buffer))
         {
             URHO3D_LOGERROR("Could not load image from memory");
@@ -261,6 +472,7 @@ bool MagicParticleEffect::LoadAtlasData(const MAGIC_CHANGE_ATLAS& atlas)
             return false;
         }
 
+        LoadPhaseTimer phase(_loadPhases[MP_LOAD_IMAGE_DECODE], 1, file.GetSize());
         if (!image.Load(file))
         {
             URHO3D_LOGERROR("Could not load image from " + filePath);
@@ -280,6 +492,7 @@ bool MagicParticleEffect::LoadAtlasData(const MAGIC_CHANGE_ATLAS& atlas)
         return false;
     }
 
+    LoadPhaseTimer phase(_loadPhases[MP_LOAD_TEXTURE_UPLOAD], 1, atlas.width * atlas.height * 4);
     return texture->SetData(0, atlas.x, atlas.y, atlas.width, atlas.height, image.GetData());
 }
 
@@ -305,6 +518,9 @@ void MagicParticleEffect::RefreshAtlas()
                 else
                     filePath = parentPath + "textures/" + atlas.file;
 
+                // decoded and uploaded by the resource cache
+                _loadPhases[MP_LOAD_ATLAS].count++;
+                LoadPhaseTimer phase(_loadPhases[MP_LOAD_IMAGE_DECODE]);
                 SharedPtr<Texture2D> texture(cache->GetResource<Texture2D>(filePath));
                 if (!texture)
                 {
@@ -357,6 +573,377 @@ HM_EMITTER MagicParticleEffect::GetEmitter(unsigned index) const
     return _emitters[index];
 }
 
+void MagicParticleEffect::SetPrewarmCount(unsigned count)
+{
+    for (unsigned i = 0; i < _emitters.Size(); ++i)
+        SetPrewarmCount(i, count);
+}
+
+void MagicParticleEffect::SetPrewarmCount(unsigned index, unsigned count)
+{
+    if (index >= _emitters.Size())
+        return;
+
+    _prewarmCounts[index] = count;
+
+    // duplicate emitters now so that acquiring them later is only a state reset
+    PODVector<MagicEmitterInstance*>& pool = _instancePool[index];
+    if (pool.Size() < count)
+        WaitSimulation();
+
+    while (pool.Size() < count)
+    {
+        MagicEmitterInstance* instance = new MagicEmitterInstance(this, index);
+        _instances.Push(instance);
+        pool.Push(instance);
+    }
+}
+
+unsigned MagicParticleEffect::GetPrewarmCount(unsigned index) const
+{
+    return index < _prewarmCounts.Size() ? _prewarmCounts[index] : 0;
+}
+
+unsigned MagicParticleEffect::GetNumFreeInstances(unsigned index) const
+{
+    return index < _instancePool.Size() ? _instancePool[index].Size() : 0;
+}
+
+MagicEmitterInstance* MagicParticleEffect::AcquireInstance(unsigned index)
+{
+    if (index >= _emitters.Size())
+        return nullptr;
+
+    // restarts only restore snapshots, they may run on the simulation thread
+    if (_snapshotsEnabled && !_snapshots[index].built)
+    {
+        WaitSimulation();
+        BuildSnapshot(index);
+    }
+
+    PODVector<MagicEmitterInstance*>& pool = _instancePool[index];
+    if (pool.Size())
+    {
+        MagicEmitterInstance* instance = pool.Back();
+        pool.Pop();
+        return instance;
+    }
+
+    WaitSimulation();
+
+    MagicEmitterInstance* instance = new MagicEmitterInstance(this, index);
+    _instances.Push(instance);
+    return instance;
+}
+
+void MagicParticleEffect::ReleaseInstance(MagicEmitterInstance* instance)
+{
+    if (!instance)
+        return;
+
+    // simulation thread must not run queued commands on a pooled instance
+    MagicParticleSimulation* simulation = GetSubsystem<MagicParticleSimulation>();
+    if (simulation)
+        simulation->Discard(instance);
+
+    instance->Reset();
+    _instancePool[instance->GetIndex()].Push(instance);
+}
+
+MP_MEMORY MagicParticleEffect::GetMemoryStats() const
+{
+    MP_MEMORY memory;
+    memory.templates = _dataSize;
+
+    // atlases are RGBA8 without mip levels
+    for (unsigned i = 0; i < _textures.Size(); ++i)
+    {
+        if (_textures[i])
+            memory.textures += (unsigned long long)_textures[i]->GetWidth() * _textures[i]->GetHeight() * 4;
+    }
+
+    for (unsigned i = 0; i < _snapshots.Size(); ++i)
+        memory.snapshots += _snapshots[i].data.Size();
+
+    for (unsigned i = 0; i < _instances.Size(); ++i)
+        memory += _instances[i]->GetMemoryUse();
+
+    return memory;
+}
+
+void MagicParticleEffect::Trim()
+{
+    URHO3D_PROFILE(MagicTrim);
+
+    // fills must not run while their buffers are released
+    WaitSimulation();
+
+    for (unsigned i = 0; i < _instancePool.Size(); ++i)
+    {
+        for (unsigned j = 0; j < _instancePool[i].Size(); ++j)
+            _instancePool[i][j]->Trim(true);
+    }
+
+    for (unsigned i = 0; i < _instances.Size(); ++i)
+        _instances[i]->Trim(false);
+
+    UpdateMemoryUse();
+}
+
+void MagicParticleEffect::SetTrimInterval(float interval)
+{
+    _trimInterval = Max(interval, 0.0f);
+    _trimTimer = 0.0f;
+
+    if (_trimInterval > 0.0f)
+        SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(MagicParticleEffect, HandleUpdate));
+    else
+        UnsubscribeFromEvent(E_UPDATE);
+}
+
+void MagicParticleEffect::UpdateMemoryUse()
+{
+    // picked up by ResourceCache memory budgets next time it updates the resource group
+    SetMemoryUse((unsigned)Min(GetMemoryStats().GetTotal(), (unsigned long long)M_MAX_UNSIGNED));
+}
+
+void MagicParticleEffect::HandleUpdate(StringHash eventType, VariantMap& eventData)
+{
+    using namespace Update;
+
+    // emitters do not fill during update, simulation thread is idle
+    _trimTimer += eventData[P_TIMESTEP].GetFloat();
+    if (_trimTimer < _trimInterval)
+        return;
+
+    _trimTimer = 0.0f;
+    Trim();
+}
+
+void MagicParticleEffect::WaitSimulation()
+{
+    MagicParticleSimulation* simulation = GetSubsystem<MagicParticleSimulation>();
+    if (simulation)
+        simulation->Wait();
+}
+
+void MagicParticleEffect::SetFixedTimeStep(double step)
+{
+    _fixedTimeStep = Max(step, 0.0);
+}
+
+void MagicParticleEffect::SetMaxSubSteps(unsigned count)
+{
+    _maxSubSteps = Max(count, 1U);
+}
+
+void MagicParticleEffect::SetMaxCatchUp(double time)
+{
+    _maxCatchUp = Max(time, 0.0);
+}
+
+void MagicParticleEffect::SetInterpolation(bool enable)
+{
+    _interpolation = enable;
+
+    WaitSimulation();
+    for (unsigned i = 0; i < _emitters.Size(); ++i)
+        Magic_SetInterpolationMode(_emitters[i], enable);
+    for (unsigned i = 0; i < _instances.Size(); ++i)
+        Magic_SetInterpolationMode(_instances[i]->GetEmitter(), enable);
+}
+
+void MagicParticleEffect::SetRandomMode(bool enable)
+{
+    _randomMode = enable;
+
+    WaitSimulation();
+    for (unsigned i = 0; i < _emitters.Size(); ++i)
+        Magic_SetRandomMode(_emitters[i], enable);
+    for (unsigned i = 0; i < _instances.Size(); ++i)
+        Magic_SetRandomMode(_instances[i]->GetEmitter(), enable);
+}
+
+/// Snapshot file identifier and version.
+static const char* SNAPSHOT_FILE_ID = "MPSN";
+static const unsigned SNAPSHOT_FILE_VERSION = 1;
+
+void MagicParticleEffect::SetSnapshotsEnabled(bool enable)
+{
+    _snapshotsEnabled = enable;
+}
+
+void MagicParticleEffect::SetSnapshotsPersistent(bool enable)
+{
+    _snapshotsPersistent = enable;
+}
+
+bool MagicParticleEffect::BuildSnapshot(unsigned index)
+{
+    if (index >= _snapshots.Size())
+        return false;
+
+    MP_SNAPSHOT& snapshot = _snapshots[index];
+    if (snapshot.built)
+        return !snapshot.data.Empty();
+
+    // build only once, even on failure
+    snapshot.built = true;
+    snapshot.data.Clear();
+
+    if (!Magic_IsInterval1(_emitters[index]))
+        return false;
+
+    if (_snapshotsPersistent && LoadSnapshotFile(index))
+        return true;
+
+    // prewarm a temporary copy at origin
+    HM_EMITTER emitter = Magic_DuplicateEmitter(_emitters[index]);
+    if (emitter <= 0)
+        return false;
+
+    MAGIC_POSITION origin;
+    origin.x = origin.y = origin.z = 0.0f;
+    Magic_SetEmitterPosition(emitter, &origin);
+    Magic_Restart(emitter);
+    Magic_EmitterToInterval1(emitter, 1.f, 0);
+    snapshot.position = Magic_GetPosition(emitter);
+
+    // capture particle space
+    bool success = false;
+    HM_STREAM stream = Magic_StreamOpenMemory(0, 0, MAGIC_STREAM_WRITE);
+    if (stream > 0)
+    {
+        if (Magic_SaveArrayToStream(emitter, stream) == MAGIC_SUCCESS)
+        {
+            unsigned length = Magic_StreamGetLength(stream);
+            Magic_StreamSetMode(stream, MAGIC_STREAM_READ);
+            Magic_StreamSetPosition(stream, 0);
+
+            snapshot.data.Resize(length);
+            success = length > 0 && Magic_StreamRead(stream, (char*)&snapshot.data[0], length) == MAGIC_SUCCESS;
+        }
+        Magic_StreamClose(stream);
+    }
+
+    Magic_UnloadEmitter(emitter);
+
+    if (!success)
+    {
+        URHO3D_LOGERROR("Could not capture snapshot of emitter " + String(Magic_GetEmitterName(_emitters[index])));
+        snapshot.data.Clear();
+        return false;
+    }
+
+    if (_snapshotsPersistent)
+        SaveSnapshotFile(index);
+
+    return true;
+}
+
+bool MagicParticleEffect::RestoreSnapshot(unsigned index, HM_EMITTER emitter)
+{
+    // built on main thread when instances are acquired : no file access nor capture here
+    if (!_snapshotsEnabled || index >= _snapshots.Size() || _snapshots[index].data.Empty())
+        return false;
+
+    MP_SNAPSHOT& snapshot = _snapshots[index];
+
+    // particles were captured at origin
+    MAGIC_POSITION target;
+    Magic_GetEmitterPosition(emitter, &target);
+
+    MAGIC_POSITION origin;
+    origin.x = origin.y = origin.z = 0.0f;
+    Magic_SetEmitterPosition(emitter, &origin);
+    Magic_SetPosition(emitter, snapshot.position);
+
+    HM_STREAM stream = Magic_StreamOpenMemory((const char*)&snapshot.data[0], snapshot.data.Size(), MAGIC_STREAM_READ);
+    if (stream <= 0)
+    {
+        Magic_SetEmitterPosition(emitter, &target);
+        return false;
+    }
+
+    bool success = Magic_LoadArrayFromStream(emitter, stream) == MAGIC_SUCCESS;
+    Magic_StreamClose(stream);
+
+    // move emitter with its particles to the wanted position
+    bool positionMode = Magic_GetEmitterPositionMode(emitter);
+    Magic_SetEmitterPositionMode(emitter, true);
+    Magic_SetEmitterPosition(emitter, &target);
+    Magic_SetEmitterPositionMode(emitter, positionMode);
+
+    if (!success)
+        URHO3D_LOGERROR("Could not restore snapshot of emitter " + String(Magic_GetEmitterName(emitter)));
+
+    return success;
+}
+
+String MagicParticleEffect::GetSnapshotFileName(unsigned index) const
+{
+    String fileName = GetSubsystem<ResourceCache>()->GetResourceFileName(GetName());
+    if (fileName.Empty())
+        return String::EMPTY;
+
+    return GetPath(fileName) + GetFileName(fileName) + "_" + String(index) + ".mps";
+}
+
+bool MagicParticleEffect::LoadSnapshotFile(unsigned index)
+{
+    String fileName = GetSnapshotFileName(index);
+    FileSystem* fileSystem = GetSubsystem<FileSystem>();
+    if (fileName.Empty() || !fileSystem->FileExists(fileName))
+        return false;
+
+    // outdated if .ptc has been modified since
+    String sourceName = GetSubsystem<ResourceCache>()->GetResourceFileName(GetName());
+    if (fileSystem->GetLastModifiedTime(fileName) < fileSystem->GetLastModifiedTime(sourceName))
+        return false;
+
+    File file(context_, fileName, FILE_READ);
+    if (!file.IsOpen() || file.ReadFileID() != SNAPSHOT_FILE_ID || file.ReadUInt() != SNAPSHOT_FILE_VERSION)
+        return false;
+
+    MP_SNAPSHOT& snapshot = _snapshots[index];
+    snapshot.position = file.ReadDouble();
+    unsigned length = file.ReadUInt();
+    snapshot.data.Resize(length);
+
+    if (!length || file.Read(&snapshot.data[0], length) != length)
+    {
+        URHO3D_LOGERROR("Could not read snapshot file " + fileName);
+        snapshot.data.Clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool MagicParticleEffect::SaveSnapshotFile(unsigned index)
+{
+    String fileName = GetSnapshotFileName(index);
+    if (fileName.Empty())
+        return false;
+
+    const MP_SNAPSHOT& snapshot = _snapshots[index];
+
+    File file(context_, fileName, FILE_WRITE);
+    if (!file.IsOpen())
+    {
+        URHO3D_LOGERROR("Could not write snapshot file " + fileName);
+        return false;
+    }
+
+    file.WriteFileID(SNAPSHOT_FILE_ID);
+    file.WriteUInt(SNAPSHOT_FILE_VERSION);
+    file.WriteDouble(snapshot.position);
+    file.WriteUInt(snapshot.data.Size());
+    file.Write(&snapshot.data[0], snapshot.data.Size());
+
+    return true;
+}
+
 Material* MagicParticleEffect::GetMaterial(int index, unsigned stateHashkey, bool& newMaterialCreated)
 {
     // Magic Particle can use a material multiple times to render an emitter assigning to it different textures and states (blending...)
@@ -415,8 +1002,14 @@ String MagicParticleEffect::GetCompatibleVertexShader(MAGIC_MATERIAL* material)
         String vsFileName = "VERTEX_SHADER" + String(nextVertexShaderId++);
         _shaderFilenameList[hashKey] = vsFileName;
 
-        String vsCode = VsGenerate(material, vsFileName);
+        String vsCode;
+        {
+            LoadPhaseTimer phase(_loadPhases[MP_LOAD_SHADER_GENERATE]);
+            vsCode = VsGenerate(material, vsFileName);
+            _loadPhases[MP_LOAD_SHADER_GENERATE].bytes += vsCode.Length();
+        }
 
+        LoadPhaseTimer phase(_loadPhases[MP_LOAD_SHADER_WRITE], 1, vsCode.Length());
         String path = URHO_SHADER_DIRECTORY + vsFileName + ".glsl";
         std::ofstream file(path.CString());
         file << vsCode.CString();
@@ -439,8 +1032,14 @@ String MagicParticleEffect::GetCompatiblePixelShader(MAGIC_MATERIAL* material)
         String psFileName = "PIXEL_SHADER" + String(nextPixelShaderId++);
         _shaderFilenameList[hashKey] = psFileName;
 
-        String psCode = PsGenerate(material, psFileName);
+        String psCode;
+        {
+            LoadPhaseTimer phase(_loadPhases[MP_LOAD_SHADER_GENERATE]);
+            psCode = PsGenerate(material, psFileName);
+            _loadPhases[MP_LOAD_SHADER_GENERATE].bytes += psCode.Length();
+        }
 
+        LoadPhaseTimer phase(_loadPhases[MP_LOAD_SHADER_WRITE], 1, psCode.Length());
         String path = URHO_SHADER_DIRECTORY + psFileName + ".glsl";
         std::ofstream file(path.CString());
         file << psCode.CString();
@@ -451,20 +1050,33 @@ String MagicParticleEffect::GetCompatiblePixelShader(MAGIC_MATERIAL* material)
 
 void MagicParticleEffect::CreateAllMaterials()
 {
+    // translations refer to materials of previous load
+    _stateCaches.Clear();
+    _stateCaches.Resize(_emitters.Size());
+
     int materialCount = Magic_GetMaterialCount();
 
     MAGIC_MATERIAL mat;
     for (int i=0; i<materialCount; i++)
     {
         Magic_GetMaterial(i, &mat);
-        _magicMaterials.Push(mat);
+        AddMaterial(mat);
+        _loadPhases[MP_LOAD_MATERIALS].count++;
+    }
+}
 
-        Material* material = CreateMaterial(&mat);
+Material* MagicParticleEffect::AddMaterial(const MAGIC_MATERIAL& material)
+{
+    _magicMaterials.Push(material);
+    MAGIC_MATERIAL& mat = _magicMaterials.Back();
 
-        // compute key from MAGIC_MATERIAL and add material to map
-        unsigned key = getMagicMaterialHashKey(&mat);
-        _materials[key] = material;
-    }
+    Material* urhoMaterial = CreateMaterial(&mat);
+
+    // compute key from MAGIC_MATERIAL and add material to map
+    unsigned key = getMagicMaterialHashKey(&mat);
+    _materials[key] = urhoMaterial;
+
+    return urhoMaterial;
 }
 
 Material* MagicParticleEffect::CreateMaterial(MAGIC_MATERIAL* mat)
@@ -8,6 +8,111 @@ namespace Urho3D
 
 typedef unsigned MP_MAT_HASHKEY;
 
+/// Materials of an emitter template per translated render state sequence. Key chains the Magic render states
+/// drained since fill start and the batch material index, see MagicEmitterInstance::ResolveMaterials.
+typedef HashMap<unsigned long long, SharedPtr<Material> > MP_STATE_CACHE;
+
+class MagicEmitterInstance;
+
+/// Generate hash key from MAGIC_MATERIAL.
+MP_MAT_HASHKEY getMagicMaterialHashKey(MAGIC_MATERIAL* material);
+/// Generate vertex and pixel shaders code for Urho3D using MAGIC_MATERIAL description.
+String VsGenerate(MAGIC_MATERIAL* m, String fileName);
+String PsGenerate(MAGIC_MATERIAL* m, String fileName);
+
+/// Particles sorting of an emitter.
+enum MP_SORT_MODE
+{
+    MP_SORT_AUTO = 0,           // from blending and camera distance (see MagicParticleEffect::SetAutoSorting)
+    MP_SORT_TEMPLATE,           // sorting mode of the .ptc file
+    MP_SORT_NONE,               // MAGIC_NOSORT
+    MP_SORT_MIX,                // MAGIC_SORT_MIX
+    MP_SORT_MIX_INV,            // MAGIC_SORT_MIX_INV
+    MP_SORT_CAMERA_NEAR,        // MAGIC_SORT_CAMERA_NEAR
+    MP_SORT_CAMERA_FAR          // MAGIC_SORT_CAMERA_FAR
+};
+
+/// Load phases.
+enum MP_LOAD_PHASE_ENUM
+{
+    MP_LOAD_READ = 0,           // read .ptc file data
+    MP_LOAD_OPEN,               // Magic_OpenFileInMemory
+    MP_LOAD_EMITTERS,           // Magic_LoadEmitter calls
+    MP_LOAD_ATLAS,              // atlas packing and textures creation
+    MP_LOAD_IMAGE_DECODE,       // atlas images decoding
+    MP_LOAD_TEXTURE_UPLOAD,     // textures data upload
+    MP_LOAD_SHADER_GENERATE,    // shader code generation
+    MP_LOAD_SHADER_WRITE,       // shader files writing
+    MP_LOAD_MATERIALS,          // materials creation, includes shaders generation and writing
+    MP_LOAD_PHASE_MAX
+};
+
+/// Time, count and bytes of a load phase.
+struct MP_LOAD_PHASE
+{
+    /// Time in microseconds.
+    long long time;
+    /// Number of items processed.
+    unsigned count;
+    /// Bytes processed.
+    unsigned long long bytes;
+};
+
+/// Emitters loading of a folder.
+struct MP_LOAD_FOLDER
+{
+    /// Folder path in .ptc file.
+    String path;
+    /// Time in microseconds, subfolders included.
+    long long time;
+    /// Number of emitters loaded directly in folder.
+    unsigned emitters;
+};
+
+/// Particle state of a prewarmed emitter, captured at origin.
+struct MP_SNAPSHOT
+{
+    /// Snapshot has been built (or tried to).
+    bool built;
+    /// Emitter animation position at capture time.
+    double position;
+    /// Particle space saved by Magic_SaveArrayToStream.
+    PODVector<unsigned char> data;
+};
+
+/// Memory used by an effect and its emitter instances, in bytes.
+struct MP_MEMORY
+{
+    /// Magic emitter templates, estimated from .ptc file size.
+    unsigned long long templates;
+    /// Atlas textures.
+    unsigned long long textures;
+    /// Prewarmed particle snapshots.
+    unsigned long long snapshots;
+    /// CPU render arrays of instances and fills stored for views.
+    unsigned long long buffers;
+    /// GPU vertex and index buffers of instances.
+    unsigned long long gpuBuffers;
+    /// Emitter instances, pooled ones included.
+    unsigned instances;
+
+    MP_MEMORY() { memset(this, 0, sizeof(MP_MEMORY)); }
+
+    /// Return total bytes.
+    unsigned long long GetTotal() const { return templates + textures + snapshots + buffers + gpuBuffers; }
+
+    MP_MEMORY& operator +=(const MP_MEMORY& rhs)
+    {
+        templates += rhs.templates;
+        textures += rhs.textures;
+        snapshots += rhs.snapshots;
+        buffers += rhs.buffers;
+        gpuBuffers += rhs.gpuBuffers;
+        instances += rhs.instances;
+        return *this;
+    }
+};
+
 ///-------------------------------------------------------------------------------------------------
 /// Magic Particle Effect
 /// Read a .ptc file, load emitters, load textures, generate urho shaders, create urho materials.
@@ -35,10 +140,113 @@ public:
     unsigned GetNumEmitters() const;
     /// Return emitter at index.
     HM_EMITTER GetEmitter(unsigned index) const;
+    /// Return whether emitter at index may have particles facing the camera, whose geometry changes when the camera moves.
+    bool IsCameraFacing(unsigned index) const { return index < _cameraFacing.Size() ? _cameraFacing[index] : true; }
     /// Return material at index. Pass a stateHashkey to register material with new states.
     Material* GetMaterial(int index, unsigned stateHashkey, bool& newMaterialCreated);
     /// Return texture at index.
     Texture2D* GetTexture(int index) { return _textures[index]; }
+    /// Return number of atlas textures.
+    unsigned GetNumTextures() const { return _textures.Size(); }
+    /// Append an atlas texture, as the atlas of a .ptc file is. Lets an effect be built without a .ptc file.
+    void AddTexture(Texture2D* texture) { _textures.Push(SharedPtr<Texture2D>(texture)); }
+    /// Return Magic materials, in Magic index order.
+    const Vector<MAGIC_MATERIAL>& GetMagicMaterials() const { return _magicMaterials; }
+    /// Append a Magic material and create its Urho material, as materials of a .ptc file are. Return the Urho material.
+    Material* AddMaterial(const MAGIC_MATERIAL& material);
+    /// Return materials of render state sequences translated by instances of emitter at index, null if out of range. Main thread only.
+    MP_STATE_CACHE* GetStateCache(unsigned index) { return index < _stateCaches.Size() ? &_stateCaches[index] : nullptr; }
+
+    /// Set number of pooled instances to create in advance for all emitters.
+    void SetPrewarmCount(unsigned count);
+    /// Set number of pooled instances to create in advance for emitter at index.
+    void SetPrewarmCount(unsigned index, unsigned count);
+    /// Return number of pooled instances created in advance for emitter at index.
+    unsigned GetPrewarmCount(unsigned index) const;
+    /// Return number of free pooled instances for emitter at index.
+    unsigned GetNumFreeInstances(unsigned index) const;
+    /// Acquire an instance of emitter at index from the pool. A new instance is created if the pool is empty.
+    MagicEmitterInstance* AcquireInstance(unsigned index);
+    /// Release an instance back to the pool.
+    void ReleaseInstance(MagicEmitterInstance* instance);
+
+    /// Return memory used by the effect and all its emitter instances.
+    MP_MEMORY GetMemoryStats() const;
+    /// Release buffers of pooled instances, and buffers of playing instances above their peak since last trim. Resource memory use is updated.
+    void Trim();
+    /// Set time in seconds between automatic trims, 0 to disable.
+    void SetTrimInterval(float interval);
+    /// Return time in seconds between automatic trims.
+    float GetTrimInterval() const { return _trimInterval; }
+
+    /// Return load phase stats. Materials and shaders created after load are added too.
+    const MP_LOAD_PHASE& GetLoadPhase(MP_LOAD_PHASE_ENUM phase) const { return _loadPhases[phase]; }
+    /// Return load phase name.
+    static const char* GetLoadPhaseName(MP_LOAD_PHASE_ENUM phase);
+    /// Return emitters loading stats per folder.
+    const Vector<MP_LOAD_FOLDER>& GetLoadFolders() const { return _loadFolders; }
+    /// Return total load time in microseconds (BeginLoad + EndLoad).
+    long long GetLoadTime() const { return _loadTime; }
+    /// Log load phases breakdown.
+    void LogLoadStats() const;
+
+    /// Set fixed simulation time step in milliseconds, 0 to feed frame time directly (default). Geometry is not interpolated
+    /// between steps : a frame without a step draws the last step again, a step slower than the frame rate looks choppy.
+    void SetFixedTimeStep(double step);
+    /// Return fixed simulation time step in milliseconds, 0 if disabled.
+    double GetFixedTimeStep() const { return _fixedTimeStep; }
+    /// Set max number of fixed steps simulated per update.
+    void SetMaxSubSteps(unsigned count);
+    /// Return max number of fixed steps simulated per update.
+    unsigned GetMaxSubSteps() const { return _maxSubSteps; }
+    /// Set max frame time in milliseconds the simulation tries to catch up per update, longer hitches are dropped.
+    void SetMaxCatchUp(double time);
+    /// Return max frame time in milliseconds the simulation tries to catch up.
+    double GetMaxCatchUp() const { return _maxCatchUp; }
+    /// Set particle positions interpolation for all emitters and instances.
+    void SetInterpolation(bool enable);
+    /// Return particle positions interpolation flag.
+    bool GetInterpolation() const { return _interpolation; }
+    /// Set random behaviour for all emitters and instances. Disable to get reproducible runs.
+    void SetRandomMode(bool enable);
+    /// Return random behaviour flag.
+    bool GetRandomMode() const { return _randomMode; }
+
+    /// Enable automatic sorting policy of emitters using MP_SORT_AUTO. Emitters without alpha blended batches are not sorted,
+    /// camera sorted emitters switch to far sort mode beyond sorting distance. When disabled, sorting mode of the .ptc file is used.
+    void SetAutoSorting(bool enable) { _autoSorting = enable; }
+    /// Return whether automatic sorting policy is enabled.
+    bool GetAutoSorting() const { return _autoSorting; }
+    /// Set camera distance beyond which camera sorted emitters use far sort mode.
+    void SetSortingDistance(float distance) { _sortingDistance = Max(distance, 0.0f); }
+    /// Return camera distance beyond which camera sorted emitters use far sort mode.
+    float GetSortingDistance() const { return _sortingDistance; }
+    /// Set sort mode of distant camera sorted emitters.
+    void SetFarSortMode(MAGIC_SORT_ENUM mode) { _farSortMode = mode; }
+    /// Return sort mode of distant camera sorted emitters.
+    MAGIC_SORT_ENUM GetFarSortMode() const { return _farSortMode; }
+
+    /// Set camera move below which emitters that did not advance keep the geometry of their previous fill, 0 to refill on any move (default).
+    void SetRefillDistance(float distance) { _refillDistance = Max(distance, 0.0f); }
+    /// Return camera move below which unchanged emitters are not refilled.
+    float GetRefillDistance() const { return _refillDistance; }
+    /// Set camera turn in degrees below which emitters that did not advance keep the geometry of their previous fill, 0 to refill on any turn (default).
+    void SetRefillAngle(float angle) { _refillAngle = Clamp(angle, 0.0f, 180.0f); }
+    /// Return camera turn in degrees below which unchanged emitters are not refilled.
+    float GetRefillAngle() const { return _refillAngle; }
+
+    /// Enable prewarmed snapshots. Emitters starting at interval1 restore a captured particle state instead of re-simulating.
+    void SetSnapshotsEnabled(bool enable);
+    /// Return whether prewarmed snapshots are enabled.
+    bool GetSnapshotsEnabled() const { return _snapshotsEnabled; }
+    /// Enable saving/loading snapshots to disk next to the .ptc file.
+    void SetSnapshotsPersistent(bool enable);
+    /// Return whether snapshots are saved to disk.
+    bool GetSnapshotsPersistent() const { return _snapshotsPersistent; }
+    /// Build snapshot of emitter at index if not done yet. Main thread only, done when an instance is acquired. Return true if a snapshot is available.
+    bool BuildSnapshot(unsigned index);
+    /// Restore snapshot of emitter at index into an emitter instance at its current position. Never builds it : may run on the simulation thread. Return false if no snapshot is available.
+    bool RestoreSnapshot(unsigned index, HM_EMITTER emitter);
 
 private:
     /// Load folder.
@@ -55,14 +263,34 @@ private:
     void RefreshAtlas();
     /// Create all materials.
     void CreateAllMaterials();
+    /// Wait for the simulation thread before calling Magic from main thread.
+    void WaitSimulation();
+    /// Report memory of the effect and its instances to the resource cache.
+    void UpdateMemoryUse();
+    /// Handle update : trim buffers periodically.
+    void HandleUpdate(StringHash eventType, VariantMap& eventData);
     /// Return vertex shader filename of a compatible shader with MAGIC_MATERIAL definition. Create shader if not exists.
     String GetCompatibleVertexShader(MAGIC_MATERIAL* material);
     /// Return pixel shader filename of a compatible shader with MAGIC_MATERIAL definition. Create shader if not exists.
     String GetCompatiblePixelShader(MAGIC_MATERIAL* material);
     /// Create urho material from MAGIC material
     Material *CreateMaterial(MAGIC_MATERIAL* mat);
+    /// Return snapshot file name of emitter at index, empty if effect is not loaded from a file.
+    String GetSnapshotFileName(unsigned index) const;
+    /// Load snapshot from disk. Fail if the file is older than the .ptc file.
+    bool LoadSnapshotFile(unsigned index);
+    /// Save snapshot to disk.
+    bool SaveSnapshotFile(unsigned index);
 
-    /// File data size.
+    /// Load phases stats.
+    MP_LOAD_PHASE _loadPhases[MP_LOAD_PHASE_MAX];
+    /// Emitters loading stats per folder.
+    Vector<MP_LOAD_FOLDER> _loadFolders;
+    /// Total load time.
+    long long _loadTime;
+    /// Path of folder being loaded.
+    String _loadFolderPath;
+    /// File data size, also used as an estimate of emitter templates memory.
     unsigned _dataSize;
     /// File data.
     SharedArrayPtr<char> _data;
@@ -76,6 +304,46 @@ private:
     HashMap<MP_MAT_HASHKEY, SharedPtr<Material>> _materials;
     /// Map of shaders filenames. Key is computed from MAGIC_MATERIAL.
     HashMap<MP_MAT_HASHKEY, String> _shaderFilenameList;
+    /// All emitter instances created by this effect.
+    PODVector<MagicEmitterInstance*> _instances;
+    /// Free emitter instances per emitter.
+    Vector<PODVector<MagicEmitterInstance*> > _instancePool;
+    /// Translated render state sequences per emitter.
+    Vector<MP_STATE_CACHE> _stateCaches;
+    /// Number of instances to create in advance per emitter.
+    PODVector<unsigned> _prewarmCounts;
+    /// Camera facing particles flag per emitter.
+    PODVector<bool> _cameraFacing;
+    /// Fixed simulation time step (milliseconds).
+    double _fixedTimeStep;
+    /// Max fixed steps per update.
+    unsigned _maxSubSteps;
+    /// Max catch up time per update (milliseconds).
+    double _maxCatchUp;
+    /// Interpolation flag.
+    bool _interpolation;
+    /// Random mode flag.
+    bool _randomMode;
+    /// Automatic sorting policy flag.
+    bool _autoSorting;
+    /// Camera sorting distance.
+    float _sortingDistance;
+    /// Sort mode beyond camera sorting distance.
+    MAGIC_SORT_ENUM _farSortMode;
+    /// Camera move below which unchanged emitters are not refilled.
+    float _refillDistance;
+    /// Camera turn below which unchanged emitters are not refilled.
+    float _refillAngle;
+    /// Prewarmed particle snapshots per emitter.
+    Vector<MP_SNAPSHOT> _snapshots;
+    /// Snapshots enabled flag.
+    bool _snapshotsEnabled;
+    /// Snapshots saved to disk flag.
+    bool _snapshotsPersistent;
+    /// Time between automatic trims.
+    float _trimInterval;
+    /// Time since last trim.
+    float _trimTimer;
 };
 
 }
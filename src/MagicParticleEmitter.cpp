@@ -1,148 +1,54 @@
 #include "MagicParticleEffect.h"
 #include "MagicParticleEmitter.h"
+#include "MagicParticleUtils.h"
+#include "MagicParticleTimeline.h"
+#include "MagicParticleEvents.h"
+#include "MagicParticleInstancing.h"
 #include <Urho3D/Urho3DAll.h>
 
 namespace Urho3D
 {
 
-#ifdef ASSERT_DEBUG
-    #define MP_ASSERT(X) assert(X)
-#else
-    #define MP_ASSERT(X)
-#endif
-
-// scale conversion factors between magic particle 3D and Urho3D (1:100)
-#define SCALE_URHO3D_TO_MAGIC 100.0f
-#define SCALE_MAGIC_TO_URHO3D 0.01f
-
-// use 16 or 32 bits indices
-#ifdef INDEX_BUFFER_32_WRAP
-    #define MP_LARGE_INDICES true
-#else
-    #define MP_LARGE_INDICES false
-#endif
-
-
-//----------------------------------------------------------------------------------------------------
-
-MP_BUFFER::MP_BUFFER()
-{
-    max_length=0;
-    length=0;
-}
-
-MP_BUFFER::~MP_BUFFER()
-{
-    Destroy();
-}
-
-void MP_BUFFER::Create(int new_length)
-{
-    Destroy();
-    max_length=new_length;
-}
-
-void MP_BUFFER::Destroy()
-{
-    max_length=0;
-    length=0;
-}
-
-void MP_BUFFER::SetLength(int new_length)
-{
-    if (max_length<new_length)
-        Create(new_length);
-    length=new_length;
-}
-
-//----------------------------------------------------------------------------------------------------
-
-
-MP_BUFFER_RAM::MP_BUFFER_RAM() : MP_BUFFER()
-{
-    buffer=nullptr;
-}
-
-MP_BUFFER_RAM::~MP_BUFFER_RAM()
-{
-    Destroy();
-}
-
-void MP_BUFFER_RAM::Create(int new_length)
-{
-    MP_BUFFER::Create(new_length);
-    buffer=new char[new_length];
-}
-
-void MP_BUFFER_RAM::Destroy()
-{
-    MP_BUFFER::Destroy();
-
-    if (buffer)
-    {
-        delete []buffer;
-        buffer=nullptr;
-    }
-}
-
-//----------------------------------------------------------------------------------------------------
-
-static inline Vector3 MagicToUrho3D(const MAGIC_POSITION& pos)
-{
-    return Vector3(pos.x, pos.y, pos.z) * SCALE_MAGIC_TO_URHO3D;
-}
-
-/*static inline Quaternion MagicToUrho3D(const MAGIC_DIRECTION& dir)
-{
-    return Quaternion(-dir.w, -dir.x, -dir.y, dir.z);
-}*/
-
-static inline MAGIC_POSITION Urho3DToMagic(const Vector3& pos)
-{
-    MAGIC_POSITION position = { pos.x_ * SCALE_URHO3D_TO_MAGIC, pos.y_ * SCALE_URHO3D_TO_MAGIC, pos.z_ * SCALE_URHO3D_TO_MAGIC};
-    return position;
-}
+extern const char* GEOMETRY_CATEGORY;
 
-static inline MAGIC_DIRECTION Urho3DToMagic(const Quaternion& rot)
+static const char* sortModeNames[] =
 {
-    MAGIC_DIRECTION direction = { -rot.x_, -rot.y_, -rot.z_, rot.w_ };
-    return direction;
-}
-
-//----------------------------------------------------------------------------------------------------
-
-extern const char* GEOMETRY_CATEGORY;
+    "Auto",
+    "Template",
+    "None",
+    "Mix",
+    "Mix Inverse",
+    "Camera Near",
+    "Camera Far",
+    0
+};
 
 MagicParticleEmitter::MagicParticleEmitter(Context* context) :
     Drawable(context, DRAWABLE_GEOMETRY)
     , _index(-1)
     , _magicEmitter(0)
-    , _indexBuffer(new IndexBuffer(context_))
-    , _vertexBuffer(new VertexBuffer(context_))
-    , _mp_vertex_buffer(new MP_BUFFER_RAM())
-    , _mp_index_buffer(new MP_BUFFER_RAM())
-    , _isVisible(false)
+    , _instance(nullptr)
     , _moveParticlesWithEmitter(false)
     , _rotateParticlesWithEmitter(false)
     , _overrideEmitterRotation(true)
-    , _cameraNode(nullptr)
+    , _state(MP_EMITTER_FINISHED)
+    , _resumeState(MP_EMITTER_PLAYING)
+    , _autoRelease(true)
+    , _sortMode(MP_SORT_AUTO)
+    , _restartJob(0)
+    , _instanced(false)
+    , _phase(-1)
+    , _master(nullptr)
 {
-    _indexBuffer->SetShadowed(true);
-    _graphics = GetSubsystem<Graphics>();
     _emitterPos = Urho3DToMagic(Vector3(0,0,0));
-    memset(&_renderingStart, 0, sizeof(MAGIC_RENDERING_START));
+    _simulation = GetSubsystem<MagicParticleSimulation>();
+    _stats = GetSubsystem<MagicParticleStats>();
+    _instancing = GetSubsystem<MagicParticleInstancing>();
 }
 
 MagicParticleEmitter::~MagicParticleEmitter()
 {
-    if(_magicEmitter > 0)
-        Magic_UnloadEmitter(_magicEmitter);
-
-    _mp_vertex_buffer->Destroy();
-    _mp_index_buffer->Destroy();
-
-    delete _mp_vertex_buffer;
-    delete _mp_index_buffer;
+    ReleaseInstance();
 }
 
 void MagicParticleEmitter::RegisterObject(Context* context)
@@ -151,6 +57,9 @@ void MagicParticleEmitter::RegisterObject(Context* context)
 
     URHO3D_MIXED_ACCESSOR_ATTRIBUTE("Magic Particle Effect", GetEffectAttr, SetEffectAttr, ResourceRef, ResourceRef(MagicParticleEffect::GetTypeStatic()), AM_DEFAULT);
     URHO3D_ACCESSOR_ATTRIBUTE("Emitter Index", GetIndex, SetIndex, int, -1, AM_DEFAULT);
+    URHO3D_ENUM_ACCESSOR_ATTRIBUTE("Sort Mode", GetSortMode, SetSortMode, MP_SORT_MODE, sortModeNames, MP_SORT_AUTO, AM_DEFAULT);
+    URHO3D_ACCESSOR_ATTRIBUTE("Instanced", IsInstanced, SetInstanced, bool, false, AM_DEFAULT);
+    URHO3D_ACCESSOR_ATTRIBUTE("Phase", GetPhase, SetPhase, int, -1, AM_DEFAULT);
     URHO3D_COPY_BASE_ATTRIBUTES(Drawable);
 }
 
@@ -162,15 +71,9 @@ void MagicParticleEmitter::OnSetEnabled()
     if (scene)
     {
         if (IsEnabledEffective())
-        {
             Restart();
-            SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(MagicParticleEmitter, HandleUpdate));
-        }
         else
-        {
             Stop();
-            UnsubscribeFromEvent(E_UPDATE);
-        }
     }
 }
 
@@ -189,275 +92,374 @@ void MagicParticleEmitter::OnNodeSet(Node* node)
 {
     Drawable::OnNodeSet(node);
 
+    if (node && _master)
+        UpdateInstanceTransform();
+
     if (node)
     {
         Scene* scene = GetScene();
         if (scene && IsEnabledEffective())
-        {
             worldBoundingBox_ = boundingBox_.Transformed(node_->GetWorldTransform());
-            SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(MagicParticleEmitter, HandleUpdate));            
-        }
-    }
-    else
-    {
-        UnsubscribeFromEvent(E_UPDATE);
     }
+
+    UpdateEventSubscription();
 }
 
 void MagicParticleEmitter::OnWorldBoundingBoxUpdate()
 {
+    // instanced : shared local box placed by the node, others set their world box at update
+    if (_master)
+        worldBoundingBox_ = _master->GetBoundingBox().Transformed(_instanceTransform);
+}
+
+void MagicParticleEmitter::OnMarkedDirty(Node* node)
+{
+    Drawable::OnMarkedDirty(node);
 
+    if (_master)
+        UpdateInstanceTransform();
 }
 
 void MagicParticleEmitter::UpdateBatches(const FrameInfo& frame)
 {    
     distance_ = frame.camera_->GetDistance(GetWorldBoundingBox().Center());
-    _isVisible = frame.camera_->GetFrustum().IsInsideFast(GetWorldBoundingBox()) != OUTSIDE;
-    _cameraNode = frame.camera_->GetNode();
-}
-
-void MagicParticleEmitter::MapBuffers(MAGIC_ARRAY_INFO* vertex_info, MAGIC_ARRAY_INFO* index_info)
-{
-    MP_ARRAY_INFO* info;
-    int new_length;
-    int stage=0;
-
-    // indices
-    *((MAGIC_ARRAY_INFO*)&(_m_array_info[0]))=*vertex_info;
-    info=&(_m_array_info[0]);
-    info->stage=stage;
-    stage++;
-    new_length=vertex_info->length*vertex_info->bytes_per_one;
-    _mp_vertex_buffer->SetLength(new_length);
-    info->offset=0;
-    info->stride=vertex_info->bytes_per_one;
-    info->buffer=_mp_vertex_buffer->Map(info->stride);
-
-    // vertices
-    *((MAGIC_ARRAY_INFO*)&(_m_array_info[1]))=*index_info;
-    info=&(_m_array_info[1]);
-    info->stage=stage;
-    stage++;
-    new_length=index_info->length*index_info->bytes_per_one;
-    _mp_index_buffer->SetLength(new_length);
-    info->offset=0;
-    info->stride=index_info->bytes_per_one;
-    info->buffer=_mp_index_buffer->Map(info->stride);
-}
 
-void MagicParticleEmitter::HandleUpdate(StringHash eventType,VariantMap& eventData)
-{
-   if(!_isVisible)
+    if (frame.camera_->GetFrustum().IsInsideFast(GetWorldBoundingBox()) == OUTSIDE)
+    {
+        batches_.Clear();
         return;
+    }
 
-    using namespace Update;
-    float timeStep = eventData[P_TIMESTEP].GetFloat();
-
-    // set camera
-    if(_cameraNode)
+    if (_master)
     {
-        MAGIC_CAMERA magicCamera;
-        magicCamera.pos = Urho3DToMagic(_cameraNode->GetWorldPosition());
-        magicCamera.dir = Urho3DToMagic(_cameraNode->GetWorldDirection());
-        magicCamera.mode = MAGIC_CAMERA_FREE;
-        Magic_SetCamera(&magicCamera);
+        UpdateInstancedBatches(frame);
+        return;
     }
 
-    // Set emitter position, direction and scale
+    // geometry of this view was filled and uploaded at post update, from its camera of this frame
+    unsigned slot = _views.Add(frame.camera_, frame.frameNumber_, distance_);
 
-    MAGIC_POSITION emPos;
-    emPos.x = _emitterPos.x + node_->GetWorldPosition().x_ * SCALE_URHO3D_TO_MAGIC;
-    emPos.y = _emitterPos.y + node_->GetWorldPosition().y_ * SCALE_URHO3D_TO_MAGIC;
-    emPos.z = _emitterPos.z + node_->GetWorldPosition().z_ * SCALE_URHO3D_TO_MAGIC;
-    Magic_SetEmitterPosition(_magicEmitter, &emPos);
+    if (!_instance || !_views.IsFilled(slot))
+    {
+        batches_.Clear();
+        return;
+    }
 
-    // ovveride emitter rotation with urho node rotation
-    if(_overrideEmitterRotation)
+    batches_.Resize(_instance->GetNumBatches(slot));
+
+    for (unsigned i = 0; i < batches_.Size(); ++i)
     {
-        MAGIC_DIRECTION emDir;
-        emDir.x = Urho3DToMagic( node_->GetWorldRotation() ).x;
-        emDir.y = Urho3DToMagic( node_->GetWorldRotation() ).y;
-        emDir.z = Urho3DToMagic( node_->GetWorldRotation() ).z;
-        emDir.w = Urho3DToMagic( node_->GetWorldRotation() ).w;
-        Magic_SetEmitterDirection(_magicEmitter, &emDir);
+        batches_[i].geometry_ = _instance->GetBatchGeometry(i, slot);
+        batches_[i].material_ = _instance->GetBatchMaterial(i, slot);
+        batches_[i].distance_ = distance_;
+        batches_[i].worldTransform_ = &Matrix3x4::IDENTITY;
     }
+}
 
-    Magic_SetScale(_magicEmitter, 1.0f * node_->GetScale().x_);
+void MagicParticleEmitter::UpdateInstancedBatches(const FrameInfo& frame)
+{
+    bool filled = false;
+    unsigned slot = _master->AddView(frame.camera_, frame.frameNumber_, distance_, _instanceTransform, filled);
 
+    MagicEmitterInstance* instance = _master->GetInstance();
+    if (_state == MP_EMITTER_FINISHED || !filled)
+    {
+        batches_.Clear();
+        return;
+    }
 
-    // update emitter
+    // master geometry is in local space
+    batches_.Resize(instance->GetNumBatches(slot));
 
-    if(Magic_Update(_magicEmitter, 1000.0 * timeStep) == false)
+    for (unsigned i = 0; i < batches_.Size(); ++i)
+    {
+        batches_[i].geometry_ = instance->GetBatchGeometry(i, slot);
+        batches_[i].material_ = instance->GetBatchMaterial(i, slot);
+        batches_[i].distance_ = distance_;
+        batches_[i].worldTransform_ = &_instanceTransform;
+    }
+}
+
+void MagicParticleEmitter::UpdateInstanceTransform()
+{
+    if (!node_)
         return;
 
-    // set bounding box
+    // turned node : switch to the master of its new rotation, kept if none can be created
+    Quaternion rotation = node_->GetWorldRotation();
+    if (rotation != _nodeRotation && !_instancing->MatchesRotation(_master, rotation))
+    {
+        MagicEmitterMaster* master = _instancing->AcquireMaster(_effect, _index, _master->GetPhase(), rotation, this);
+        if (master)
+        {
+            _instancing->ReleaseMaster(_master, this);
+            _master = master;
+            _magicEmitter = _master->GetInstance()->GetEmitter();
+            batches_.Clear();
+        }
+    }
 
-    MAGIC_BBOX bbox;
-    Magic_GetBBox(_magicEmitter, &bbox);
-    boundingBox_.Define( MagicToUrho3D(bbox.corner1), MagicToUrho3D(bbox.corner2) );
-    worldBoundingBox_ = boundingBox_;
+    _nodeRotation = rotation;
 
-    // clear draw batches
-    _drawBatches.Clear();
+    _instanceTransform = Matrix3x4(node_->GetWorldPosition(), _master->GetRotation(), node_->GetWorldScale());
+}
 
-    Vector<SharedPtr<Material> > materials;
+void MagicParticleEmitter::HandleUpdate(StringHash eventType,VariantMap& eventData)
+{
+    if(!_instance)
+        return;
 
-    if (_magicEmitter > 0)// && Magic_InInterval(_magicEmitter))
+    // views that rendered the emitter in previous frame
+    unsigned frameNumber = GetSubsystem<Time>()->GetFrameNumber();
+    unsigned nearest = _views.GetNearest(frameNumber);
+    bool visible = nearest != MagicViewList::NO_VIEW;
+    bool pipelined = _simulation && _simulation->IsPipelined();
+
+    // pipelined : present results of last simulation job, unless it ran before a restart
+    if(pipelined && _simulation->GetNumJobs() > _restartJob)
     {
-        MAGIC_RENDERING_START start;
-        MAGIC_ARGB_ENUM color_mode = MAGIC_ARGB;
-        int max_array_streams = 0;
+        if(!_instance->IsAlive())
+        {
+            // emitter is done : Finish() may lead to this component destruction, do nothing after
+            Finish();
+            return;
+        }
 
-        // prepares the information about render arrays and fill start structure
-        void* context = Magic_PrepareRenderArrays(_magicEmitter, &start, max_array_streams, color_mode, MP_LARGE_INDICES);
+        UpdateBoundingBox();
 
-        if (start.arrays)
+        for (unsigned i = 0; i < _views.Size(); ++i)
         {
-            // save start infos
-            SaveAttributes(&start);
-
-            // set vertex format
-            _vertexElements.Clear();
-            _vertexElements.Push(VertexElement(TYPE_VECTOR3, SEM_POSITION));
-            _vertexElements.Push(VertexElement(TYPE_UBYTE4_NORM, SEM_COLOR));
-            for(int i=0; i<start.format.UVs; ++i)
-                _vertexElements.Push(VertexElement(TYPE_VECTOR2, SEM_TEXCOORD, i));
-
-            // returns info about render arrays
-            MAGIC_ARRAY_INFO vertex_info, index_info;
-            Magic_GetRenderArrayData(context, 0, &vertex_info);
-            Magic_GetRenderArrayData(context, 1, &index_info);
-
-            // map index and vertex buffers
-            MapBuffers(&vertex_info, &index_info);
-
-            // set render array
-            MP_ARRAY_INFO* array_info_vertex = &_m_array_info[0];
-            Magic_SetRenderArrayData(context, array_info_vertex->stage, array_info_vertex->buffer, array_info_vertex->offset, array_info_vertex->stride);
-            MP_ARRAY_INFO* array_info_index = &_m_array_info[1];
-            Magic_SetRenderArrayData(context, array_info_index->stage, array_info_index->buffer, array_info_index->offset, array_info_index->stride);
-
-            // Fills the render buffers by info about vertices
-            Magic_FillRenderArrays(context);
-
-            // reset render states
-            ResetStates();
-
-            // fill draw batches
-
-            MAGIC_RENDER_VERTICES vrts;
-            MAGIC_RENDER_STATE state;
-            while (Magic_GetVertices(context, &vrts) == MAGIC_SUCCESS)
-            {                
-                while (Magic_GetNextRenderState(context, &state) == MAGIC_SUCCESS)
-                {
-                    SetRenderState(&state);
-                }
-
-                Material* material = GetRenderMaterial(vrts.material);
-                materials.Push(SharedPtr<Material>(material));
-
-                _drawBatches.Push(vrts);
-            }
+            if (_instance->Present(i))
+                _views.SetFilled(i);
         }
     }
 
+    // occluded emitters are simulated without fill so they are up to date when revealed,
+    // emitters out of view are frozen, except stopping ones so they can finish
+    bool occluded = !visible && _views.IsOccluded(this, frameNumber);
+    bool hidden = _simulation && _simulation->IsSimulateHidden();
+    if(!visible && !occluded && !hidden && _state != MP_EMITTER_STOPPING)
+        return;
 
-    unsigned batchCount = _drawBatches.Size();
+    if(occluded && _stats)
+    {
+        MP_COUNTERS counters;
+        counters.occluded = 1;
+        _stats->Add(counters);
+    }
 
-    batches_.Resize(batchCount);
-    _geometries.Resize(batchCount);
+    URHO3D_PROFILE(UpdateMagicEmitter);
 
-    if(batchCount == 0)
-        return;
+    using namespace Update;
+    float timeStep = eventData[P_TIMESTEP].GetFloat();
+
+    // Set emitter position, direction and scale
 
-    unsigned totalIndexCount = _renderingStart.indexes;
-    unsigned totalVertexCount = _renderingStart.vertices;
+    MP_SIM_COMMAND transform(MP_SIM_TRANSFORM, _instance);
+    transform.position = GetMagicPosition();
 
-    if(_graphics->IsDeviceLost())
-        return;
+    // ovveride emitter rotation with urho node rotation
+    if(_overrideEmitterRotation)
+    {
+        transform.direction = Urho3DToMagic( node_->GetWorldRotation() );
+        transform.flag = true;
+    }
 
-    // set index buffer
+    transform.value = 1.0f * node_->GetScale().x_;
 
-    _indexBuffer->SetSize(totalIndexCount, MP_LARGE_INDICES);
-    MP_BUFFER_RAM* ib = reinterpret_cast<MP_BUFFER_RAM*>(_mp_index_buffer);
-    _indexBuffer->SetData(ib->buffer);
+    // update emitter once for all views from the nearest camera, distance is known from last frame
 
-    // set vertex buffer
+    MP_SIM_COMMAND update(MP_SIM_UPDATE, _instance);
+    update.time = 1000.0 * timeStep;
+    update.sortMode = _sortMode;
+    update.value = visible ? _views.Get(nearest).distance : distance_;
+    update.hasCamera = visible && _views.GetMagicCamera(nearest, update.camera);
 
-    _vertexBuffer->SetSize(totalVertexCount,  _vertexElements , true);
-    MP_BUFFER_RAM* vb = reinterpret_cast<MP_BUFFER_RAM*>(_mp_vertex_buffer);
-    _vertexBuffer->SetData(vb->buffer);
+    if(pipelined)
+    {
+        // simulated after update, presented next frame
+        _simulation->Post(transform);
+        _simulation->Post(update);
 
-    // set batches and geometries
+        for (unsigned i = 0; visible && i < _views.Size(); ++i)
+        {
+            if (!_views.IsActive(i, frameNumber))
+                continue;
+
+            MP_SIM_COMMAND fill(MP_SIM_FILL, _instance);
+            fill.view = i;
+            fill.hasCamera = _views.GetMagicCamera(i, fill.camera);
+            fill.flag = true;
+            _simulation->Post(fill);
+        }
+        return;
+    }
 
-    for (unsigned i = 0; i < batches_.Size(); ++i)
+    MagicParticleSimulation::Execute(transform);
+    MagicParticleSimulation::Execute(update);
+
+    if(!_instance->IsAlive())
     {
-        if (!_geometries[i])
+        // emitter is done : Finish() may lead to this component destruction, do nothing after
+        Finish();
+        return;
+    }
+
+    UpdateBoundingBox();
+
+    // fill each view that rendered the emitter and still has it in its frustum, with all emitters
+    // at post update : the subsystem uploads them before views gather batches
+
+    for (unsigned i = 0; visible && i < _views.Size(); ++i)
+    {
+        MAGIC_CAMERA camera;
+        if (!_views.IsActive(i, frameNumber) || !_views.IsInFrustum(i, worldBoundingBox_) || !_views.GetMagicCamera(i, camera))
+            continue;
+
+        // emitter did not advance and camera did not move : uploaded geometry and batches are kept
+        if (_instance->SkipFill(i, camera))
+            continue;
+
+        if (_simulation)
         {
-            _geometries[i] = new Geometry(context_);
-            _geometries[i]->SetIndexBuffer(_indexBuffer);
-            _geometries[i]->SetVertexBuffer(0, _vertexBuffer);
+            MP_SIM_COMMAND fill(MP_SIM_FILL, _instance);
+            fill.view = i;
+            fill.camera = camera;
+            fill.hasCamera = true;
+            _simulation->PostFill(fill);
+            _views.SetFilled(i);
+            continue;
         }
-		
-        _geometries[i]->SetDrawRange(TRIANGLE_LIST, _drawBatches[i].starting_index, _drawBatches[i].indexes_count, true);
 
-        batches_[i].geometry_ = _geometries[i];
-        batches_[i].material_ = materials[i];
-        batches_[i].distance_ = distance_;
-        batches_[i].worldTransform_ = &Matrix3x4::IDENTITY;
+        Magic_SetCamera(&camera);
+        _instance->Fill(&camera);
+        if (_instance->Upload(i))
+            _views.SetFilled(i);
     }
 }
 
+void MagicParticleEmitter::UpdateBoundingBox()
+{
+    // conservative occludee bounds : particles and emitter position, defined even without particles
+    boundingBox_ = _instance->GetBoundingBox();
+    boundingBox_.Merge(MagicToUrho3D(GetMagicPosition()));
+    worldBoundingBox_ = boundingBox_;
+}
+
 void MagicParticleEmitter::DrawDebugGeometry(DebugRenderer* debug, bool depthTest)
 {
     if (debug && IsEnabledEffective())
     {
-        debug->AddBoundingBox(worldBoundingBox_, Color::RED, depthTest);
+        debug->AddBoundingBox(GetWorldBoundingBox(), Color::RED, depthTest);
     }
 }
 
-void MagicParticleEmitter::SaveAttributes(MAGIC_RENDERING_START* start)
-{
-    _renderingStart = *start;
-}
-
 void MagicParticleEmitter::SetEffect(MagicParticleEffect* effect, int index)
 {
     if (effect == _effect && index == _index)
         return;
 
-    if (_magicEmitter > 0)
-    {
-        Stop();
-
-        Magic_UnloadEmitter(_magicEmitter);
-        _magicEmitter = 0;
-    }
+    ReleaseInstance();
 
     _effect = effect;
     _index = index;
 
-    if (_effect && _index >= 0)
-    {
-        HM_EMITTER emitter = _effect->GetEmitter(_index);
-        if (emitter > 0)
-        {
-            // Create new emitter
-            _magicEmitter = Magic_DuplicateEmitter(emitter);
+    Restart();
+}
 
-            // Calculating bounding box every frame
-            Magic_SetBBoxPeriod(_magicEmitter, 1);
+void MagicParticleEmitter::AcquireInstance()
+{
+    if (_instance || _master || !_effect || _index < 0)
+        return;
 
-            // Set position and diretion modes
-            Magic_SetEmitterPositionMode(_magicEmitter, _moveParticlesWithEmitter);
-            Magic_SetEmitterDirectionMode(_magicEmitter, _rotateParticlesWithEmitter);
+    // instanced : draw the master of emitter template, phase and rotation
+    if (_instanced)
+    {
+        if (!_instancing)
+            return;
 
-            Restart();
+        unsigned phase = _phase >= 0 ? (unsigned)_phase : (node_ ? node_->GetID() : 0);
+        Quaternion rotation = node_ ? node_->GetWorldRotation() : Quaternion::IDENTITY;
+        _master = _instancing->AcquireMaster(_effect, _index, phase, rotation, this);
+        if (_master)
+        {
+            _magicEmitter = _master->GetInstance()->GetEmitter();
+            _nodeRotation = rotation;
+            UpdateInstanceTransform();
         }
+        return;
+    }
+
+    // Get a pooled instance of the emitter
+    _instance = _effect->AcquireInstance(_index);
+    if (_instance)
+    {
+        _magicEmitter = _instance->GetEmitter();
+        _instance->SetOwnerID(node_ ? node_->GetID() : 0);
+
+        // Set position and diretion modes
+        PostMoveModes();
     }
 }
 
+void MagicParticleEmitter::ReleaseInstance()
+{
+    if (!_instance && !_master)
+        return;
+
+    Stop();
+
+    // geometries go back to the pool with the instance
+    batches_.Clear();
+
+    if (_master)
+        _instancing->ReleaseMaster(_master, this);
+    else
+        _effect->ReleaseInstance(_instance);
+
+    _instance = nullptr;
+    _master = nullptr;
+    _magicEmitter = 0;
+}
+
+void MagicParticleEmitter::SetState(MP_EMITTER_STATE state)
+{
+    _state = state;
+    UpdateEventSubscription();
+}
+
+void MagicParticleEmitter::UpdateEventSubscription()
+{
+    bool needUpdate = _instance && GetScene() && IsEnabledEffective() &&
+            (_state == MP_EMITTER_PLAYING || _state == MP_EMITTER_STOPPING);
+
+    if (needUpdate && !HasSubscribedToEvent(E_UPDATE))
+        SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(MagicParticleEmitter, HandleUpdate));
+    else if (!needUpdate && HasSubscribedToEvent(E_UPDATE))
+        UnsubscribeFromEvent(E_UPDATE);
+}
+
+void MagicParticleEmitter::Finish()
+{
+    _instance->ClearRendering();
+    batches_.Clear();
+    SetState(MP_EMITTER_FINISHED);
+
+    if (_autoRelease)
+        ReleaseInstance();
+
+    // notify, receivers are allowed to remove the node
+    using namespace MagicParticleFinished;
+
+    VariantMap& eventData = GetEventDataMap();
+    eventData[P_NODE] = node_;
+    eventData[P_EMITTER] = this;
+    eventData[P_EFFECT] = _effect.Get();
+    eventData[P_INDEX] = _index;
+
+    node_->SendEvent(E_MAGICPARTICLEFINISHED, eventData);
+}
+
 void MagicParticleEmitter::SetEmitterPosition(Vector3 pos)
 {
     if(_magicEmitter)
@@ -474,13 +476,41 @@ void MagicParticleEmitter::SetOverrideEmitterRotation(bool override)
 void MagicParticleEmitter::SetParticlesMoveWithEmitter(bool moveWithEmitter)
 {
     _moveParticlesWithEmitter = moveWithEmitter;
-    Magic_SetEmitterPositionMode(_magicEmitter, moveWithEmitter);
+    PostMoveModes();
 }
 
 void MagicParticleEmitter::SetParticlesRotateWithEmitter(bool rotateWithEmitter)
 {
     _rotateParticlesWithEmitter = rotateWithEmitter;
-    Magic_SetEmitterDirectionMode(_magicEmitter, rotateWithEmitter);
+    PostMoveModes();
+}
+
+void MagicParticleEmitter::PostMoveModes()
+{
+    MP_SIM_COMMAND command(MP_SIM_MOVE_MODES, _instance);
+    command.flag = _moveParticlesWithEmitter;
+    command.flag2 = _rotateParticlesWithEmitter;
+    PostCommand(command);
+}
+
+void MagicParticleEmitter::PostCommand(const MP_SIM_COMMAND& command)
+{
+    if (!command.instance)
+        return;
+
+    if (_simulation)
+        _simulation->Post(command);
+    else
+        MagicParticleSimulation::Execute(command);
+}
+
+MAGIC_POSITION MagicParticleEmitter::GetMagicPosition() const
+{
+    MAGIC_POSITION emPos;
+    emPos.x = _emitterPos.x + node_->GetWorldPosition().x_ * SCALE_URHO3D_TO_MAGIC;
+    emPos.y = _emitterPos.y + node_->GetWorldPosition().y_ * SCALE_URHO3D_TO_MAGIC;
+    emPos.z = _emitterPos.z + node_->GetWorldPosition().z_ * SCALE_URHO3D_TO_MAGIC;
+    return emPos;
 }
 
 void MagicParticleEmitter::SetEffect(MagicParticleEffect* effect)
@@ -495,221 +525,147 @@ void MagicParticleEmitter::SetIndex(int index)
 
 void MagicParticleEmitter::Restart()
 {
+    // instance may have been released when finished
+    AcquireInstance();
+
+    // instanced : master is shared and never restarted, only drawn again
+    if (_master)
+    {
+        SetState(MP_EMITTER_PLAYING);
+        if (node_)
+            OnMarkedDirty(node_);
+        return;
+    }
+
     if (_magicEmitter > 0)
     {
-        Magic_Restart(_magicEmitter);
+        MP_SIM_COMMAND command(MP_SIM_RESTART, _instance);
+        command.position = GetMagicPosition();
+        PostCommand(command);
 
-        // start emitter to interval 1
-        if (Magic_IsInterval1(_magicEmitter))
-        {
-            MAGIC_POSITION emPos;
-            emPos.x = _emitterPos.x + node_->GetWorldPosition().x_ * SCALE_URHO3D_TO_MAGIC;
-            emPos.y = _emitterPos.y + node_->GetWorldPosition().y_ * SCALE_URHO3D_TO_MAGIC;
-            emPos.z = _emitterPos.z + node_->GetWorldPosition().z_ * SCALE_URHO3D_TO_MAGIC;
-            Magic_SetEmitterPosition(_magicEmitter, &emPos);
+        // results of simulation jobs started before the restart are outdated
+        if (_simulation)
+            _restartJob = _simulation->GetNumJobs();
 
-            Magic_EmitterToInterval1(_magicEmitter, 1.f, 0);
-        }
+        SetState(MP_EMITTER_PLAYING);
     }
 }
 
 void MagicParticleEmitter::Stop()
 {
-    if (_magicEmitter > 0)
-        Magic_Stop(_magicEmitter);
-    memset(&_renderingStart, 0, sizeof(MAGIC_RENDERING_START));
-}
+    if (_instance)
+    {
+        PostCommand(MP_SIM_COMMAND(MP_SIM_STOP, _instance));
+        _instance->ClearViews();
+    }
 
-void MagicParticleEmitter::Pause()
-{
-    if (_magicEmitter > 0)
-        Magic_SetInterrupt(_magicEmitter, true);
+    batches_.Clear();
+    SetState(MP_EMITTER_FINISHED);
 }
 
-void MagicParticleEmitter::Resume()
+void MagicParticleEmitter::Pause()
 {
-    if (_magicEmitter > 0)
-        Magic_SetInterrupt(_magicEmitter, false);
-}
+    if (_state != MP_EMITTER_PLAYING && _state != MP_EMITTER_STOPPING)
+        return;
 
-MagicParticleEffect* MagicParticleEmitter::GetEffect() const
-{
-    return _effect;
+    // simulation is not updated anymore, batches keep the last geometry
+    _resumeState = _state;
+    SetState(MP_EMITTER_PAUSED);
 }
 
-String MagicParticleEmitter::GetEmitterName()
-{
-    return String(Magic_GetEmitterName(_magicEmitter));
-}
-
-int MagicParticleEmitter::GetParticlesCount()
+void MagicParticleEmitter::Resume()
 {
-    return _renderingStart.particles;
+    if (_state == MP_EMITTER_PAUSED)
+        SetState(_resumeState);
 }
 
-void MagicParticleEmitter::ResetStates()
+void MagicParticleEmitter::StopEmitting()
 {
-    // Reset all states to default.
-
-    // Textures
-    for (unsigned i=0; i<MAX_TEX_STAGE; i++)
+    // shared master keeps emitting for other instances
+    if (_master)
     {
-        TEX_STAGE* s = &(stages[i]);
-        s->address_u = MAX_ADDRESSMODES;
-        s->address_v = MAX_ADDRESSMODES;
-        s->uTexture = nullptr;
+        Stop();
+        return;
     }
 
-    // Blending
-    STATE_BLENDING = MAX_BLENDMODES;
+    if (_state == MP_EMITTER_PAUSED)
+        _resumeState = MP_EMITTER_STOPPING;
+    else if (_state != MP_EMITTER_PLAYING)
+        return;
 
-    // Depth write on/off
-    STATE_ZWRITE = true;
+    // interrupted emitter creates no more particles and ends when the existing ones are gone
+    MP_SIM_COMMAND command(MP_SIM_INTERRUPT, _instance);
+    command.flag = true;
+    PostCommand(command);
 
-    // State hash key
-    _stateHashKey = 0;
+    if (_state == MP_EMITTER_PLAYING)
+        SetState(MP_EMITTER_STOPPING);
 }
 
-void MagicParticleEmitter::SetRenderNothing(MAGIC_RENDER_STATE* s)
+void MagicParticleEmitter::SetAutoRelease(bool enable)
 {
-    // use this for non implemented states.
+    _autoRelease = enable;
+
+    if (_autoRelease && _state == MP_EMITTER_FINISHED)
+        ReleaseInstance();
 }
 
-extern unsigned int hash(unsigned int x);
-void MagicParticleEmitter::SetRenderTexture(MAGIC_RENDER_STATE* s)
+void MagicParticleEmitter::SetSortMode(MP_SORT_MODE mode)
 {
-    // state = MAGIC_RENDER_STATE_TEXTURE - setting of texture.
-    // value = index of textural atlas, which was created by API.
-    // index = index of stage for the setting of textural atlas.
-
-    TEX_STAGE* stage = &(stages[s->index]);
-    stage->uTexture = _effect->GetTexture(s->value);  
-
-    // compute hash key using texture value and index (see : MagicParticleEffect::GetMaterial)
-    //_stateHashKey += hash(s->value);
-    //_stateHashKey += hash(s->index);
-    _stateHashKey += stage->uTexture->GetNameHash().ToHash();
+    _sortMode = mode;
 }
 
-BlendMode URHO_BLEND_MODE[] = { BLEND_ALPHA, BLEND_ADDALPHA, BLEND_REPLACE };
-void MagicParticleEmitter::SetRenderBlending(MAGIC_RENDER_STATE* s)
+void MagicParticleEmitter::SetInstanced(bool enable)
 {
-    // state = MAGIC_RENDER_STATE_BLENDING - blending.
-    // value = 0 - usual blending.
-    // value = 1 - additional blending.
-    // value = 2 - without blending.
+    if (enable == _instanced)
+        return;
 
-    STATE_BLENDING = URHO_BLEND_MODE[s->value];
+    bool running = _instance || _master;
+    ReleaseInstance();
+    _instanced = enable;
 
-    // compute hash key using blending value (see : MagicParticleEffect::GetMaterial)
-    _stateHashKey += hash(s->value);	
+    if (running)
+        Restart();
 }
 
-TextureAddressMode URHO_ADDRESS_UV_MODE[] = { ADDRESS_WRAP, ADDRESS_MIRROR, ADDRESS_CLAMP, ADDRESS_BORDER };
-void MagicParticleEmitter::SetRenderAddressU(MAGIC_RENDER_STATE* s)
+void MagicParticleEmitter::SetPhase(int phase)
 {
-    // state = MAGIC_RENDER_STATE_ADDRESS_U - setting of addressing of textural U-coordinate.
-    // value = way of addressing (MAGIC_TEXADDRESS_WRAP, MAGIC_TEXADDRESS_MIRROR, MAGIC_TEXADDRESS_CLAMP, MAGIC_TEXADDRESS_BORDER).
-    // index = index of stage of texture for setting.
+    if (phase == _phase)
+        return;
 
-    TEX_STAGE* stage = &(stages[s->index]);
-    stage->address_u = URHO_ADDRESS_UV_MODE[s->value];
+    bool running = _master != nullptr;
+    ReleaseInstance();
+    _phase = phase;
 
-    //_stateHashKey += hash(s->index);
-    //_stateHashKey += hash(s->value);
+    if (running)
+        Restart();
 }
 
-void MagicParticleEmitter::SetRenderZWrite(MAGIC_RENDER_STATE* s)
+MagicParticleEffect* MagicParticleEmitter::GetEffect() const
 {
-    // state = MAGIC_RENDER_STATE_ZWRITE - disable/enable the change of Z-buffer
-    // value = 0 (enable) / 1 (disable).
-
-    STATE_ZWRITE = s->value;
+    return _effect;
 }
 
-void MagicParticleEmitter::SetRenderAddressV(MAGIC_RENDER_STATE* s)
+String MagicParticleEmitter::GetEmitterName()
 {
-    // state = MAGIC_RENDER_STATE_ADDRESS_V - setting of addressing of textural V-coordinate.
-    // value = way of addressing (MAGIC_TEXADDRESS_WRAP, MAGIC_TEXADDRESS_MIRROR, MAGIC_TEXADDRESS_CLAMP, MAGIC_TEXADDRESS_BORDER).
-    // index = index of stage of texture for setting.
+    if (!_magicEmitter)
+        return String::EMPTY;
 
-    TEX_STAGE* stage = &(stages[s->index]);
-    stage->address_v = URHO_ADDRESS_UV_MODE[s->value];
-
-    //_stateHashKey += hash(s->index);
-    //_stateHashKey += hash(s->value);
+    return String(Magic_GetEmitterName(_magicEmitter));
 }
 
-// Init array of poinet to function with adresses of functions for all MAGIC states.
-MagicParticleEmitter::StateFuncPtr MagicParticleEmitter::_stateFuncPointer[] = {
-    &MagicParticleEmitter::SetRenderBlending,   // MAGIC_RENDER_STATE_BLENDING
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_TEXTURE_COUNT
-    &MagicParticleEmitter::SetRenderTexture,    // MAGIC_RENDER_STATE_TEXTURE
-    &MagicParticleEmitter::SetRenderAddressU,   // MAGIC_RENDER_STATE_ADDRESS_U
-    &MagicParticleEmitter::SetRenderAddressV,   // MAGIC_RENDER_STATE_ADDRESS_V
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_OPERATION_RGB
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_ARGUMENT1_RGB
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_ARGUMENT2_RGB
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_OPERATION_ALPHA
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_ARGUMENT1_ALPHA
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_ARGUMENT2_ALPHA
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_ZENABLE
-    &MagicParticleEmitter::SetRenderZWrite,     // MAGIC_RENDER_STATE_ZWRITE
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_ALPHATEST_INIT
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_ALPHATEST
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_TECHNIQUE_ON
-    &MagicParticleEmitter::SetRenderNothing,    // MAGIC_RENDER_STATE_TECHNIQUE_OFF
-};
-
-void MagicParticleEmitter::SetRenderState(MAGIC_RENDER_STATE* state)
+int MagicParticleEmitter::GetParticlesCount()
 {
-    MP_ASSERT(state->state != MAGIC_RENDER_STATE__ERROR || state->state != MAGIC_RENDER_STATE__MAX);
-
-    // use a pointer to function to call the right state.
-    (this->*_stateFuncPointer[state->state])(state);
+    // instanced emitters report the particles of their master
+    MagicEmitterInstance* instance = _master ? _master->GetInstance() : _instance;
+    return instance ? instance->GetParticlesCount() : 0;
 }
 
-Material* MagicParticleEmitter::GetRenderMaterial(int matIndex)
+const MP_COUNTERS& MagicParticleEmitter::GetCounters() const
 {
-    bool newMaterial;
-
-    // get material from magic material index and texture hash value
-    Material* mat = _effect->GetMaterial(matIndex, _stateHashKey, newMaterial);
-    MP_ASSERT(mat);
-
-    // Assign textures and states to material if new one has been created.
-    if(newMaterial)
-    {
-        // Textures.
-        for (unsigned i=0; i<MAX_TEX_STAGE; i++)
-        {
-            TEX_STAGE* s=&(stages[i]);
-            if(s->uTexture != 0)
-            {
-                // check if uv address mode have been set for this texture
-                MP_ASSERT(s->address_u != MAX_ADDRESSMODES);
-                MP_ASSERT(s->address_v != MAX_ADDRESSMODES);
-
-                // assign adress coord mode
-                s->uTexture->SetAddressMode(COORD_U, s->address_u);
-                s->uTexture->SetAddressMode(COORD_V, s->address_v);
-
-                // assign textures
-                mat->SetTexture(TextureUnit(i), s->uTexture);
-            }
-        }
-
-        Pass* pass = mat->GetPass(0, "alpha");
-
-        // Blending.
-        MP_ASSERT(STATE_BLENDING != MAX_BLENDMODES);
-        pass->SetBlendMode(STATE_BLENDING);
-
-        // Depth write.
-        pass->SetDepthWrite(STATE_ZWRITE);
-    }
-
-    return mat;
+    static const MP_COUNTERS noCounters;
+    MagicEmitterInstance* instance = _master ? _master->GetInstance() : _instance;
+    return instance ? instance->GetCounters() : noCounters;
 }
 
 }
@@ -1,51 +1,32 @@
 #pragma once
 
 #include "MagicParticleEffect.h"
+#include "MagicEmitterInstance.h"
+#include "MagicParticleView.h"
+#include "MagicParticleSimulation.h"
 #include "Magic.h"
 
 namespace Urho3D
 {
 
-/// structure for description of one array of attribute.
-struct MP_ARRAY_INFO : public MAGIC_ARRAY_INFO
-{
-    int stage;
-    void* buffer;
-    int offset;
-    int stride;
-};
-
-/// Base buffer structure for vertex and index buffers.
-struct MP_BUFFER
-{
-    int max_length;
-    int length;
+class MagicEmitterMaster;
+class MagicParticleInstancing;
 
-    MP_BUFFER();
-    virtual ~MP_BUFFER();
-
-    void SetLength(int new_length);
-    virtual void Create(int new_length);
-    virtual void Destroy();
-    virtual void* Map(int stride) { return nullptr; }
-};
-
-/// Buffer data for vertex and index buffers.
-struct MP_BUFFER_RAM : public MP_BUFFER
+/// Emitter lifecycle state.
+enum MP_EMITTER_STATE
 {
-    char* buffer;
-
-    MP_BUFFER_RAM();
-    virtual ~MP_BUFFER_RAM();
-
-    virtual void Create(int new_length);
-    virtual void Destroy();
-    virtual void* Map(int stride) { return buffer; }
+    MP_EMITTER_PLAYING = 0,     // simulated and rendered each frame
+    MP_EMITTER_PAUSED,          // frozen, last geometry is kept, no per-frame work
+    MP_EMITTER_STOPPING,        // no more particles emitted, finishes when the last particle dies
+    MP_EMITTER_FINISHED         // nothing to simulate nor render, no per-frame work
 };
 
-
 ///-------------------------------------------------------------------------------------------------
 /// Manage and Render a Magic particle emitter.
+/// Instanced emitters have no simulation of their own : they draw the shared master of their
+/// emitter template, phase and node world rotation with their node transform. Billboards and
+/// sorting of a master are filled for the rotation of its instances, node rotations snapped to
+/// the instancing rotation step are drawn with the snapped one (see MagicParticleInstancing).
 ///-------------------------------------------------------------------------------------------------
 class URHO3D_API MagicParticleEmitter : public Drawable
 {
@@ -70,8 +51,6 @@ public:
     virtual void UpdateBatches(const FrameInfo& frame);
     /// Visualize the component as debug geometry.
     virtual void DrawDebugGeometry(DebugRenderer* debug, bool depthTest);
-    /// Return whether a geometry update is necessary, and if it can happen in a worker thread.
-    virtual UpdateGeometryType GetUpdateGeometryType() { return UPDATE_NONE; }
 
     /// Set effect and emitter index.
     void SetEffect(MagicParticleEffect* effect, int index);
@@ -83,10 +62,20 @@ public:
     void Restart();
     /// Stop.
     void Stop();
-    /// Pause.
+    /// Pause. Simulation is frozen and last geometry is kept until Resume.
     void Pause();
     /// Resume.
     void Resume();
+    /// Stop emitting new particles, emitter finishes when the last particle dies.
+    void StopEmitting();
+    /// Set whether the emitter instance is given back to the effect pool when finished. Restart acquires a new one.
+    void SetAutoRelease(bool enable);
+    /// Set particles sorting mode, overrides effect sorting policy unless MP_SORT_AUTO (default).
+    void SetSortMode(MP_SORT_MODE mode);
+    /// Set whether the emitter draws a master simulation shared by identical emitters with the same node world rotation. Pause does not freeze instanced emitters, they do not collide with MagicParticleObstacles.
+    void SetInstanced(bool enable);
+    /// Set phase of instanced emitter, -1 to pick it from node ID (default).
+    void SetPhase(int phase);
 
     /// Return effect.
     MagicParticleEffect* GetEffect() const;
@@ -96,6 +85,18 @@ public:
     String GetEmitterName();
     /// Get the number of the drawing particles.
     int GetParticlesCount();
+    /// Return performance counters of the current frame.
+    const MP_COUNTERS& GetCounters() const;
+    /// Return lifecycle state.
+    MP_EMITTER_STATE GetState() const { return _state; }
+    /// Return whether emitter instance is released when finished.
+    bool GetAutoRelease() const { return _autoRelease; }
+    /// Return particles sorting mode.
+    MP_SORT_MODE GetSortMode() const { return _sortMode; }
+    /// Return whether the emitter is instanced.
+    bool IsInstanced() const { return _instanced; }
+    /// Return phase of instanced emitter.
+    int GetPhase() const { return _phase; }
 
     /// If true, particles are moving with the emitter when it is being moved, else particles remain at their positions when emitter is moved.
     void SetParticlesMoveWithEmitter(bool moveWithEmitter);
@@ -110,96 +111,77 @@ public:
 private:
     /// Handle node being assigned.
     virtual void OnNodeSet(Node* node);
+    /// Handle node transform being dirtied.
+    virtual void OnMarkedDirty(Node* node);
     /// Recalculate the world-space bounding box.
     virtual void OnWorldBoundingBoxUpdate();
     /// Handle particles update, create and render geometries.
     void HandleUpdate(StringHash eventType,VariantMap& eventData);
-    /// Save attributes rendering.
-    void SaveAttributes(MAGIC_RENDERING_START* start);
-    /// Map vertex and index buffers.
-    void MapBuffers(MAGIC_ARRAY_INFO* vertex_info, MAGIC_ARRAY_INFO* index_info);
+    /// Get an emitter instance from the effect pool.
+    void AcquireInstance();
+    /// Give back emitter instance to the effect pool.
+    void ReleaseInstance();
+    /// Set lifecycle state and subscribe/unsubscribe to update event accordingly.
+    void SetState(MP_EMITTER_STATE state);
+    /// Subscribe to update event only when there is something to simulate.
+    void UpdateEventSubscription();
+    /// Handle end of simulation : clear geometry, release instance and send finished event.
+    void Finish();
+    /// Run a command on emitter instance now, or on the simulation thread in pipelined mode.
+    void PostCommand(const MP_SIM_COMMAND& command);
+    /// Post particles move and rotate with emitter modes.
+    void PostMoveModes();
+    /// Return emitter position in Magic space.
+    MAGIC_POSITION GetMagicPosition() const;
+    /// Set bounding box from simulated particles and emitter position.
+    void UpdateBoundingBox();
+    /// Prepare batches drawing the master geometry of view with node transform.
+    void UpdateInstancedBatches(const FrameInfo& frame);
+    /// Draw the master of node world rotation, and set instance transform with the master rotation.
+    void UpdateInstanceTransform();
 
-    /// Reset all states.
-    void ResetStates();
-    /// Set render state.
-    void SetRenderState(MAGIC_RENDER_STATE* state);
-    /// Fake state.
-    void SetRenderNothing(MAGIC_RENDER_STATE* s);
-    /// Texture state.
-    void SetRenderTexture(MAGIC_RENDER_STATE* s);
-    /// Blending state.
-    void SetRenderBlending(MAGIC_RENDER_STATE* s);
-    /// Texture coord adresse mode.
-    void SetRenderAddressU(MAGIC_RENDER_STATE* s);
-    /// Texture coord adresse mode.
-    void SetRenderAddressV(MAGIC_RENDER_STATE* s);
-    /// Enable/Disable Depth write.
-    void SetRenderZWrite(MAGIC_RENDER_STATE* s);
-    /// Get material from index.
-    Material* GetRenderMaterial(int matIndex);
-
-    /// Vertex elements used to define vertex format.
-    PODVector<VertexElement> _vertexElements;
-    /// Index buffer.
-    SharedPtr<IndexBuffer> _indexBuffer;
-    /// Vertex buffer.
-    SharedPtr<VertexBuffer> _vertexBuffer;
-    /// Geometries.
-    Vector<SharedPtr<Geometry> > _geometries;
     /// Magic particle effect.
     SharedPtr<MagicParticleEffect> _effect;
     /// Emitter index.
     int _index;
     /// Emitter instance.
     HM_EMITTER _magicEmitter;
-    /// Batch indices to render.
-    PODVector<MAGIC_RENDER_VERTICES> _drawBatches;    
-    /// Array info for vertex and index buffers.
-    MP_ARRAY_INFO _m_array_info[2];
-    /// Buffer Data for vertices.
-    MP_BUFFER* _mp_vertex_buffer;
-    /// Buffer Data for indices.
-    MP_BUFFER* _mp_index_buffer;
-    /// Rendering infos.
-    MAGIC_RENDERING_START _renderingStart;
-    /// Is drawable visible by camera
-    bool _isVisible;
+    /// Pooled emitter instance owning the emitter and its buffers.
+    MagicEmitterInstance* _instance;
     /// override emitter rotation flag
     bool _overrideEmitterRotation;
     /// move particles with emitter flag
     bool _moveParticlesWithEmitter;
     /// rotate particles with emitter flag
     bool _rotateParticlesWithEmitter;
-    /// Camera pointer
-    Node* _cameraNode;
-    /// Graphics subsystem pointer.
-    Graphics* _graphics;
-
-
-    /// Define pointer to function type for render state pointer to functions.
-    typedef void (MagicParticleEmitter::*StateFuncPtr)(MAGIC_RENDER_STATE* s);
-    /// Array of pointers to functions to collect render states.
-    static StateFuncPtr _stateFuncPointer[];
-
-    /// Texture state structure.
-    struct TEX_STAGE
-    {
-        /// Texture adress mode.
-        TextureAddressMode address_u, address_v;
-        /// Pointer to texture.
-        Texture2D* uTexture;
-    };
-
-    /// Max textures per stage.
-    static const unsigned int MAX_TEX_STAGE = 16;
-    /// Array of texture stage.
-    TEX_STAGE stages[MAX_TEX_STAGE];
-    /// Blending state.
-    BlendMode STATE_BLENDING;
-    /// Render state hash key used to identify states.
-    unsigned _stateHashKey;
-
-    bool STATE_ZWRITE;
+    /// Cameras rendering the emitter.
+    MagicViewList _views;
+    /// Lifecycle state.
+    MP_EMITTER_STATE _state;
+    /// State to go back to on resume.
+    MP_EMITTER_STATE _resumeState;
+    /// Release instance when finished flag
+    bool _autoRelease;
+    /// Particles sorting mode.
+    MP_SORT_MODE _sortMode;
+    /// Simulation subsystem.
+    MagicParticleSimulation* _simulation;
+    /// Global stats subsystem.
+    MagicParticleStats* _stats;
+    /// Number of simulation jobs when restarted, results of older jobs are ignored.
+    unsigned _restartJob;
+    /// Instanced flag.
+    bool _instanced;
+    /// Phase of instanced emitter, -1 for automatic.
+    int _phase;
+    /// Shared master drawn when instanced.
+    MagicEmitterMaster* _master;
+    /// World transform of instanced emitter, with the master rotation.
+    Matrix3x4 _instanceTransform;
+    /// Node world rotation the master was chosen for.
+    Quaternion _nodeRotation;
+    /// Instancing subsystem.
+    MagicParticleInstancing* _instancing;
 };
 
 }
@@ -0,0 +1,120 @@
+#include "MagicParticleEventStream.h"
+#include "MagicParticleEvents.h"
+#include "MagicParticleSimulation.h"
+#include "MagicParticleTimeline.h"
+#include "MagicParticleUtils.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+MagicParticleEventStream::MagicParticleEventStream(Context* context) :
+    Object(context)
+    , _filter((1u << MAGIC_EVENT_COLLISION) | (1u << MAGIC_EVENT_MAGNET) | (1u << MAGIC_EVENT_WIND))
+    , _maxEvents(4096)
+    , _nextDropped(0)
+    , _numDropped(0)
+{
+    SubscribeToEvent(E_BEGINFRAME, URHO3D_HANDLER(MagicParticleEventStream, HandleBeginFrame));
+    SubscribeToEvent(E_POSTUPDATE, URHO3D_HANDLER(MagicParticleEventStream, HandlePostUpdate));
+}
+
+MagicParticleEventStream::~MagicParticleEventStream()
+{
+}
+
+void MagicParticleEventStream::SetEventFilter(MAGIC_EVENT_ENUM type, bool enable)
+{
+    if (type < 0 || type >= MAGIC_EVENT__MAX)
+        return;
+
+    if (enable)
+        _filter |= 1u << type;
+    else
+        _filter &= ~(1u << type);
+}
+
+void MagicParticleEventStream::Drain(HM_EMITTER emitter, unsigned ownerID)
+{
+    MP_TIMELINE_SCOPE("EventDrain", emitter);
+
+    // always empty the queue, filtered events would be attributed to next emitter
+    MAGIC_EVENT evt;
+    while (Magic_GetNextEvent(&evt) == MAGIC_SUCCESS)
+    {
+        if (!(_filter & (1u << evt.event)))
+            continue;
+
+        if (_nextTypes.Size() >= _maxEvents)
+        {
+            ++_nextDropped;
+            continue;
+        }
+
+        _nextTypes.Push((unsigned char)evt.event);
+        _nextEmitters.Push(emitter);
+        _nextOwners.Push(ownerID);
+        _nextPositions.Push(MagicToUrho3D(evt.position1));
+        _nextReflections.Push(MagicToUrho3D(evt.reflection));
+        _nextParticles.Push(evt.hmParticle);
+    }
+}
+
+void MagicParticleEventStream::Discard()
+{
+    MAGIC_EVENT evt;
+    while (Magic_GetNextEvent(&evt) == MAGIC_SUCCESS)
+        ;
+}
+
+void MagicParticleEventStream::HandleBeginFrame(StringHash eventType, VariantMap& eventData)
+{
+    MagicParticleSimulation* simulation = GetSubsystem<MagicParticleSimulation>();
+    if (!simulation || !simulation->IsPipelined())
+        return;
+
+    // events of the job started at last post update
+    simulation->Wait();
+    Publish();
+}
+
+void MagicParticleEventStream::HandlePostUpdate(StringHash eventType, VariantMap& eventData)
+{
+    MagicParticleSimulation* simulation = GetSubsystem<MagicParticleSimulation>();
+    if (simulation && simulation->IsPipelined())
+        return;
+
+    Publish();
+}
+
+void MagicParticleEventStream::Publish()
+{
+    _types.Swap(_nextTypes);
+    _emitters.Swap(_nextEmitters);
+    _owners.Swap(_nextOwners);
+    _positions.Swap(_nextPositions);
+    _reflections.Swap(_nextReflections);
+    _particles.Swap(_nextParticles);
+    _numDropped = _nextDropped;
+
+    _nextTypes.Clear();
+    _nextEmitters.Clear();
+    _nextOwners.Clear();
+    _nextPositions.Clear();
+    _nextReflections.Clear();
+    _nextParticles.Clear();
+    _nextDropped = 0;
+
+    if (_types.Empty() && !_numDropped)
+        return;
+
+    using namespace MagicParticleEvents;
+
+    VariantMap& eventData = GetEventDataMap();
+    eventData[P_STREAM] = this;
+    eventData[P_COUNT] = _types.Size();
+    eventData[P_DROPPED] = _numDropped;
+    SendEvent(E_MAGICPARTICLEEVENTS, eventData);
+}
+
+}
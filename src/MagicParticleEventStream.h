@@ -0,0 +1,101 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+#include "Magic.h"
+
+namespace Urho3D
+{
+
+///-------------------------------------------------------------------------------------------------
+/// Magic particles event stream subsystem.
+/// Magic queues particle events (creation, destruction, collision, magnet, wind) in one global
+/// queue, it is drained right after each emitter update so that events are attributed to their
+/// emitter. Events passing the type filter are stored in flat arrays, one entry per event,
+/// and published once per frame with a single E_MAGICPARTICLEEVENTS event.
+/// Events are collected by the thread running the simulation and published on main thread while
+/// the simulation is idle : after E_POSTUPDATE, or at next E_BEGINFRAME when pipelined.
+///-------------------------------------------------------------------------------------------------
+class URHO3D_API MagicParticleEventStream : public Object
+{
+    URHO3D_OBJECT(MagicParticleEventStream, Object)
+
+public:
+    /// Construct.
+    MagicParticleEventStream(Context* context);
+    /// Destruct.
+    virtual ~MagicParticleEventStream();
+
+    /// Enable or disable collection of an event type. Collision, magnet and wind are enabled by default.
+    void SetEventFilter(MAGIC_EVENT_ENUM type, bool enable);
+    /// Return whether an event type is collected.
+    bool GetEventFilter(MAGIC_EVENT_ENUM type) const { return (_filter & (1u << type)) != 0; }
+    /// Set maximum number of events collected per frame, next ones are dropped.
+    void SetMaxEvents(unsigned maxEvents) { _maxEvents = maxEvents; }
+    /// Return maximum number of events collected per frame.
+    unsigned GetMaxEvents() const { return _maxEvents; }
+
+    /// Drain Magic event queue after an emitter update and store filtered events.
+    void Drain(HM_EMITTER emitter, unsigned ownerID);
+    /// Drain Magic event queue and drop all events (prewarm).
+    void Discard();
+
+    /// Return number of events published for last frame.
+    unsigned GetNumEvents() const { return _types.Size(); }
+    /// Return number of events dropped last frame because of max events.
+    unsigned GetNumDropped() const { return _numDropped; }
+    /// Return event types (MAGIC_EVENT_ENUM).
+    const PODVector<unsigned char>& GetTypes() const { return _types; }
+    /// Return emitters of events.
+    const PODVector<HM_EMITTER>& GetEmitters() const { return _emitters; }
+    /// Return ID of owner nodes of emitters, 0 if unknown.
+    const PODVector<unsigned>& GetOwners() const { return _owners; }
+    /// Return world positions of particles.
+    const PODVector<Vector3>& GetPositions() const { return _positions; }
+    /// Return reflection vectors of collisions.
+    const PODVector<Vector3>& GetReflections() const { return _reflections; }
+    /// Return particles. Valid until next update of their emitter, e.g. for Magic_ParticleGetData.
+    const PODVector<HM_PARTICLE>& GetParticles() const { return _particles; }
+
+private:
+    /// Handle frame begin : publish events of pipelined simulation.
+    void HandleBeginFrame(StringHash eventType, VariantMap& eventData);
+    /// Handle post update : publish events of main thread simulation.
+    void HandlePostUpdate(StringHash eventType, VariantMap& eventData);
+    /// Exchange collected and published events and send E_MAGICPARTICLEEVENTS.
+    void Publish();
+
+    /// Published event types.
+    PODVector<unsigned char> _types;
+    /// Published emitters.
+    PODVector<HM_EMITTER> _emitters;
+    /// Published owner node IDs.
+    PODVector<unsigned> _owners;
+    /// Published positions.
+    PODVector<Vector3> _positions;
+    /// Published reflections.
+    PODVector<Vector3> _reflections;
+    /// Published particles.
+    PODVector<HM_PARTICLE> _particles;
+    /// Collected event types.
+    PODVector<unsigned char> _nextTypes;
+    /// Collected emitters.
+    PODVector<HM_EMITTER> _nextEmitters;
+    /// Collected owner node IDs.
+    PODVector<unsigned> _nextOwners;
+    /// Collected positions.
+    PODVector<Vector3> _nextPositions;
+    /// Collected reflections.
+    PODVector<Vector3> _nextReflections;
+    /// Collected particles.
+    PODVector<HM_PARTICLE> _nextParticles;
+    /// Collected event types, one bit per MAGIC_EVENT_ENUM value.
+    unsigned _filter;
+    /// Maximum number of events per frame.
+    unsigned _maxEvents;
+    /// Events dropped while collecting.
+    unsigned _nextDropped;
+    /// Events dropped last frame.
+    unsigned _numDropped;
+};
+
+}
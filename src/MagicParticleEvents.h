@@ -0,0 +1,25 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+/// Magic particle emitter has finished : no more particles alive and no more particles to emit.
+URHO3D_EVENT(E_MAGICPARTICLEFINISHED, MagicParticleFinished)
+{
+    URHO3D_PARAM(P_NODE, Node);                     // Node pointer
+    URHO3D_PARAM(P_EMITTER, Emitter);               // MagicParticleEmitter pointer
+    URHO3D_PARAM(P_EFFECT, Effect);                 // MagicParticleEffect pointer
+    URHO3D_PARAM(P_INDEX, Index);                   // int
+}
+
+/// Magic particle events collected during the frame, sent once per frame. Read them from the stream arrays.
+URHO3D_EVENT(E_MAGICPARTICLEEVENTS, MagicParticleEvents)
+{
+    URHO3D_PARAM(P_STREAM, Stream);                 // MagicParticleEventStream pointer
+    URHO3D_PARAM(P_COUNT, Count);                   // unsigned
+    URHO3D_PARAM(P_DROPPED, Dropped);               // unsigned
+}
+
+}
@@ -0,0 +1,309 @@
+#include "MagicParticleInstancing.h"
+#include "MagicParticleEmitter.h"
+#include "MagicParticleUtils.h"
+#include "MagicParticleTimeline.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+MagicEmitterMaster::MagicEmitterMaster(MagicParticleEffect* effect, int index, unsigned phase, const Quaternion& rotation, MagicEmitterInstance* instance) :
+    _effect(effect)
+    , _index(index)
+    , _phase(phase)
+    , _rotation(rotation)
+    , _instance(instance)
+    , _boundingBox(Vector3::ZERO, Vector3::ZERO)
+    , _restartJob(0)
+{
+}
+
+unsigned MagicEmitterMaster::AddView(Camera* camera, unsigned frameNumber, float distance, const Matrix3x4& transform, bool& filled)
+{
+    std::lock_guard<std::mutex> lock(_viewsMutex);
+
+    // another instance nearer to this camera registered it this frame
+    unsigned slot = _views.Find(camera);
+    if (slot == MagicViewList::NO_VIEW || _views.Get(slot).frameNumber != frameNumber || distance < _views.Get(slot).distance)
+    {
+        slot = _views.Add(camera, frameNumber, distance);
+        _viewTransforms.Resize(_views.Size());
+        _viewTransforms[slot] = transform;
+    }
+
+    filled = _views.IsFilled(slot);
+    return slot;
+}
+
+bool MagicEmitterMaster::GetMagicCamera(unsigned slot, MAGIC_CAMERA& magicCamera) const
+{
+    Camera* camera = _views.Get(slot).camera;
+    if (!camera)
+        return false;
+
+    // camera in local space of the nearest instance, direction from two transformed points to keep scale out
+    Node* cameraNode = camera->GetNode();
+    Matrix3x4 inverse = _viewTransforms[slot].Inverse();
+    Vector3 position = inverse * cameraNode->GetWorldPosition();
+    Vector3 direction = (inverse * (cameraNode->GetWorldPosition() + cameraNode->GetWorldDirection()) - position).Normalized();
+
+    magicCamera.pos = Urho3DToMagic(position);
+    magicCamera.dir = Urho3DToMagic(direction);
+    magicCamera.mode = MAGIC_CAMERA_FREE;
+    return true;
+}
+
+void MagicEmitterMaster::UpdateBoundingBox()
+{
+    BoundingBox box = _boundingBox;
+    box.Merge(_instance->GetBoundingBox());
+    if (box == _boundingBox)
+        return;
+
+    // instances recompute their world box from the grown one
+    _boundingBox = box;
+    for (unsigned i = 0; i < _users.Size(); ++i)
+    {
+        if (_users[i]->GetNode())
+            _users[i]->GetNode()->MarkDirty();
+    }
+}
+
+//----------------------------------------------------------------------------------------------------
+
+MagicParticleInstancing::MagicParticleInstancing(Context* context) :
+    Object(context)
+    , _numPhases(1)
+    , _phaseOffset(0.5f)
+    , _rotationStep(0.0f)
+{
+    _simulation = GetSubsystem<MagicParticleSimulation>();
+}
+
+MagicParticleInstancing::~MagicParticleInstancing()
+{
+    for (unsigned i = 0; i < _masters.Size(); ++i)
+    {
+        _masters[i]->GetEffect()->ReleaseInstance(_masters[i]->GetInstance());
+        delete _masters[i];
+    }
+}
+
+MagicEmitterMaster* MagicParticleInstancing::AcquireMaster(MagicParticleEffect* effect, int index, unsigned phase, const Quaternion& rotation, MagicParticleEmitter* user)
+{
+    if (!effect || index < 0)
+        return nullptr;
+
+    phase %= _numPhases;
+
+    // billboards and sorting are filled in local space of one instance : instances of a master share its rotation
+    MagicEmitterMaster* master = nullptr;
+    for (unsigned i = 0; i < _masters.Size() && !master; ++i)
+    {
+        if (_masters[i]->GetEffect() == effect && _masters[i]->GetIndex() == index && _masters[i]->GetPhase() == phase &&
+                MatchesRotation(_masters[i], rotation))
+            master = _masters[i];
+    }
+
+    if (!master)
+    {
+        MagicEmitterInstance* instance = effect->AcquireInstance(index);
+        if (!instance)
+            return nullptr;
+
+        master = new MagicEmitterMaster(effect, index, phase, SnapRotation(rotation), instance);
+        _masters.Push(master);
+
+        // local space : emitter at origin without rotation, instances are placed by their node
+        MP_SIM_COMMAND transform(MP_SIM_TRANSFORM, instance);
+        transform.position = Urho3DToMagic(Vector3::ZERO);
+        transform.direction = Urho3DToMagic(Quaternion::IDENTITY);
+        transform.flag = true;
+        transform.value = 1.0f;
+        PostCommand(transform);
+
+        Restart(master);
+
+        if (!HasSubscribedToEvent(E_UPDATE))
+            SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(MagicParticleInstancing, HandleUpdate));
+    }
+
+    master->GetUsers().Push(user);
+    return master;
+}
+
+void MagicParticleInstancing::ReleaseMaster(MagicEmitterMaster* master, MagicParticleEmitter* user)
+{
+    if (!master)
+        return;
+
+    master->GetUsers().Remove(user);
+    if (!master->GetUsers().Empty())
+        return;
+
+    master->GetEffect()->ReleaseInstance(master->GetInstance());
+    _masters.Remove(master);
+    delete master;
+
+    if (_masters.Empty())
+        UnsubscribeFromEvent(E_UPDATE);
+}
+
+void MagicParticleInstancing::SetNumPhases(unsigned numPhases)
+{
+    _numPhases = Max(numPhases, 1U);
+}
+
+void MagicParticleInstancing::SetPhaseOffset(float offset)
+{
+    _phaseOffset = Max(offset, 0.0f);
+}
+
+void MagicParticleInstancing::SetRotationStep(float step)
+{
+    _rotationStep = Max(step, 0.0f);
+}
+
+bool MagicParticleInstancing::MatchesRotation(const MagicEmitterMaster* master, const Quaternion& rotation) const
+{
+    // q and -q are the same rotation
+    return Abs(master->GetRotation().DotProduct(SnapRotation(rotation))) >= 1.0f - M_EPSILON;
+}
+
+Quaternion MagicParticleInstancing::SnapRotation(const Quaternion& rotation) const
+{
+    if (_rotationStep <= 0.0f)
+        return rotation;
+
+    Vector3 angles = rotation.EulerAngles();
+    angles.x_ = Round(angles.x_ / _rotationStep) * _rotationStep;
+    angles.y_ = Round(angles.y_ / _rotationStep) * _rotationStep;
+    angles.z_ = Round(angles.z_ / _rotationStep) * _rotationStep;
+    return Quaternion(angles.x_, angles.y_, angles.z_);
+}
+
+void MagicParticleInstancing::Restart(MagicEmitterMaster* master)
+{
+    MP_SIM_COMMAND restart(MP_SIM_RESTART, master->GetInstance());
+    restart.position = Urho3DToMagic(Vector3::ZERO);
+    PostCommand(restart);
+
+    // phases are shifted in time once, then all masters are updated with the frame time step
+    if (master->GetPhase())
+    {
+        MP_SIM_COMMAND update(MP_SIM_UPDATE, master->GetInstance());
+        update.time = 1000.0 * _phaseOffset * master->GetPhase();
+        update.sortMode = MP_SORT_AUTO;
+        PostCommand(update);
+    }
+
+    // results of simulation jobs started before the restart are outdated
+    if (_simulation)
+        master->SetRestartJob(_simulation->GetNumJobs());
+}
+
+void MagicParticleInstancing::PostCommand(const MP_SIM_COMMAND& command)
+{
+    if (_simulation)
+        _simulation->Post(command);
+    else
+        MagicParticleSimulation::Execute(command);
+}
+
+void MagicParticleInstancing::HandleUpdate(StringHash eventType, VariantMap& eventData)
+{
+    URHO3D_PROFILE(UpdateMagicInstancing);
+
+    using namespace Update;
+    double time = 1000.0 * eventData[P_TIMESTEP].GetFloat();
+
+    unsigned frameNumber = GetSubsystem<Time>()->GetFrameNumber();
+    bool pipelined = _simulation && _simulation->IsPipelined();
+
+    for (unsigned m = 0; m < _masters.Size(); ++m)
+    {
+        MagicEmitterMaster* master = _masters[m];
+        MagicEmitterInstance* instance = master->GetInstance();
+        MagicViewList& views = master->GetViews();
+
+        // views that rendered an instance in previous frame
+        unsigned nearest = views.GetNearest(frameNumber);
+        bool visible = nearest != MagicViewList::NO_VIEW;
+
+        // pipelined : present results of last simulation job, unless it ran before a restart
+        if (pipelined && _simulation->GetNumJobs() > master->GetRestartJob())
+        {
+            if (!instance->IsAlive())
+            {
+                Restart(master);
+                continue;
+            }
+
+            master->UpdateBoundingBox();
+
+            for (unsigned i = 0; i < views.Size(); ++i)
+            {
+                if (instance->Present(i))
+                    views.SetFilled(i);
+            }
+        }
+
+        // masters are always simulated : the cost does not depend on instances, and they are
+        // up to date when an instance is revealed
+
+        MP_SIM_COMMAND update(MP_SIM_UPDATE, instance);
+        update.time = time;
+        update.sortMode = MP_SORT_AUTO;
+        update.value = visible ? views.Get(nearest).distance : 0.0f;
+        update.hasCamera = visible && master->GetMagicCamera(nearest, update.camera);
+
+        if (pipelined)
+        {
+            // simulated after update, presented next frame
+            _simulation->Post(update);
+
+            for (unsigned i = 0; visible && i < views.Size(); ++i)
+            {
+                if (!views.IsActive(i, frameNumber))
+                    continue;
+
+                MP_SIM_COMMAND fill(MP_SIM_FILL, instance);
+                fill.view = i;
+                fill.hasCamera = master->GetMagicCamera(i, fill.camera);
+                fill.flag = true;
+                _simulation->Post(fill);
+            }
+            continue;
+        }
+
+        MagicParticleSimulation::Execute(update);
+
+        if (!instance->IsAlive())
+        {
+            Restart(master);
+            continue;
+        }
+
+        master->UpdateBoundingBox();
+
+        // fill once per view for all instances, batches are set by instances in UpdateBatches
+
+        for (unsigned i = 0; visible && i < views.Size(); ++i)
+        {
+            MAGIC_CAMERA camera;
+            if (!views.IsActive(i, frameNumber) || !master->GetMagicCamera(i, camera) || instance->SkipFill(i, camera))
+                continue;
+
+            {
+                MP_TIMELINE_SCOPE("CameraPush", 0);
+                Magic_SetCamera(&camera);
+            }
+
+            instance->Fill(&camera);
+            if (instance->Upload(i))
+                views.SetFilled(i);
+        }
+    }
+}
+
+}
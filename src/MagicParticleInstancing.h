@@ -0,0 +1,150 @@
+#pragma once
+
+#include "MagicParticleEffect.h"
+#include "MagicEmitterInstance.h"
+#include "MagicParticleView.h"
+#include "MagicParticleSimulation.h"
+#include "Magic.h"
+
+#include <mutex>
+
+namespace Urho3D
+{
+
+class MagicParticleEmitter;
+
+///-------------------------------------------------------------------------------------------------
+/// Shared simulation of an emitter template for instanced emitters.
+/// The master instance is simulated in local space at the origin, filled once per view and drawn
+/// by every instanced emitter with its node world position and scale and the master rotation,
+/// which all its instances share. Views are registered by the instances from UpdateBatches : each
+/// view keeps the transform of its nearest instance, the camera is moved into that local space
+/// for the fill so billboards face it correctly.
+///-------------------------------------------------------------------------------------------------
+class MagicEmitterMaster
+{
+public:
+    /// Construct with a pooled instance of emitter at index.
+    MagicEmitterMaster(MagicParticleEffect* effect, int index, unsigned phase, const Quaternion& rotation, MagicEmitterInstance* instance);
+
+    /// Register camera rendering an instance in current frame, nearest instance transform is kept. Thread-safe. Return view slot, filled is set if its geometry was uploaded.
+    unsigned AddView(Camera* camera, unsigned frameNumber, float distance, const Matrix3x4& transform, bool& filled);
+    /// Return Magic camera of view at slot in local space of its nearest instance. Return false if camera is gone.
+    bool GetMagicCamera(unsigned slot, MAGIC_CAMERA& magicCamera) const;
+    /// Merge simulated particles in the local bounding box, and move instances in the octree when it grew.
+    void UpdateBoundingBox();
+
+    /// Return effect.
+    MagicParticleEffect* GetEffect() const { return _effect; }
+    /// Return emitter index.
+    int GetIndex() const { return _index; }
+    /// Return phase.
+    unsigned GetPhase() const { return _phase; }
+    /// Return world rotation of instances.
+    const Quaternion& GetRotation() const { return _rotation; }
+    /// Return simulated instance.
+    MagicEmitterInstance* GetInstance() const { return _instance; }
+    /// Return local bounding box, grows with particles and never shrinks.
+    const BoundingBox& GetBoundingBox() const { return _boundingBox; }
+    /// Return instanced emitters drawing the master.
+    PODVector<MagicParticleEmitter*>& GetUsers() { return _users; }
+    /// Return cameras rendering the instances. Main thread only.
+    MagicViewList& GetViews() { return _views; }
+    /// Set number of simulation jobs at restart.
+    void SetRestartJob(unsigned job) { _restartJob = job; }
+    /// Return number of simulation jobs at restart.
+    unsigned GetRestartJob() const { return _restartJob; }
+
+private:
+    /// Magic particle effect.
+    SharedPtr<MagicParticleEffect> _effect;
+    /// Emitter index.
+    int _index;
+    /// Phase, simulated time offset in phase steps.
+    unsigned _phase;
+    /// World rotation of instances.
+    Quaternion _rotation;
+    /// Pooled emitter instance.
+    MagicEmitterInstance* _instance;
+    /// Instanced emitters drawing the master.
+    PODVector<MagicParticleEmitter*> _users;
+    /// Cameras rendering the instances.
+    MagicViewList _views;
+    /// Transform of the nearest instance per view.
+    PODVector<Matrix3x4> _viewTransforms;
+    /// Views lock, instances register from worker threads.
+    std::mutex _viewsMutex;
+    /// Local bounding box.
+    BoundingBox _boundingBox;
+    /// Number of simulation jobs when restarted, results of older jobs are ignored.
+    unsigned _restartJob;
+};
+
+///-------------------------------------------------------------------------------------------------
+/// Masters of instanced emitters (torches, candles, braziers...).
+/// Identical emitters set as instanced share one master simulation per emitter template, phase
+/// and world rotation, so simulation and fill cost depend on the number of phases and rotations
+/// instead of the number of emitters. Phases are masters prewarmed by a multiple of the phase
+/// offset, instances pick one to hide the repetition. Rotations are matched exactly unless a
+/// rotation step is set : node rotations are then snapped to it, so emitters turned by slightly
+/// different angles share a master and are drawn with its rotation. Billboards and particle
+/// sorting are filled for the nearest instance of a master, instances under a different
+/// rotation would be drawn with a wrong facing and order. Masters are restarted when finished :
+/// looping emitters only.
+///-------------------------------------------------------------------------------------------------
+class URHO3D_API MagicParticleInstancing : public Object
+{
+    URHO3D_OBJECT(MagicParticleInstancing, Object)
+
+public:
+    /// Construct.
+    MagicParticleInstancing(Context* context);
+    /// Destruct. Release all masters.
+    virtual ~MagicParticleInstancing();
+
+    /// Return master of emitter at index, phase (modulo number of phases) and world rotation (snapped to rotation step) for an instanced emitter, created if needed.
+    MagicEmitterMaster* AcquireMaster(MagicParticleEffect* effect, int index, unsigned phase, const Quaternion& rotation, MagicParticleEmitter* user);
+    /// Release master used by an instanced emitter, master is destroyed when it has no user left.
+    void ReleaseMaster(MagicEmitterMaster* master, MagicParticleEmitter* user);
+
+    /// Set number of phases of each emitter template (1). Applies to masters created afterwards.
+    void SetNumPhases(unsigned numPhases);
+    /// Set time offset between phases in seconds (0.5).
+    void SetPhaseOffset(float offset);
+    /// Set angle step in degrees instanced emitters rotations are snapped to, 0 to match rotations exactly (default). Applies to masters created afterwards.
+    void SetRotationStep(float step);
+    /// Return whether an instanced emitter with world rotation can draw master.
+    bool MatchesRotation(const MagicEmitterMaster* master, const Quaternion& rotation) const;
+
+    /// Return number of phases.
+    unsigned GetNumPhases() const { return _numPhases; }
+    /// Return time offset between phases in seconds.
+    float GetPhaseOffset() const { return _phaseOffset; }
+    /// Return angle step in degrees instanced emitters rotations are snapped to.
+    float GetRotationStep() const { return _rotationStep; }
+    /// Return number of masters.
+    unsigned GetNumMasters() const { return _masters.Size(); }
+
+private:
+    /// Handle masters update, create and render geometries.
+    void HandleUpdate(StringHash eventType, VariantMap& eventData);
+    /// Restart master emitter and simulate its phase offset.
+    void Restart(MagicEmitterMaster* master);
+    /// Run a command on master now, or on the simulation thread in pipelined mode.
+    void PostCommand(const MP_SIM_COMMAND& command);
+    /// Return world rotation snapped to rotation step.
+    Quaternion SnapRotation(const Quaternion& rotation) const;
+
+    /// Masters.
+    PODVector<MagicEmitterMaster*> _masters;
+    /// Number of phases.
+    unsigned _numPhases;
+    /// Time offset between phases in seconds.
+    float _phaseOffset;
+    /// Angle step rotations are snapped to in degrees, 0 for none.
+    float _rotationStep;
+    /// Simulation subsystem.
+    MagicParticleSimulation* _simulation;
+};
+
+}
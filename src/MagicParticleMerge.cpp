@@ -0,0 +1,250 @@
+#include "MagicParticleMerge.h"
+#include "MagicParticleUtils.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+MagicMergedGeometry::MagicMergedGeometry() :
+    _numBuffers(0)
+{
+}
+
+void MagicMergedGeometry::Begin()
+{
+    _timer.Reset();
+    _numBuffers = 0;
+    _batches.Clear();
+    _instances.Clear();
+}
+
+void MagicMergedGeometry::Add(MagicEmitterInstance* instance, unsigned view, const Vector3& center)
+{
+    _instances.Push(instance);
+    instance->MarkMerged(view);
+
+    unsigned numBatches = instance->GetNumFillBatches();
+    unsigned vertexCount = instance->GetFillVertexCount();
+    if (!numBatches || !vertexCount)
+        return;
+
+    // does not fit 16 bits indices : drawn with its own split geometry
+    if (instance->IsFillIndex32())
+    {
+        if (instance->Upload(view))
+        {
+            MP_MERGED_BATCH batch;
+            batch.instance = instance;
+            batch.buffer = 0;
+            batch.batch = 0;
+            batch.center = center;
+            _batches.Push(batch);
+        }
+        return;
+    }
+
+    // shared buffer with the same vertex format and room left
+    const PODVector<VertexElement>& elements = instance->GetFillVertexElements();
+    unsigned b = 0;
+    for (; b < _numBuffers; ++b)
+    {
+        const MP_MERGED_BUFFER& buffer = _buffers[b];
+        if (buffer.elements == elements && buffer.vertices.Size() / buffer.vertexSize + vertexCount <= MP_MAX_VERTICES_16)
+            break;
+    }
+
+    if (b == _numBuffers)
+    {
+        if (b >= _buffers.Size())
+            _buffers.Resize(b + 1);
+
+        MP_MERGED_BUFFER& buffer = _buffers[b];
+        buffer.elements = elements;
+        buffer.vertexSize = VertexBuffer::GetVertexSize(elements);
+        buffer.vertices.Clear();
+        buffer.numBatches = 0;
+        ++_numBuffers;
+    }
+
+    MP_MERGED_BUFFER& buffer = _buffers[b];
+
+    // append vertices
+    unsigned base = buffer.vertices.Size() / buffer.vertexSize;
+    buffer.vertices.Resize((base + vertexCount) * buffer.vertexSize);
+    memcpy(&buffer.vertices[base * buffer.vertexSize], reinterpret_cast<MP_BUFFER_RAM*>(instance->GetVertexData())->buffer, vertexCount * buffer.vertexSize);
+
+    // append rebased indices to the last merged batch if it has the same material and buffer,
+    // else open a new one : batches are drawn in the order they were filled
+    const unsigned short* indices = reinterpret_cast<const unsigned short*>(reinterpret_cast<MP_BUFFER_RAM*>(instance->GetIndexData())->buffer);
+
+    for (unsigned j = 0; j < numBatches; ++j)
+    {
+        const MAGIC_RENDER_VERTICES& batch = instance->GetFillBatch(j);
+        Material* material = instance->GetFillMaterial(j);
+
+        bool extend = !_batches.Empty() && !_batches.Back().instance && _batches.Back().buffer == b &&
+                buffer.materials[_batches.Back().batch].Get() == material;
+
+        if (!extend)
+        {
+            unsigned m = buffer.numBatches;
+            if (m >= buffer.materials.Size())
+            {
+                buffer.materials.Resize(m + 1);
+                buffer.indices.Resize(m + 1);
+            }
+
+            buffer.materials[m] = material;
+            buffer.indices[m].Clear();
+            ++buffer.numBatches;
+
+            MP_MERGED_BATCH mergedBatch;
+            mergedBatch.instance = nullptr;
+            mergedBatch.buffer = b;
+            mergedBatch.batch = m;
+            mergedBatch.center = center;
+            _batches.Push(mergedBatch);
+        }
+
+        PODVector<unsigned short>& merged = buffer.indices[_batches.Back().batch];
+        unsigned start = merged.Size();
+        merged.Resize(start + batch.indexes_count);
+        for (int i = 0; i < batch.indexes_count; ++i)
+            merged[start + i] = (unsigned short)(indices[batch.starting_index + i] + base);
+    }
+}
+
+void MagicMergedGeometry::End(Context* context, MagicParticleStats* stats)
+{
+    unsigned long long bytesUploaded = 0;
+
+    // upload shared buffers, one geometry per merged batch
+
+    for (unsigned b = 0; b < _numBuffers; ++b)
+    {
+        MP_MERGED_BUFFER& buffer = _buffers[b];
+        unsigned vertexCount = buffer.vertices.Size() / buffer.vertexSize;
+
+        _indices.Clear();
+        for (unsigned m = 0; m < buffer.numBatches; ++m)
+            _indices.Push(buffer.indices[m]);
+
+        if (_indices.Empty())
+        {
+            buffer.numBatches = 0;
+            continue;
+        }
+
+        if (!buffer.vertexBuffer)
+        {
+            buffer.vertexBuffer = new VertexBuffer(context);
+            buffer.indexBuffer = new IndexBuffer(context);
+        }
+
+        buffer.vertexBuffer->SetSize(vertexCount, buffer.elements, true);
+        buffer.vertexBuffer->SetData(&buffer.vertices[0]);
+        buffer.vertexBuffer->ClearDataLost();
+        buffer.indexBuffer->SetSize(_indices.Size(), false, true);
+        buffer.indexBuffer->SetData(&_indices[0]);
+        buffer.indexBuffer->ClearDataLost();
+        bytesUploaded += buffer.vertices.Size() + _indices.Size() * sizeof(unsigned short);
+
+        if (buffer.geometries.Size() < buffer.numBatches)
+            buffer.geometries.Resize(buffer.numBatches);
+
+        unsigned indexStart = 0;
+        for (unsigned m = 0; m < buffer.numBatches; ++m)
+        {
+            SharedPtr<Geometry>& batchGeometry = buffer.geometries[m];
+            if (!batchGeometry)
+            {
+                batchGeometry = new Geometry(context);
+                batchGeometry->SetVertexBuffer(0, buffer.vertexBuffer);
+                batchGeometry->SetIndexBuffer(buffer.indexBuffer);
+            }
+
+            unsigned indexCount = buffer.indices[m].Size();
+            batchGeometry->SetDrawRange(TRIANGLE_LIST, indexStart, indexCount, 0, vertexCount, false);
+            indexStart += indexCount;
+        }
+    }
+
+    if (stats)
+    {
+        MP_COUNTERS counters;
+        counters.bytesUploaded = bytesUploaded;
+        counters.uploadTime = _timer.GetUSec(false);
+        stats->Add(counters);
+    }
+}
+
+void MagicMergedGeometry::GetBatches(Vector<SourceBatch>& batches, Camera* camera, unsigned view) const
+{
+    // batches keep their own distance : transparent ones are sorted back to front with the others
+    SourceBatch batch;
+    batch.worldTransform_ = &Matrix3x4::IDENTITY;
+
+    for (unsigned i = 0; i < _batches.Size(); ++i)
+    {
+        const MP_MERGED_BATCH& mergedBatch = _batches[i];
+        batch.distance_ = camera->GetDistance(mergedBatch.center);
+
+        if (mergedBatch.instance)
+        {
+            MagicEmitterInstance* instance = mergedBatch.instance;
+            for (unsigned j = 0; j < instance->GetNumBatches(view); ++j)
+            {
+                batch.geometry_ = instance->GetBatchGeometry(j, view);
+                batch.material_ = instance->GetBatchMaterial(j, view);
+                batches.Push(batch);
+            }
+            continue;
+        }
+
+        const MP_MERGED_BUFFER& buffer = _buffers[mergedBatch.buffer];
+        batch.geometry_ = buffer.geometries[mergedBatch.batch];
+        batch.material_ = buffer.materials[mergedBatch.batch];
+        batches.Push(batch);
+    }
+}
+
+bool MagicMergedGeometry::SkipMerge(unsigned view, const MAGIC_CAMERA& camera, const PODVector<MagicEmitterInstance*>& instances) const
+{
+    if (instances != _instances)
+        return false;
+
+    // shared buffers lost their contents (device lost) : geometry must be merged and uploaded again
+    for (unsigned b = 0; b < _numBuffers; ++b)
+    {
+        const MP_MERGED_BUFFER& buffer = _buffers[b];
+        if ((buffer.vertexBuffer && buffer.vertexBuffer->IsDataLost()) || (buffer.indexBuffer && buffer.indexBuffer->IsDataLost()))
+            return false;
+    }
+
+    for (unsigned i = 0; i < _instances.Size(); ++i)
+    {
+        if (!_instances[i]->IsFillCurrent(view, camera))
+            return false;
+    }
+
+    for (unsigned i = 0; i < _instances.Size(); ++i)
+        _instances[i]->SkipFill(view, camera);
+
+    return true;
+}
+
+void MagicMergedGeometry::RemoveInstance(MagicEmitterInstance* instance)
+{
+    // merged vertices of the instance are drawn until next merge, which cannot be skipped
+    _instances.Clear();
+
+    for (unsigned i = 0; i < _batches.Size();)
+    {
+        if (_batches[i].instance == instance)
+            _batches.Erase(i);
+        else
+            ++i;
+    }
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "MagicEmitterInstance.h"
+#include "MagicParticleStats.h"
+#include "Magic.h"
+
+namespace Urho3D
+{
+
+/// Merged geometry of instances sharing a vertex format, addressed by 16 bits indices.
+struct MP_MERGED_BUFFER
+{
+    /// Vertex elements.
+    PODVector<VertexElement> elements;
+    /// Vertex size in bytes.
+    unsigned vertexSize;
+    /// Merged vertices.
+    PODVector<unsigned char> vertices;
+    /// Materials of merged batches, a material may have several batches.
+    Vector<SharedPtr<Material> > materials;
+    /// Rebased indices of merged batches.
+    Vector<PODVector<unsigned short> > indices;
+    /// Number of merged batches.
+    unsigned numBatches;
+    /// Vertex buffer.
+    SharedPtr<VertexBuffer> vertexBuffer;
+    /// Index buffer.
+    SharedPtr<IndexBuffer> indexBuffer;
+    /// Geometries of merged batches.
+    Vector<SharedPtr<Geometry> > geometries;
+
+    MP_MERGED_BUFFER() : vertexSize(0), numBatches(0) { }
+};
+
+/// Draw batch of merged geometry, merged or of an instance drawn with its own geometry.
+struct MP_MERGED_BATCH
+{
+    /// Instance too large to be merged, null for a merged batch.
+    MagicEmitterInstance* instance;
+    /// Shared buffer of merged batch.
+    unsigned buffer;
+    /// Merged batch in shared buffer.
+    unsigned batch;
+    /// World center of the farthest instance in the batch, gives the batch distance in each view.
+    Vector3 center;
+};
+
+///-------------------------------------------------------------------------------------------------
+/// Filled geometry of several emitter instances merged into shared buffers, for one view of a
+/// drawable (cluster members, one-shots). Instances are added back to front : a merged batch only
+/// spans consecutive batches of the same material and buffer, and is sorted at the distance of its
+/// farthest instance, so transparent batches keep their depth order across materials and buffers.
+/// Instances whose geometry needs 32 bits indices are uploaded and drawn on their own.
+///-------------------------------------------------------------------------------------------------
+class MagicMergedGeometry
+{
+public:
+    /// Construct.
+    MagicMergedGeometry();
+
+    /// Start a new merge, batches of previous merge are dropped.
+    void Begin();
+    /// Append geometry filled by instance, drawn for view at distance of world center.
+    void Add(MagicEmitterInstance* instance, unsigned view, const Vector3& center);
+    /// Upload shared buffers and set draw ranges of merged batches. Time since Begin and uploaded bytes are added to stats if not null.
+    void End(Context* context, MagicParticleStats* stats);
+    /// Append draw batches of view to batches, sorted at their distance to camera.
+    void GetBatches(Vector<SourceBatch>& batches, Camera* camera, unsigned view) const;
+    /// Return true, and count skipped fills, if geometry merged for view can be drawn again as is : same instances in the same
+    /// order, each one current for camera (see MagicEmitterInstance::IsFillCurrent), and shared buffers kept their data.
+    bool SkipMerge(unsigned view, const MAGIC_CAMERA& camera, const PODVector<MagicEmitterInstance*>& instances) const;
+    /// Stop drawing instance, when it is released.
+    void RemoveInstance(MagicEmitterInstance* instance);
+    /// Return number of draw batches.
+    unsigned GetNumBatches() const { return _batches.Size(); }
+
+private:
+    /// Shared buffers, only the first numBuffers are in use.
+    Vector<MP_MERGED_BUFFER> _buffers;
+    /// Number of shared buffers in use.
+    unsigned _numBuffers;
+    /// Draw batches, back to front.
+    PODVector<MP_MERGED_BATCH> _batches;
+    /// Instances added since merge start, in order. Cleared when one is removed.
+    PODVector<MagicEmitterInstance*> _instances;
+    /// Concatenated indices of a shared buffer being uploaded.
+    PODVector<unsigned short> _indices;
+    /// Merge start time.
+    HiresTimer _timer;
+};
+
+}
@@ -0,0 +1,324 @@
+#include "MagicParticleObstacles.h"
+#include "MagicParticleEmitter.h"
+#include "MagicParticleSimulation.h"
+#include "MagicParticleTimeline.h"
+#include "MagicParticleUtils.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+extern const char* LOGIC_CATEGORY;
+
+MagicParticleObstacles::MagicParticleObstacles(Context* context) :
+    Component(context)
+    , _margin(2.0f)
+    , _maxObstacles(32)
+    , _maxTriangles(1024)
+    , _updateInterval(0.1f)
+    , _updateTimer(0.0f)
+    , _cellSize(0)
+    , _capLogged(false)
+{
+}
+
+MagicParticleObstacles::~MagicParticleObstacles()
+{
+    Clear();
+}
+
+void MagicParticleObstacles::RegisterObject(Context* context)
+{
+    context->RegisterFactory<MagicParticleObstacles>(LOGIC_CATEGORY);
+}
+
+void MagicParticleObstacles::Clear()
+{
+    if (_regions.Empty())
+        return;
+
+    // obstacles are read by Magic_Update
+    MagicParticleSimulation* simulation = GetSubsystem<MagicParticleSimulation>();
+    if (simulation)
+        simulation->Wait();
+
+    for (unsigned i = 0; i < _regions.Size(); ++i)
+    {
+        if (_regions[i].obstacle > 0)
+            Magic_DestroyPhysicObject(MAGIC_TYPE_OBSTACLE, _regions[i].obstacle);
+    }
+
+    _regions.Clear();
+}
+
+unsigned MagicParticleObstacles::GetNumObstacles() const
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < _regions.Size(); ++i)
+    {
+        if (_regions[i].obstacle > 0)
+            ++count;
+    }
+    return count;
+}
+
+unsigned MagicParticleObstacles::GetNumTriangles() const
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < _regions.Size(); ++i)
+        count += _regions[i].numTriangles;
+    return count;
+}
+
+void MagicParticleObstacles::DrawDebugGeometry(DebugRenderer* debug, bool depthTest)
+{
+    if (!debug)
+        return;
+
+    for (unsigned i = 0; i < _regions.Size(); ++i)
+        debug->AddBoundingBox(_regions[i].box, _regions[i].obstacle > 0 ? Color::RED : Color::GRAY, depthTest);
+}
+
+void MagicParticleObstacles::OnSceneSet(Scene* scene)
+{
+    if (scene)
+    {
+        SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(MagicParticleObstacles, HandleUpdate));
+    }
+    else
+    {
+        UnsubscribeFromEvent(E_UPDATE);
+        Clear();
+    }
+}
+
+void MagicParticleObstacles::HandleUpdate(StringHash eventType, VariantMap& eventData)
+{
+    if (!IsEnabledEffective())
+    {
+        Clear();
+        return;
+    }
+
+    using namespace Update;
+    _updateTimer += eventData[P_TIMESTEP].GetFloat();
+    if (_updateTimer < _updateInterval)
+        return;
+
+    _updateTimer = 0.0f;
+    Refresh();
+}
+
+void MagicParticleObstacles::Refresh()
+{
+    Scene* scene = GetScene();
+    if (!scene || !scene->GetComponent<Octree>())
+        return;
+
+    URHO3D_PROFILE(MagicObstacles);
+    MP_TIMELINE_SCOPE("Obstacles", 0);
+
+    // obstacles are read by Magic_Update, simulation is idle during update in pipelined mode
+    MagicParticleSimulation* simulation = GetSubsystem<MagicParticleSimulation>();
+    if (simulation)
+        simulation->Wait();
+
+    for (unsigned i = 0; i < _regions.Size(); ++i)
+        _regions[i].seen = false;
+
+    scene->GetComponents<MagicParticleEmitter>(_emitters, true);
+
+    for (unsigned e = 0; e < _emitters.Size(); ++e)
+    {
+        MagicParticleEmitter* emitter = _emitters[e];
+        MP_EMITTER_STATE state = emitter->GetState();
+        if (!emitter->IsEnabledEffective() || (state != MP_EMITTER_PLAYING && state != MP_EMITTER_STOPPING))
+            continue;
+
+        // instanced : shared master is simulated in local space at the origin, world obstacles do not apply
+        if (emitter->IsInstanced())
+            continue;
+
+        // no particle yet : emitter position
+        BoundingBox bounds = emitter->GetWorldBoundingBox();
+        if (!bounds.Defined())
+            bounds.Define(emitter->GetNode()->GetWorldPosition());
+
+        unsigned r = 0;
+        while (r < _regions.Size() && _regions[r].emitter.Get() != emitter)
+            ++r;
+
+        if (r < _regions.Size())
+        {
+            _regions[r].seen = true;
+
+            // still inside queried box : triangles are up to date
+            if (_regions[r].box.IsInside(bounds) == INSIDE)
+                continue;
+        }
+        else
+        {
+            if (_regions.Size() >= _maxObstacles)
+            {
+                if (!_capLogged)
+                {
+                    URHO3D_LOGWARNING("Magic obstacles cap reached, some emitters do not collide");
+                    _capLogged = true;
+                }
+                continue;
+            }
+
+            OBSTACLE_REGION region;
+            region.emitter = emitter;
+            region.obstacle = 0;
+            region.numTriangles = 0;
+            region.seen = true;
+            _regions.Push(region);
+        }
+
+        OBSTACLE_REGION& region = _regions[r];
+        Vector3 margin(_margin, _margin, _margin);
+        region.box = BoundingBox(bounds.min_ - margin, bounds.max_ + margin);
+
+        if (!CollectTriangles(region.box) && !_capLogged)
+        {
+            URHO3D_LOGWARNING("Magic obstacle triangles cap reached, some triangles are ignored");
+            _capLogged = true;
+        }
+
+        region.numTriangles = _triangles.Size();
+
+        if (_triangles.Empty())
+        {
+            if (region.obstacle > 0)
+                Magic_DestroyPhysicObject(MAGIC_TYPE_OBSTACLE, region.obstacle);
+            region.obstacle = 0;
+            continue;
+        }
+
+        // triangles are in Magic world space, obstacle stays at origin
+        MAGIC_OBSTACLE data;
+        data.type = MAGIC_OBSTACLE_TRIANGLE;
+        data.radius = 0.0f;
+        data.count = _triangles.Size();
+        data.primitives = &_triangles[0];
+
+        if (region.obstacle > 0)
+        {
+            Magic_SetObstacleData(region.obstacle, &data, _cellSize);
+        }
+        else
+        {
+            MAGIC_POSITION origin = Urho3DToMagic(Vector3::ZERO);
+            region.obstacle = Magic_CreateObstacle(&data, &origin, _cellSize);
+            if (region.obstacle <= 0)
+            {
+                URHO3D_LOGERROR("Could not create Magic obstacle");
+                region.obstacle = 0;
+            }
+        }
+    }
+
+    // emitters removed, stopped or finished
+    for (unsigned i = 0; i < _regions.Size();)
+    {
+        if (_regions[i].seen)
+        {
+            ++i;
+            continue;
+        }
+
+        if (_regions[i].obstacle > 0)
+            Magic_DestroyPhysicObject(MAGIC_TYPE_OBSTACLE, _regions[i].obstacle);
+        _regions.EraseSwap(i);
+    }
+}
+
+bool MagicParticleObstacles::CollectTriangles(const BoundingBox& box)
+{
+    _triangles.Clear();
+
+    BoxOctreeQuery query(_drawables, box, DRAWABLE_GEOMETRY);
+    GetScene()->GetComponent<Octree>()->GetDrawables(query);
+
+    for (unsigned i = 0; i < _drawables.Size(); ++i)
+    {
+        // static geometry only, skinned and instanced models derive from StaticModel
+        Drawable* drawable = _drawables[i];
+        if (drawable->GetType() != StaticModel::GetTypeStatic())
+            continue;
+
+        Node* node = drawable->GetNode();
+        Model* model = static_cast<StaticModel*>(drawable)->GetModel();
+        Matrix3x4 transform = node->GetWorldTransform();
+
+#ifdef URHO3D_PHYSICS
+        // prefer the simplified collision mesh when there is one
+        CollisionShape* shape = node->GetComponent<CollisionShape>();
+        if (shape && shape->GetShapeType() == SHAPE_TRIANGLEMESH && shape->GetModel())
+        {
+            model = shape->GetModel();
+            transform = transform * Matrix3x4(shape->GetPosition(), shape->GetRotation(), shape->GetSize());
+        }
+#endif
+
+        if (model && !CollectModelTriangles(model, transform, box))
+            return false;
+    }
+
+    return true;
+}
+
+bool MagicParticleObstacles::CollectModelTriangles(Model* model, const Matrix3x4& transform, const BoundingBox& box)
+{
+    for (unsigned i = 0; i < model->GetNumGeometries(); ++i)
+    {
+        Geometry* geometry = model->GetGeometry(i, 0);
+        if (!geometry || geometry->GetPrimitiveType() != TRIANGLE_LIST)
+            continue;
+
+        // CPU copy of the geometry, position is the first vertex element
+        const unsigned char* vertexData;
+        const unsigned char* indexData;
+        unsigned vertexSize;
+        unsigned indexSize;
+        const PODVector<VertexElement>* elements;
+        geometry->GetRawData(vertexData, vertexSize, indexData, indexSize, elements);
+        if (!vertexData)
+            continue;
+
+        unsigned start = indexData ? geometry->GetIndexStart() : geometry->GetVertexStart();
+        unsigned count = indexData ? geometry->GetIndexCount() : geometry->GetVertexCount();
+
+        for (unsigned j = start; j + 2 < start + count; j += 3)
+        {
+            Vector3 v[3];
+            for (unsigned k = 0; k < 3; ++k)
+            {
+                unsigned index = j + k;
+                if (indexData)
+                    index = indexSize == sizeof(unsigned short) ? ((const unsigned short*)indexData)[index] : ((const unsigned*)indexData)[index];
+                v[k] = transform * *((const Vector3*)(vertexData + index * vertexSize));
+            }
+
+            BoundingBox bounds(v[0], v[0]);
+            bounds.Merge(v[1]);
+            bounds.Merge(v[2]);
+            if (box.IsInsideFast(bounds) == OUTSIDE)
+                continue;
+
+            if (_triangles.Size() >= _maxTriangles)
+                return false;
+
+            MAGIC_TRIANGLE triangle;
+            triangle.vertex1 = Urho3DToMagic(v[0]);
+            triangle.vertex2 = Urho3DToMagic(v[1]);
+            triangle.vertex3 = Urho3DToMagic(v[2]);
+            _triangles.Push(triangle);
+        }
+    }
+
+    return true;
+}
+
+}
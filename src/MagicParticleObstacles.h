@@ -0,0 +1,116 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+#include "Magic.h"
+
+namespace Urho3D
+{
+
+class MagicParticleEmitter;
+
+///-------------------------------------------------------------------------------------------------
+/// Bridge between scene geometry and Magic obstacles.
+/// Create it on the scene node, next to the Octree. Each playing emitter gets one Magic triangle
+/// obstacle made of the StaticModel triangles found around it (the collision mesh of the node is
+/// used instead when it has a triangle mesh CollisionShape). Triangles are queried in the emitter
+/// bounding box inflated by a margin, and only queried again when the emitter leaves that box.
+/// Particle types collide with these obstacles if they have obstacles enabled in the editor.
+/// Instanced emitters get no obstacle : their shared master is simulated at the Magic origin, so
+/// it does not collide with the geometry around its instances but with obstacles of emitters
+/// placed near the world origin, if any.
+///-------------------------------------------------------------------------------------------------
+class URHO3D_API MagicParticleObstacles : public Component
+{
+    URHO3D_OBJECT(MagicParticleObstacles, Component)
+
+public:
+    /// Construct.
+    MagicParticleObstacles(Context* context);
+    /// Destruct. Destroy Magic obstacles.
+    virtual ~MagicParticleObstacles();
+    /// Register object factory.
+    static void RegisterObject(Context* context);
+
+    /// Set distance added around emitter bounding box when querying triangles. Larger margins query less often.
+    void SetMargin(float margin) { _margin = Max(margin, 0.0f); }
+    /// Set maximum number of obstacles, one per emitter. Emitters above the cap do not collide.
+    void SetMaxObstacles(unsigned maxObstacles) { _maxObstacles = maxObstacles; }
+    /// Set maximum number of triangles per obstacle. Triangles above the cap are ignored.
+    void SetMaxTriangles(unsigned maxTriangles) { _maxTriangles = maxTriangles; }
+    /// Set time between two refreshes in seconds.
+    void SetUpdateInterval(float interval) { _updateInterval = Max(interval, 0.0f); }
+    /// Set Magic obstacle cell size, passed to Magic_CreateObstacle.
+    void SetCellSize(int cellSize) { _cellSize = cellSize; }
+    /// Destroy all obstacles, they are rebuilt at next refresh.
+    void Clear();
+
+    /// Return margin around emitter bounding boxes.
+    float GetMargin() const { return _margin; }
+    /// Return maximum number of obstacles.
+    unsigned GetMaxObstacles() const { return _maxObstacles; }
+    /// Return maximum number of triangles per obstacle.
+    unsigned GetMaxTriangles() const { return _maxTriangles; }
+    /// Return time between two refreshes.
+    float GetUpdateInterval() const { return _updateInterval; }
+    /// Return Magic obstacle cell size.
+    int GetCellSize() const { return _cellSize; }
+    /// Return number of Magic obstacles.
+    unsigned GetNumObstacles() const;
+    /// Return number of triangles in all obstacles.
+    unsigned GetNumTriangles() const;
+
+    /// Visualize the obstacle query boxes as debug geometry.
+    virtual void DrawDebugGeometry(DebugRenderer* debug, bool depthTest);
+
+private:
+    /// Handle scene being assigned.
+    virtual void OnSceneSet(Scene* scene);
+    /// Handle update : refresh obstacles of moved, new and removed emitters.
+    void HandleUpdate(StringHash eventType, VariantMap& eventData);
+    /// Refresh obstacles.
+    void Refresh();
+    /// Collect scene triangles intersecting box. Return false if the triangle cap was reached.
+    bool CollectTriangles(const BoundingBox& box);
+    /// Collect triangles of a model intersecting box. Return false if the triangle cap was reached.
+    bool CollectModelTriangles(Model* model, const Matrix3x4& transform, const BoundingBox& box);
+
+    /// Obstacle region of an emitter.
+    struct OBSTACLE_REGION
+    {
+        /// Emitter.
+        WeakPtr<MagicParticleEmitter> emitter;
+        /// World box the triangles were queried in.
+        BoundingBox box;
+        /// Magic obstacle, 0 if there is no triangle in box.
+        HM_OBSTACLE obstacle;
+        /// Number of triangles in obstacle.
+        unsigned numTriangles;
+        /// Emitter found at last refresh.
+        bool seen;
+    };
+
+    /// Obstacle regions.
+    Vector<OBSTACLE_REGION> _regions;
+    /// Emitters found at refresh.
+    PODVector<MagicParticleEmitter*> _emitters;
+    /// Drawables found by octree query.
+    PODVector<Drawable*> _drawables;
+    /// Triangles collected for an obstacle, in Magic space.
+    PODVector<MAGIC_TRIANGLE> _triangles;
+    /// Margin around emitter bounding boxes.
+    float _margin;
+    /// Maximum number of obstacles.
+    unsigned _maxObstacles;
+    /// Maximum number of triangles per obstacle.
+    unsigned _maxTriangles;
+    /// Time between refreshes.
+    float _updateInterval;
+    /// Time since last refresh.
+    float _updateTimer;
+    /// Magic obstacle cell size.
+    int _cellSize;
+    /// Cap reached already logged.
+    bool _capLogged;
+};
+
+}
@@ -0,0 +1,388 @@
+#include "MagicParticleSimulation.h"
+#include "MagicEmitterInstance.h"
+#include "MagicParticleTimeline.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+MagicParticleSimulation::MagicParticleSimulation(Context* context) :
+    Object(context)
+    , _head(0)
+    , _tail(0)
+    , _numJobs(0)
+    , _jobsStarted(0)
+    , _jobsDone(0)
+    , _pipelined(false)
+    , _parallelFill(false)
+    , _simulateHidden(false)
+    , _overflowLogged(false)
+{
+    _queue.Resize(QUEUE_SIZE);
+
+    SubscribeToEvent(E_POSTUPDATE, URHO3D_HANDLER(MagicParticleSimulation, HandlePostUpdate));
+}
+
+MagicParticleSimulation::~MagicParticleSimulation()
+{
+    StopThread();
+}
+
+void MagicParticleSimulation::SetPipelined(bool enable)
+{
+    if (enable == _pipelined)
+        return;
+
+    if (enable)
+    {
+        // fills queued by emitters are stored, presented by the pipelined path
+        RunFills();
+
+        shouldRun_ = true;
+        if (!Run())
+        {
+            URHO3D_LOGERROR("Could not start particle simulation thread");
+            return;
+        }
+
+        SubscribeToEvent(E_BEGINFRAME, URHO3D_HANDLER(MagicParticleSimulation, HandleBeginFrame));
+    }
+    else
+    {
+        StopThread();
+
+        UnsubscribeFromEvent(E_BEGINFRAME);
+
+        // commands posted since last job
+        RunQueue();
+    }
+
+    _pipelined = enable;
+}
+
+void MagicParticleSimulation::Post(const MP_SIM_COMMAND& command)
+{
+    if (!_pipelined)
+    {
+        Execute(command);
+        return;
+    }
+
+    unsigned head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) >= QUEUE_SIZE)
+    {
+        if (!_overflowLogged)
+        {
+            URHO3D_LOGWARNING("Particle simulation queue is full, running it now");
+            _overflowLogged = true;
+        }
+
+        // make room : run the queue on simulation thread and wait for it
+        Wait();
+        StartJob();
+        Wait();
+    }
+
+    _queue[head & (QUEUE_SIZE - 1)] = command;
+    _head.store(head + 1, std::memory_order_release);
+}
+
+void MagicParticleSimulation::Wait()
+{
+    if (!_pipelined)
+        return;
+
+    MP_TIMELINE_SCOPE("SimulationWait", 0);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _condition.wait(lock, [this] { return _jobsDone == _jobsStarted; });
+}
+
+void MagicParticleSimulation::Discard(MagicEmitterInstance* instance)
+{
+    for (unsigned i = 0; i < _fills.Size(); ++i)
+    {
+        if (_fills[i].instance == instance)
+            _fills[i].instance = nullptr;
+    }
+
+    if (!_pipelined)
+        return;
+
+    Wait();
+
+    // simulation thread is idle and does not read the queue until next job
+    unsigned head = _head.load(std::memory_order_relaxed);
+    for (unsigned i = _tail.load(std::memory_order_relaxed); i != head; ++i)
+    {
+        MP_SIM_COMMAND& command = _queue[i & (QUEUE_SIZE - 1)];
+        if (command.instance == instance)
+            command.instance = nullptr;
+    }
+}
+
+void MagicParticleSimulation::SetParallelFill(bool enable)
+{
+    if (enable && !_parallelFill)
+        URHO3D_LOGWARNING("Parallel particle fill enabled, it requires a thread-safe Magic fill");
+
+    _parallelFill = enable;
+}
+
+void MagicParticleSimulation::PostFill(const MP_SIM_COMMAND& command)
+{
+    if (_pipelined)
+    {
+        Post(command);
+        return;
+    }
+
+    _fills.Push(command);
+}
+
+void MagicParticleSimulation::RunFills()
+{
+    if (_fills.Empty())
+        return;
+
+    URHO3D_PROFILE(MagicFills);
+
+    WorkQueue* queue = _parallelFill ? GetSubsystem<WorkQueue>() : nullptr;
+    unsigned numThreads = queue ? queue->GetNumThreads() : 0;
+
+    for (unsigned i = 0; i < _fills.Size();)
+    {
+        // group fills of the same camera : Magic camera is global, pushed once per group
+        const MAGIC_CAMERA camera = _fills[i].camera;
+        unsigned end = i + 1;
+        for (unsigned j = end; j < _fills.Size(); ++j)
+        {
+            if (!memcmp(&_fills[j].camera, &camera, sizeof(MAGIC_CAMERA)))
+                Swap(_fills[j], _fills[end++]);
+        }
+
+        {
+            MP_TIMELINE_SCOPE("CameraPush", 0);
+
+            MAGIC_CAMERA pushed = camera;
+            Magic_SetCamera(&pushed);
+        }
+
+        MP_SIM_COMMAND* fills = &_fills.Front();
+        unsigned count = end - i;
+
+        if (numThreads && count > 1)
+        {
+            // views with the same camera fill the same instance : its fills are kept on one item
+            Sort(_fills.Begin() + i, _fills.Begin() + end, CompareFillInstance);
+
+            // one item per thread, main thread included as it works while completing
+            unsigned numItems = Min(numThreads + 1, count);
+            unsigned perItem = (count + numItems - 1) / numItems;
+
+            for (unsigned start = i; start < end;)
+            {
+                unsigned stop = Min(start + perItem, end);
+                while (stop < end && fills[stop].instance == fills[stop - 1].instance)
+                    ++stop;
+
+                SharedPtr<WorkItem> item = queue->GetFreeItem();
+                item->priority_ = M_MAX_UNSIGNED;
+                item->workFunction_ = FillWork;
+                item->start_ = fills + start;
+                item->end_ = fills + stop;
+                queue->AddWorkItem(item);
+                start = stop;
+            }
+
+            queue->Complete(M_MAX_UNSIGNED);
+        }
+        else
+            Fill(fills + i, fills + end);
+
+        i = end;
+    }
+
+    // upload before views gather batches : the frame draws its own fills
+    {
+        URHO3D_PROFILE(MagicPresentFills);
+
+        for (unsigned i = 0; i < _fills.Size(); ++i)
+        {
+            if (_fills[i].instance)
+                _fills[i].instance->Present(_fills[i].view);
+        }
+    }
+
+    _fills.Clear();
+}
+
+bool MagicParticleSimulation::CompareFillInstance(const MP_SIM_COMMAND& lhs, const MP_SIM_COMMAND& rhs)
+{
+    return lhs.instance < rhs.instance;
+}
+
+void MagicParticleSimulation::FillWork(const WorkItem* item, unsigned threadIndex)
+{
+    Fill(reinterpret_cast<MP_SIM_COMMAND*>(item->start_), reinterpret_cast<MP_SIM_COMMAND*>(item->end_));
+}
+
+void MagicParticleSimulation::Fill(MP_SIM_COMMAND* start, MP_SIM_COMMAND* end)
+{
+    // no Urho object is touched here, materials and GPU buffers are updated on main thread
+    for (MP_SIM_COMMAND* command = start; command != end; ++command)
+    {
+        if (!command->instance || command->instance->GetEmitter() <= 0)
+            continue;
+
+        command->instance->FillArrays(&command->camera);
+        command->instance->StoreFill(command->view);
+    }
+}
+
+void MagicParticleSimulation::Execute(const MP_SIM_COMMAND& command)
+{
+    // camera is pushed even by discarded commands, next ones may rely on it
+    if (command.hasCamera)
+    {
+        MP_TIMELINE_SCOPE("CameraPush", 0);
+
+        MAGIC_CAMERA camera = command.camera;
+        Magic_SetCamera(&camera);
+    }
+
+    MagicEmitterInstance* instance = command.instance;
+    if (!instance || instance->GetEmitter() <= 0)
+        return;
+
+    switch (command.type)
+    {
+    case MP_SIM_RESTART:
+        instance->Restart(command.position);
+        break;
+
+    case MP_SIM_STOP:
+        instance->Stop();
+        break;
+
+    case MP_SIM_INTERRUPT:
+        Magic_SetInterrupt(instance->GetEmitter(), command.flag);
+        break;
+
+    case MP_SIM_MOVE_MODES:
+        Magic_SetEmitterPositionMode(instance->GetEmitter(), command.flag);
+        Magic_SetEmitterDirectionMode(instance->GetEmitter(), command.flag2);
+        break;
+
+    case MP_SIM_SPAWN:
+        instance->Spawn(command.position, command.direction);
+        break;
+
+    case MP_SIM_TRANSFORM:
+        instance->SetTransform(command.position, command.flag ? &command.direction : nullptr, command.value);
+        break;
+
+    case MP_SIM_UPDATE:
+        instance->ApplySorting((MP_SORT_MODE)command.sortMode, command.value);
+        instance->Update(command.time);
+        break;
+
+    case MP_SIM_FILL:
+        // geometry uploaded for the view is still valid : nothing stored, nothing presented
+        if (command.flag && command.hasCamera && instance->SkipFill(command.view, command.camera))
+            break;
+
+        instance->FillArrays(command.hasCamera ? &command.camera : nullptr);
+        instance->StoreFill(command.view);
+        break;
+    }
+}
+
+void MagicParticleSimulation::ThreadFunction()
+{
+    unsigned jobsDone;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        jobsDone = _jobsDone;
+    }
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [this, jobsDone] { return !shouldRun_ || _jobsStarted != jobsDone; });
+
+            if (!shouldRun_)
+                return;
+        }
+
+        {
+            MP_TIMELINE_SCOPE("Simulation", 0);
+            RunQueue();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _jobsDone = ++jobsDone;
+        }
+        _condition.notify_all();
+    }
+}
+
+void MagicParticleSimulation::HandleBeginFrame(StringHash eventType, VariantMap& eventData)
+{
+    Wait();
+}
+
+void MagicParticleSimulation::HandlePostUpdate(StringHash eventType, VariantMap& eventData)
+{
+    // fills queued by emitters at update
+    if (!_pipelined)
+    {
+        RunFills();
+        return;
+    }
+
+    if (_head.load(std::memory_order_relaxed) != _tail.load(std::memory_order_relaxed))
+        StartJob();
+}
+
+void MagicParticleSimulation::StartJob()
+{
+    ++_numJobs;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_jobsStarted;
+    }
+    _condition.notify_all();
+}
+
+void MagicParticleSimulation::StopThread()
+{
+    if (!IsStarted())
+        return;
+
+    Wait();
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        shouldRun_ = false;
+    }
+    _condition.notify_all();
+
+    Stop();
+}
+
+void MagicParticleSimulation::RunQueue()
+{
+    unsigned head = _head.load(std::memory_order_acquire);
+    unsigned tail = _tail.load(std::memory_order_relaxed);
+
+    for (; tail != head; ++tail)
+        Execute(_queue[tail & (QUEUE_SIZE - 1)]);
+
+    _tail.store(tail, std::memory_order_release);
+}
+
+}
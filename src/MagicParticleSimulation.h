@@ -0,0 +1,171 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+#include "Magic.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+namespace Urho3D
+{
+
+class MagicEmitterInstance;
+
+/// Command run on emitter instances by the simulation.
+enum MP_SIM_COMMAND_TYPE
+{
+    MP_SIM_RESTART = 0,         // restart emitter, placed at position if it starts at interval 1
+    MP_SIM_STOP,                // stop emitter and clear its filled geometry
+    MP_SIM_INTERRUPT,           // stop (flag) or resume emitting new particles
+    MP_SIM_MOVE_MODES,          // particles move (flag) and rotate (flag2) with emitter
+    MP_SIM_SPAWN,               // place at position and direction and play once as a one-shot
+    MP_SIM_TRANSFORM,           // set emitter position, direction (if flag) and scale (value)
+    MP_SIM_UPDATE,              // apply sort mode at camera distance (value), then simulate time
+    MP_SIM_FILL                 // fill geometry from camera and store it for view, skipped if unchanged (flag)
+};
+
+/// Simulation command. Plain data, copied in the command queue.
+struct MP_SIM_COMMAND
+{
+    /// Command type.
+    MP_SIM_COMMAND_TYPE type;
+    /// Target instance, null once discarded.
+    MagicEmitterInstance* instance;
+    /// Emitter position.
+    MAGIC_POSITION position;
+    /// Emitter direction.
+    MAGIC_DIRECTION direction;
+    /// Camera, used if hasCamera.
+    MAGIC_CAMERA camera;
+    /// Simulated time in milliseconds.
+    double time;
+    /// Scale or camera distance.
+    float value;
+    /// Sort mode (MP_SORT_MODE).
+    int sortMode;
+    /// View slot.
+    unsigned view;
+    /// Camera is set.
+    bool hasCamera;
+    /// Command flags, see MP_SIM_COMMAND_TYPE.
+    bool flag;
+    bool flag2;
+
+    MP_SIM_COMMAND() { memset(this, 0, sizeof(MP_SIM_COMMAND)); }
+    MP_SIM_COMMAND(MP_SIM_COMMAND_TYPE commandType, MagicEmitterInstance* commandInstance)
+    {
+        memset(this, 0, sizeof(MP_SIM_COMMAND));
+        type = commandType;
+        instance = commandInstance;
+    }
+};
+
+///-------------------------------------------------------------------------------------------------
+/// Magic particles simulation subsystem.
+/// By default commands run immediately on the calling thread. In pipelined mode a dedicated thread
+/// owns all Magic calls of emitters : the main thread posts commands in a lock-free queue during
+/// update, the queue is run after E_POSTUPDATE while the main thread renders, and results are
+/// waited for at next E_BEGINFRAME. Emitters render geometry one frame late, in exchange
+/// the simulation is off the main thread.
+/// Other Magic calls from main thread (loading, pooling) must Wait() first, it only blocks while
+/// the queue is running.
+/// When not pipelined, emitters simulate in E_UPDATE and queue a fill per view that rendered them
+/// in previous frame and still has them in its frustum : the subsystem runs fills together at
+/// E_POSTUPDATE, one camera push per view, on Urho worker threads if parallel fill is enabled, and
+/// uploads them right after, so batches of the frame use its own fills. Fill is not done in
+/// Drawable::UpdateGeometry : batches and their materials come from the fill, Urho copies them
+/// before UpdateGeometry runs.
+///-------------------------------------------------------------------------------------------------
+class URHO3D_API MagicParticleSimulation : public Object, public Thread
+{
+    URHO3D_OBJECT(MagicParticleSimulation, Object)
+
+public:
+    /// Construct.
+    MagicParticleSimulation(Context* context);
+    /// Destruct. Stop simulation thread.
+    virtual ~MagicParticleSimulation();
+
+    /// Enable pipelined mode, simulation runs on a dedicated thread.
+    void SetPipelined(bool enable);
+    /// Return whether simulation runs on a dedicated thread.
+    bool IsPipelined() const { return _pipelined; }
+    /// Post a command from main thread. Run immediately if not pipelined.
+    void Post(const MP_SIM_COMMAND& command);
+    /// Wait until queued commands that have been started are done.
+    void Wait();
+    /// Wait and drop queued commands of an instance about to be reset or destroyed.
+    void Discard(MagicEmitterInstance* instance);
+    /// Return number of times the queue has been started. In E_UPDATE all of them are done.
+    unsigned GetNumJobs() const { return _numJobs; }
+    /// Allow fills of distinct emitters to run concurrently on worker threads. Off by default : Magic does not document its fill
+    /// as thread-safe, enable only with a Magic build verified to be.
+    void SetParallelFill(bool enable);
+    /// Return whether fills run concurrently on worker threads.
+    bool IsParallelFill() const { return _parallelFill; }
+    /// Simulate emitters and clusters out of every view instead of freezing them, without fill (headless benchmarks and servers). Off by default.
+    void SetSimulateHidden(bool enable) { _simulateHidden = enable; }
+    /// Return whether emitters and clusters out of every view are simulated.
+    bool IsSimulateHidden() const { return _simulateHidden; }
+    /// Queue a fill command (with camera) from update, run at post update with the fills of all emitters. Posted as a command if pipelined.
+    void PostFill(const MP_SIM_COMMAND& command);
+    /// Run fills queued since last call and upload their geometry for their view. Main thread, called at post update.
+    void RunFills();
+
+    /// Run a command on the calling thread.
+    static void Execute(const MP_SIM_COMMAND& command);
+
+    /// Simulation thread function.
+    virtual void ThreadFunction();
+
+private:
+    /// Handle frame begin : wait for simulation of previous frame.
+    void HandleBeginFrame(StringHash eventType, VariantMap& eventData);
+    /// Handle post update : run queued fills, or start simulation of commands posted during update.
+    void HandlePostUpdate(StringHash eventType, VariantMap& eventData);
+    /// Order fills by instance.
+    static bool CompareFillInstance(const MP_SIM_COMMAND& lhs, const MP_SIM_COMMAND& rhs);
+    /// Run fills of a work item.
+    static void FillWork(const WorkItem* item, unsigned threadIndex);
+    /// Fill and store geometry of a command range.
+    static void Fill(MP_SIM_COMMAND* start, MP_SIM_COMMAND* end);
+    /// Start running queued commands on simulation thread.
+    void StartJob();
+    /// Stop simulation thread.
+    void StopThread();
+    /// Run queued commands, on simulation thread or on main thread when it is not running.
+    void RunQueue();
+
+    /// Queue capacity, must be a power of two.
+    static const unsigned QUEUE_SIZE = 4096;
+
+    /// Command queue, single producer (main thread) single consumer.
+    PODVector<MP_SIM_COMMAND> _queue;
+    /// Number of commands ever posted.
+    std::atomic<unsigned> _head;
+    /// Number of commands ever run.
+    std::atomic<unsigned> _tail;
+    /// Number of started jobs, main thread only.
+    unsigned _numJobs;
+    /// Number of jobs requested, guarded by mutex.
+    unsigned _jobsStarted;
+    /// Number of jobs done, guarded by mutex.
+    unsigned _jobsDone;
+    /// Job state mutex.
+    std::mutex _mutex;
+    /// Signaled when a job starts, a job is done or the thread must exit.
+    std::condition_variable _condition;
+    /// Fills queued during update, main thread only.
+    PODVector<MP_SIM_COMMAND> _fills;
+    /// Pipelined mode flag.
+    bool _pipelined;
+    /// Parallel fill flag.
+    bool _parallelFill;
+    /// Simulate hidden emitters flag.
+    bool _simulateHidden;
+    /// Queue overflow already logged.
+    bool _overflowLogged;
+};
+
+}
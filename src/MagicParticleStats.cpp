@@ -0,0 +1,123 @@
+#include "MagicParticleStats.h"
+#include "MagicParticleSimulation.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+/// Counters of a thread, only written by their thread, padded so that threads do not share cache lines.
+struct MP_STATS_SLOT
+{
+    /// Counters added since last merge.
+    MP_COUNTERS counters;
+    /// Padding.
+    char padding[64];
+};
+
+/// Slots of all threads that added counters, kept until exit as threads hold pointers to them.
+struct MP_STATS_SLOTS
+{
+    Mutex mutex;
+    PODVector<MP_STATS_SLOT*> slots;
+
+    ~MP_STATS_SLOTS()
+    {
+        for (unsigned i = 0; i < slots.Size(); ++i)
+            delete slots[i];
+    }
+};
+
+static MP_STATS_SLOTS statsSlots;
+static thread_local MP_STATS_SLOT* statsThreadSlot = 0;
+
+//----------------------------------------------------------------------------------------------------
+
+MagicParticleStats::MagicParticleStats(Context* context) :
+    Object(context)
+    , _numFrames(0)
+    , _debugHudEnabled(false)
+{
+    SubscribeToEvent(E_BEGINFRAME, URHO3D_HANDLER(MagicParticleStats, HandleBeginFrame));
+}
+
+MagicParticleStats::~MagicParticleStats()
+{
+}
+
+void MagicParticleStats::Add(const MP_COUNTERS& counters)
+{
+    MP_STATS_SLOT* slot = statsThreadSlot;
+    if (!slot)
+    {
+        // first counters added by this thread
+        slot = new MP_STATS_SLOT();
+
+        MutexLock lock(statsSlots.mutex);
+        statsSlots.slots.Push(slot);
+        statsThreadSlot = slot;
+    }
+
+    slot->counters += counters;
+}
+
+void MagicParticleStats::ResetTotal()
+{
+    _total.Reset();
+    _numFrames = 0;
+}
+
+void MagicParticleStats::SetDebugHudEnabled(bool enable)
+{
+    _debugHudEnabled = enable;
+
+    DebugHud* debugHud = GetSubsystem<DebugHud>();
+    if (debugHud && !enable)
+    {
+        debugHud->ResetAppStats("Magic particles");
+        debugHud->ResetAppStats("Magic geometry");
+        debugHud->ResetAppStats("Magic time (us)");
+    }
+}
+
+void MagicParticleStats::HandleBeginFrame(StringHash eventType, VariantMap& eventData)
+{
+    // pipelined simulation adds counters until its job is done, worker threads are idle between frames
+    MagicParticleSimulation* simulation = GetSubsystem<MagicParticleSimulation>();
+    if (simulation)
+        simulation->Wait();
+
+    {
+        MutexLock lock(statsSlots.mutex);
+        for (unsigned i = 0; i < statsSlots.slots.Size(); ++i)
+        {
+            _frame += statsSlots.slots[i]->counters;
+            statsSlots.slots[i]->counters.Reset();
+        }
+    }
+
+    _lastFrame = _frame;
+    _total += _frame;
+    _frame.Reset();
+    ++_numFrames;
+
+    if (_debugHudEnabled)
+        UpdateDebugHud();
+}
+
+void MagicParticleStats::UpdateDebugHud()
+{
+    DebugHud* debugHud = GetSubsystem<DebugHud>();
+    if (!debugHud)
+        return;
+
+    const MP_COUNTERS& c = _lastFrame;
+
+    debugHud->SetAppStats("Magic particles", String(c.particles) + " (" + String(c.batches) + " batches, " +
+                          String(_total.materialsCreated) + " materials, " + String(c.sortSkipped) + " sorting skipped, " + String(c.occluded) + " occluded emitters, " + String(c.fillsSkipped) + " fills skipped)");
+    debugHud->SetAppStats("Magic geometry", String(c.vertices) + " vertices, " + String(c.indices) + " indices, " +
+                          String((unsigned)(c.bytesUploaded / 1024)) + " KB uploaded");
+    debugHud->SetAppStats("Magic time (us)", "update " + String((int)c.updateTime) + ", fill " + String((int)c.fillTime) +
+                          ", states " + String((int)c.stateTime) + ", upload " + String((int)c.uploadTime));
+}
+
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+/// Performance counters. Times are in microseconds.
+struct MP_COUNTERS
+{
+    /// Drawn particles.
+    unsigned particles;
+    /// Filled vertices.
+    unsigned vertices;
+    /// Filled indices.
+    unsigned indices;
+    /// Draw batches.
+    unsigned batches;
+    /// Bytes uploaded to GPU buffers.
+    unsigned long long bytesUploaded;
+    /// Urho materials created from Magic render states.
+    unsigned materialsCreated;
+    /// Particles sorted with a cheaper mode than their emitter template (sorting policy).
+    unsigned sortSkipped;
+    /// Emitters simulated without fill because they are occluded.
+    unsigned occluded;
+    /// Fills skipped because neither the emitter nor the camera changed, previous geometry is drawn.
+    unsigned fillsSkipped;
+    /// Time spent in Magic_Update.
+    long long updateTime;
+    /// Time spent preparing and filling render arrays.
+    long long fillTime;
+    /// Time spent translating render states to materials.
+    long long stateTime;
+    /// Time spent uploading GPU buffers.
+    long long uploadTime;
+
+    MP_COUNTERS() { Reset(); }
+
+    void Reset() { memset(this, 0, sizeof(MP_COUNTERS)); }
+
+    MP_COUNTERS& operator +=(const MP_COUNTERS& rhs)
+    {
+        particles += rhs.particles;
+        vertices += rhs.vertices;
+        indices += rhs.indices;
+        batches += rhs.batches;
+        bytesUploaded += rhs.bytesUploaded;
+        materialsCreated += rhs.materialsCreated;
+        sortSkipped += rhs.sortSkipped;
+        occluded += rhs.occluded;
+        fillsSkipped += rhs.fillsSkipped;
+        updateTime += rhs.updateTime;
+        fillTime += rhs.fillTime;
+        stateTime += rhs.stateTime;
+        uploadTime += rhs.uploadTime;
+        return *this;
+    }
+};
+
+///-------------------------------------------------------------------------------------------------
+/// Magic particles statistics subsystem.
+/// Aggregates counters of all emitter instances per frame and since start,
+/// and optionally displays them in the DebugHud. Each thread adds to its own counters without
+/// locking, they are merged on main thread at frame begin once fills and simulation are done.
+///-------------------------------------------------------------------------------------------------
+class URHO3D_API MagicParticleStats : public Object
+{
+    URHO3D_OBJECT(MagicParticleStats, Object)
+
+public:
+    /// Construct.
+    MagicParticleStats(Context* context);
+    /// Destruct.
+    virtual ~MagicParticleStats();
+
+    /// Add counters of an emitter instance to current frame. May be called from worker threads, lock-free.
+    void Add(const MP_COUNTERS& counters);
+    /// Return counters of last complete frame.
+    const MP_COUNTERS& GetFrameCounters() const { return _lastFrame; }
+    /// Return counters accumulated since start (or last reset).
+    const MP_COUNTERS& GetTotalCounters() const { return _total; }
+    /// Return number of frames accumulated in total counters.
+    unsigned GetNumFrames() const { return _numFrames; }
+    /// Reset total counters.
+    void ResetTotal();
+
+    /// Show counters in DebugHud application stats.
+    void SetDebugHudEnabled(bool enable);
+    /// Return whether counters are shown in DebugHud.
+    bool GetDebugHudEnabled() const { return _debugHudEnabled; }
+
+private:
+    /// Handle frame begin : merge counters of all threads and close last frame counters.
+    void HandleBeginFrame(StringHash eventType, VariantMap& eventData);
+    /// Update DebugHud application stats.
+    void UpdateDebugHud();
+
+    /// Counters of current frame.
+    MP_COUNTERS _frame;
+    /// Counters of last complete frame.
+    MP_COUNTERS _lastFrame;
+    /// Counters since start.
+    MP_COUNTERS _total;
+    /// Frames since start.
+    unsigned _numFrames;
+    /// DebugHud display flag.
+    bool _debugHudEnabled;
+};
+
+}
@@ -0,0 +1,364 @@
+#include "MagicParticleSystem.h"
+#include "MagicParticleUtils.h"
+#include "MagicParticleTimeline.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+extern const char* GEOMETRY_CATEGORY;
+
+MagicParticleSystem::MagicParticleSystem(Context* context) :
+    Drawable(context, DRAWABLE_GEOMETRY)
+{
+    _simulation = GetSubsystem<MagicParticleSimulation>();
+    _stats = GetSubsystem<MagicParticleStats>();
+}
+
+MagicParticleSystem::~MagicParticleSystem()
+{
+    ClearOneShots();
+}
+
+void MagicParticleSystem::RegisterObject(Context* context)
+{
+    context->RegisterFactory<MagicParticleSystem>(GEOMETRY_CATEGORY);
+
+    URHO3D_COPY_BASE_ATTRIBUTES(Drawable);
+}
+
+void MagicParticleSystem::OnSceneSet(Scene* scene)
+{
+    Drawable::OnSceneSet(scene);
+
+    if (scene)
+        SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(MagicParticleSystem, HandleUpdate));
+    else
+        UnsubscribeFromEvent(E_UPDATE);
+}
+
+void MagicParticleSystem::OnWorldBoundingBoxUpdate()
+{
+    worldBoundingBox_ = boundingBox_;
+}
+
+void MagicParticleSystem::UpdateBatches(const FrameInfo& frame)
+{
+    distance_ = frame.camera_->GetDistance(GetWorldBoundingBox().Center());
+
+    // geometry of this view was filled at update, from its camera of previous frame
+    unsigned slot = _views.Add(frame.camera_, frame.frameNumber_, distance_);
+
+    batches_.Clear();
+
+    if (!_views.IsFilled(slot) || slot >= _geometries.Size())
+        return;
+
+    _geometries[slot].GetBatches(batches_, frame.camera_, slot);
+}
+
+void MagicParticleSystem::DrawDebugGeometry(DebugRenderer* debug, bool depthTest)
+{
+    if (debug && IsEnabledEffective())
+    {
+        for (unsigned i = 0; i < _oneShots.Size(); ++i)
+            debug->AddBoundingBox(_oneShots[i].instance->GetBoundingBox(), Color::YELLOW, depthTest);
+    }
+}
+
+bool MagicParticleSystem::SpawnOneShot(MagicParticleEffect* effect, int emitterIndex, const Vector3& position, const Quaternion& rotation)
+{
+    if (!effect || emitterIndex < 0)
+        return false;
+
+    MagicEmitterInstance* instance = effect->AcquireInstance(emitterIndex);
+    if (!instance)
+        return false;
+
+    instance->SetOwnerID(node_ ? node_->GetID() : 0);
+
+    MP_SIM_COMMAND spawn(MP_SIM_SPAWN, instance);
+    spawn.position = Urho3DToMagic(position);
+    spawn.direction = Urho3DToMagic(rotation);
+
+    if (_simulation)
+        _simulation->Post(spawn);
+    else
+        MagicParticleSimulation::Execute(spawn);
+
+    ONE_SHOT oneShot;
+    oneShot.effect = effect;
+    oneShot.instance = instance;
+    oneShot.position = position;
+    oneShot.distance = 0.0f;
+    oneShot.filled = false;
+    _oneShots.Push(oneShot);
+
+    if (!_effects.Contains(SharedPtr<MagicParticleEffect>(effect)))
+        _effects.Push(SharedPtr<MagicParticleEffect>(effect));
+
+    return true;
+}
+
+void MagicParticleSystem::ClearOneShots()
+{
+    for (unsigned i = 0; i < _oneShots.Size(); ++i)
+        _oneShots[i].effect->ReleaseInstance(_oneShots[i].instance);
+
+    _oneShots.Clear();
+    _order.Clear();
+    _effects.Clear();
+    _geometries.Clear();
+    batches_.Clear();
+}
+
+int MagicParticleSystem::GetParticlesCount() const
+{
+    int count = 0;
+    for (unsigned i = 0; i < _oneShots.Size(); ++i)
+        count += _oneShots[i].instance->GetParticlesCount();
+    return count;
+}
+
+void MagicParticleSystem::HandleUpdate(StringHash eventType, VariantMap& eventData)
+{
+    if (_oneShots.Empty())
+    {
+        batches_.Clear();
+        return;
+    }
+
+    URHO3D_PROFILE(UpdateMagicOneShots);
+
+    using namespace Update;
+    float timeStep = eventData[P_TIMESTEP].GetFloat();
+
+    // views that rendered the one-shots in previous frame
+    unsigned frameNumber = GetSubsystem<Time>()->GetFrameNumber();
+    unsigned nearest = _views.GetNearest(frameNumber);
+
+    // One-shots are always simulated so they retire on time, but only filled when visible.
+    bool visible = nearest != MagicViewList::NO_VIEW;
+
+    Vector3 cameraPosition = visible ? _views.GetCameraPosition(nearest) : Vector3::ZERO;
+
+    boundingBox_.Clear();
+
+    if (_simulation && _simulation->IsPipelined())
+    {
+        UpdatePipelined(1000.0 * timeStep, frameNumber, nearest, cameraPosition);
+        return;
+    }
+
+    // simulate once for all views from the nearest camera
+    if (visible)
+        _views.SetMagicCamera(nearest);
+
+    for (unsigned i = 0; i < _oneShots.Size();)
+    {
+        ONE_SHOT& oneShot = _oneShots[i];
+        MagicEmitterInstance* instance = oneShot.instance;
+
+        // sorting policy uses distance to the one-shot itself, not to the merged bounding box
+        oneShot.distance = visible ? (instance->GetBoundingBox().Center() - cameraPosition).Length() : distance_;
+        instance->ApplySorting(MP_SORT_AUTO, oneShot.distance);
+
+        if (!instance->Update(1000.0 * timeStep))
+        {
+            RetireOneShot(i);
+            continue;
+        }
+
+        boundingBox_.Merge(instance->GetBoundingBox());
+        ++i;
+    }
+
+    // fill one-shots and merge their geometry for each view, batches are set in UpdateBatches
+
+    if (visible)
+    {
+        SortOneShots();
+
+        _mergeOrder.Resize(_oneShots.Size());
+        for (unsigned k = 0; k < _oneShots.Size(); ++k)
+            _mergeOrder[k] = _oneShots[_order[k]].instance;
+    }
+
+    for (unsigned v = 0; visible && v < _views.Size(); ++v)
+    {
+        MAGIC_CAMERA camera;
+        if (!_views.IsActive(v, frameNumber) || !_views.GetMagicCamera(v, camera))
+            continue;
+
+        // no one-shot advanced nor came or left, camera did not move : merged geometry is kept
+        if (v < _geometries.Size() && _geometries[v].SkipMerge(v, camera, _mergeOrder))
+        {
+            _views.SetFilled(v);
+            continue;
+        }
+
+        // pushed for every view : an earlier view may have replaced the camera of the nearest one
+        Magic_SetCamera(&camera);
+
+        for (unsigned i = 0; i < _oneShots.Size(); ++i)
+        {
+            _oneShots[i].instance->Fill(&camera);
+            _oneShots[i].filled = true;
+        }
+
+        Merge(v);
+        _views.SetFilled(v);
+    }
+
+    // update octree placement with the merged bounding box
+    OnMarkedDirty(node_);
+}
+
+void MagicParticleSystem::UpdatePipelined(double time, unsigned frameNumber, unsigned nearest, const Vector3& cameraPosition)
+{
+    bool visible = nearest != MagicViewList::NO_VIEW;
+
+    // results of last simulation job : retire finished one-shots
+    for (unsigned i = 0; i < _oneShots.Size();)
+    {
+        MagicEmitterInstance* instance = _oneShots[i].instance;
+
+        if (!instance->IsAlive())
+        {
+            RetireOneShot(i);
+            continue;
+        }
+
+        boundingBox_.Merge(instance->GetBoundingBox());
+        ++i;
+    }
+
+    // merged back to front from the distances the fills were posted with
+    SortOneShots();
+
+    for (unsigned v = 0; v < _views.Size(); ++v)
+    {
+        bool presented = false;
+        for (unsigned i = 0; i < _oneShots.Size(); ++i)
+        {
+            _oneShots[i].filled = _oneShots[i].instance->TakeFill(v);
+            presented |= _oneShots[i].filled;
+        }
+
+        if (presented)
+        {
+            Merge(v);
+            _views.SetFilled(v);
+        }
+    }
+
+    // simulated after update, presented next frame
+    MP_SIM_COMMAND update(MP_SIM_UPDATE, nullptr);
+    update.time = time;
+    update.sortMode = MP_SORT_AUTO;
+    update.hasCamera = visible && _views.GetMagicCamera(nearest, update.camera);
+
+    for (unsigned i = 0; i < _oneShots.Size(); ++i)
+    {
+        ONE_SHOT& oneShot = _oneShots[i];
+        oneShot.distance = visible ? (oneShot.instance->GetBoundingBox().Center() - cameraPosition).Length() : distance_;
+
+        update.instance = oneShot.instance;
+        update.value = oneShot.distance;
+        _simulation->Post(update);
+    }
+
+    for (unsigned v = 0; visible && v < _views.Size(); ++v)
+    {
+        if (!_views.IsActive(v, frameNumber))
+            continue;
+
+        MP_SIM_COMMAND fill(MP_SIM_FILL, nullptr);
+        fill.view = v;
+        fill.hasCamera = _views.GetMagicCamera(v, fill.camera);
+
+        for (unsigned i = 0; i < _oneShots.Size(); ++i)
+        {
+            fill.instance = _oneShots[i].instance;
+            _simulation->Post(fill);
+            fill.hasCamera = false;
+        }
+    }
+
+    // update octree placement with the merged bounding box
+    OnMarkedDirty(node_);
+}
+
+
+void MagicParticleSystem::RetireOneShot(unsigned index)
+{
+    MagicEmitterInstance* instance = _oneShots[index].instance;
+    MagicParticleEffect* effect = _oneShots[index].effect;
+
+    // released instance must not be drawn anymore
+    for (unsigned i = 0; i < _geometries.Size(); ++i)
+        _geometries[i].RemoveInstance(instance);
+    batches_.Clear();
+
+    effect->ReleaseInstance(instance);
+    _oneShots.EraseSwap(index);
+    _order.Clear();
+
+    // effect is kept alive while a one-shot uses it
+    for (unsigned i = 0; i < _oneShots.Size(); ++i)
+    {
+        if (_oneShots[i].effect == effect)
+            return;
+    }
+    _effects.Remove(SharedPtr<MagicParticleEffect>(effect));
+}
+
+void MagicParticleSystem::SortOneShots()
+{
+    if (_order.Size() != _oneShots.Size())
+    {
+        _order.Resize(_oneShots.Size());
+        for (unsigned i = 0; i < _order.Size(); ++i)
+            _order[i] = i;
+    }
+
+    // back to front, order barely changes between frames : insertion sort is close to linear
+    for (unsigned i = 1; i < _order.Size(); ++i)
+    {
+        unsigned oneShot = _order[i];
+        unsigned j = i;
+        for (; j > 0 && _oneShots[_order[j - 1]].distance < _oneShots[oneShot].distance; --j)
+            _order[j] = _order[j - 1];
+        _order[j] = oneShot;
+    }
+}
+
+void MagicParticleSystem::Merge(unsigned view)
+{
+    URHO3D_PROFILE(MagicOneShotsMerge);
+    MP_TIMELINE_SCOPE("OneShotsMerge", 0);
+
+    if (view >= _geometries.Size())
+        _geometries.Resize(view + 1);
+
+    MagicMergedGeometry& geometry = _geometries[view];
+    geometry.Begin();
+
+    bool ordered = _order.Size() == _oneShots.Size();
+
+    for (unsigned k = 0; k < _oneShots.Size(); ++k)
+    {
+        ONE_SHOT& oneShot = _oneShots[ordered ? _order[k] : k];
+        if (!oneShot.filled)
+            continue;
+
+        oneShot.filled = false;
+
+        const BoundingBox& box = oneShot.instance->GetBoundingBox();
+        geometry.Add(oneShot.instance, view, box.Defined() ? box.Center() : oneShot.position);
+    }
+
+    geometry.End(context_, _stats);
+}
+
+}
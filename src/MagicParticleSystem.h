@@ -0,0 +1,97 @@
+#pragma once
+
+#include "MagicParticleEffect.h"
+#include "MagicEmitterInstance.h"
+#include "MagicParticleView.h"
+#include "MagicParticleSimulation.h"
+#include "MagicParticleMerge.h"
+#include "Magic.h"
+
+namespace Urho3D
+{
+
+///-------------------------------------------------------------------------------------------------
+/// Scene-wide Magic particle system.
+/// Create it on the scene node. Runs fire-and-forget effects (impacts, muzzle flashes, sparks...)
+/// from a flat array of pooled emitter instances rendered by this single drawable, without any
+/// node, component or event subscription per effect. Filled geometry of one-shots is merged
+/// back to front into shared buffers (see MagicMergedGeometry).
+///-------------------------------------------------------------------------------------------------
+class URHO3D_API MagicParticleSystem : public Drawable
+{
+    URHO3D_OBJECT(MagicParticleSystem, Drawable)
+
+public:
+    /// Construct.
+    MagicParticleSystem(Context* context);
+    /// Destruct.
+    virtual ~MagicParticleSystem();
+    /// Register object factory.
+    static void RegisterObject(Context* context);
+
+    /// Calculate distance and prepare batches for rendering. May be called from worker thread(s), possibly re-entrantly.
+    virtual void UpdateBatches(const FrameInfo& frame);
+    /// Visualize the component as debug geometry.
+    virtual void DrawDebugGeometry(DebugRenderer* debug, bool depthTest);
+    /// Return whether a geometry update is necessary, and if it can happen in a worker thread.
+    virtual UpdateGeometryType GetUpdateGeometryType() { return UPDATE_NONE; }
+
+    /// Spawn a one-shot effect using emitter at index. Its timeline is played once and it is retired automatically when finished. Return true if successful.
+    bool SpawnOneShot(MagicParticleEffect* effect, int emitterIndex, const Vector3& position, const Quaternion& rotation = Quaternion::IDENTITY);
+    /// Remove all running one-shot effects.
+    void ClearOneShots();
+    /// Return number of running one-shot effects.
+    unsigned GetNumOneShots() const { return _oneShots.Size(); }
+    /// Return the number of the drawing particles of one-shot effects.
+    int GetParticlesCount() const;
+
+private:
+    /// Handle scene being assigned.
+    virtual void OnSceneSet(Scene* scene);
+    /// Recalculate the world-space bounding box.
+    virtual void OnWorldBoundingBoxUpdate();
+    /// Handle one-shots update, create and render geometries.
+    void HandleUpdate(StringHash eventType, VariantMap& eventData);
+    /// Present last simulation results and post simulation of one-shots (pipelined mode).
+    void UpdatePipelined(double time, unsigned frameNumber, unsigned nearest, const Vector3& cameraPosition);
+    /// Release one-shot at index, last one takes its place. Its effect is released with its last one-shot.
+    void RetireOneShot(unsigned index);
+    /// Compute back to front merge order of one-shots from their distance to nearest camera.
+    void SortOneShots();
+    /// Merge filled geometry of one-shots into shared buffers of a view and upload it.
+    void Merge(unsigned view);
+
+    /// One-shot effect instance.
+    struct ONE_SHOT
+    {
+        /// Effect owning the pooled instance.
+        MagicParticleEffect* effect;
+        /// Pooled emitter instance.
+        MagicEmitterInstance* instance;
+        /// World spawn position.
+        Vector3 position;
+        /// Distance to nearest camera at last update.
+        float distance;
+        /// Geometry filled for the view being merged.
+        bool filled;
+    };
+
+    /// Running one-shot effects.
+    PODVector<ONE_SHOT> _oneShots;
+    /// One-shot indices, back to front.
+    PODVector<unsigned> _order;
+    /// Effects referenced by running one-shots.
+    Vector<SharedPtr<MagicParticleEffect> > _effects;
+    /// Cameras rendering the one-shots.
+    MagicViewList _views;
+    /// Instances of one-shots in merge order, to skip unchanged merges.
+    PODVector<MagicEmitterInstance*> _mergeOrder;
+    /// Merged GPU geometry per view.
+    Vector<MagicMergedGeometry> _geometries;
+    /// Simulation subsystem.
+    MagicParticleSimulation* _simulation;
+    /// Global stats subsystem.
+    MagicParticleStats* _stats;
+};
+
+}
@@ -0,0 +1,285 @@
+#include "MagicParticleTimeline.h"
+#include <Urho3D/Urho3DAll.h>
+
+#include <atomic>
+
+namespace Urho3D
+{
+
+/// Events per thread ring buffer, must be a power of two.
+static const unsigned MP_TIMELINE_RING_SIZE = 32768;
+
+/// Single producer ring buffer, written by its thread, read when saving.
+struct MP_TIMELINE_RING
+{
+    /// Index in rings, used as thread id.
+    unsigned index;
+    /// Ring belongs to main thread.
+    bool mainThread;
+    /// Number of events ever written.
+    std::atomic<unsigned> head;
+    /// Events.
+    MP_TIMELINE_EVENT events[MP_TIMELINE_RING_SIZE];
+};
+
+/// Rings of all threads that recorded phases, kept until exit as threads hold pointers to them.
+struct MP_TIMELINE_RINGS
+{
+    Mutex mutex;
+    PODVector<MP_TIMELINE_RING*> rings;
+
+    ~MP_TIMELINE_RINGS()
+    {
+        for (unsigned i = 0; i < rings.Size(); ++i)
+            delete rings[i];
+    }
+};
+
+static MP_TIMELINE_RINGS timelineRings;
+static thread_local MP_TIMELINE_RING* timelineThreadRing = 0;
+static std::atomic<bool> timelineActive(false);
+static std::atomic<unsigned> timelineFrame(0);
+static HiresTimer timelineTimer;
+
+//----------------------------------------------------------------------------------------------------
+
+MagicParticleTimeline::MagicParticleTimeline(Context* context) :
+    Object(context)
+    , _captureFrames(0)
+    , _captureStart(0)
+    , _hitchThreshold(0.0f)
+    , _hitchFrames(0)
+    , _numHitches(0)
+    , _hitchArmed(true)
+    , _saveFrame(M_MAX_UNSIGNED)
+    , _saving(false)
+{
+    SubscribeToEvent(E_BEGINFRAME, URHO3D_HANDLER(MagicParticleTimeline, HandleBeginFrame));
+}
+
+MagicParticleTimeline::~MagicParticleTimeline()
+{
+    timelineActive = false;
+    WaitSave();
+}
+
+void MagicParticleTimeline::CaptureFrames(unsigned numFrames, const String& fileName)
+{
+    _captureFrames = numFrames;
+    _captureStart = timelineFrame + 1;
+    _captureFileName = fileName;
+    UpdateActive();
+}
+
+void MagicParticleTimeline::SetHitchTrigger(float threshold, unsigned numFrames, const String& fileName)
+{
+    _hitchThreshold = Max(threshold, 0.0f);
+    _hitchFrames = Max(numFrames, 1U);
+    _hitchFileName = fileName;
+    _hitchArmed = true;
+    UpdateActive();
+}
+
+bool MagicParticleTimeline::IsCapturing() const
+{
+    return timelineActive;
+}
+
+void MagicParticleTimeline::UpdateActive()
+{
+    timelineActive = _captureFrames > 0 || _hitchThreshold > 0.0f;
+}
+
+bool MagicParticleTimeline::IsActive()
+{
+    return timelineActive.load(std::memory_order_relaxed);
+}
+
+long long MagicParticleTimeline::GetTimestamp()
+{
+    return timelineTimer.GetUSec(false);
+}
+
+void MagicParticleTimeline::Record(const char* name, int emitter, long long begin, long long end)
+{
+    MP_TIMELINE_RING* ring = timelineThreadRing;
+    if (!ring)
+    {
+        // first phase recorded by this thread
+        ring = new MP_TIMELINE_RING();
+        ring->mainThread = Thread::IsMainThread();
+        ring->head = 0;
+
+        MutexLock lock(timelineRings.mutex);
+        ring->index = timelineRings.rings.Size();
+        timelineRings.rings.Push(ring);
+        timelineThreadRing = ring;
+    }
+
+    unsigned head = ring->head.load(std::memory_order_relaxed);
+    MP_TIMELINE_EVENT& event = ring->events[head & (MP_TIMELINE_RING_SIZE - 1)];
+    event.name = name;
+    event.emitter = emitter;
+    event.frame = timelineFrame.load(std::memory_order_relaxed);
+    event.begin = begin;
+    event.end = end;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void MagicParticleTimeline::HandleBeginFrame(StringHash eventType, VariantMap& eventData)
+{
+    using namespace BeginFrame;
+
+    unsigned lastFrame = timelineFrame++;
+
+    // capture window complete
+    if (_captureFrames && lastFrame >= _captureStart + _captureFrames - 1)
+    {
+        WaitSave();
+        SaveAsync(_captureFileName, _captureStart, lastFrame);
+        _captureFrames = 0;
+        UpdateActive();
+    }
+
+    // time step is the duration of the frame that just ended, the one that copied the rings of
+    // a dump is slow because of it
+    if (_hitchThreshold <= 0.0f || lastFrame == _saveFrame)
+        return;
+
+    float frameTime = eventData[P_TIMESTEP].GetFloat() * 1000.0f;
+    if (frameTime <= _hitchThreshold)
+    {
+        _hitchArmed = true;
+        return;
+    }
+
+    // one dump per hitch, frames of a long slowdown are not dumped again and again
+    if (!_hitchArmed || IsSaving())
+        return;
+
+    String fileName = ReplaceExtension(_hitchFileName, "") + "_" + String(_numHitches) + GetExtension(_hitchFileName);
+    unsigned firstFrame = lastFrame + 1 > _hitchFrames ? lastFrame + 1 - _hitchFrames : 0;
+    if (SaveAsync(fileName, firstFrame, lastFrame))
+    {
+        ++_numHitches;
+        _hitchArmed = false;
+    }
+}
+
+bool MagicParticleTimeline::Save(const String& fileName, unsigned firstFrame, unsigned lastFrame)
+{
+    Vector<THREAD_EVENTS> threads;
+    Snapshot(firstFrame, lastFrame, threads);
+    return Write(context_, fileName, threads, firstFrame, lastFrame);
+}
+
+bool MagicParticleTimeline::SaveAsync(const String& fileName, unsigned firstFrame, unsigned lastFrame)
+{
+    if (IsSaving())
+        return false;
+
+    // previous dump is done, its thread only has to be joined
+    WaitSave();
+
+    Vector<THREAD_EVENTS>* threads = new Vector<THREAD_EVENTS>();
+    Snapshot(firstFrame, lastFrame, *threads);
+    _saveFrame = timelineFrame;
+    _saving = true;
+
+    Context* context = context_;
+    _saveThread = std::thread([this, context, fileName, threads, firstFrame, lastFrame]()
+    {
+        Write(context, fileName, *threads, firstFrame, lastFrame);
+        delete threads;
+        _saving.store(false, std::memory_order_release);
+    });
+
+    return true;
+}
+
+void MagicParticleTimeline::WaitSave()
+{
+    if (_saveThread.joinable())
+        _saveThread.join();
+}
+
+void MagicParticleTimeline::Snapshot(unsigned firstFrame, unsigned lastFrame, Vector<THREAD_EVENTS>& threads)
+{
+    PODVector<MP_TIMELINE_RING*> rings;
+    {
+        MutexLock lock(timelineRings.mutex);
+        rings = timelineRings.rings;
+    }
+
+    PODVector<MP_TIMELINE_EVENT> events;
+    threads.Resize(rings.Size());
+
+    for (unsigned i = 0; i < rings.Size(); ++i)
+    {
+        MP_TIMELINE_RING* ring = rings[i];
+        THREAD_EVENTS& thread = threads[i];
+        thread.index = ring->index;
+        thread.mainThread = ring->mainThread;
+        thread.events.Clear();
+
+        // copy events, then drop the ones the writer may have overwritten meanwhile
+        unsigned head = ring->head.load(std::memory_order_acquire);
+        unsigned start = head > MP_TIMELINE_RING_SIZE ? head - MP_TIMELINE_RING_SIZE : 0;
+
+        events.Resize(head - start);
+        for (unsigned j = start; j < head; ++j)
+            events[j - start] = ring->events[j & (MP_TIMELINE_RING_SIZE - 1)];
+
+        unsigned newHead = ring->head.load(std::memory_order_acquire);
+        unsigned valid = newHead > MP_TIMELINE_RING_SIZE ? newHead - MP_TIMELINE_RING_SIZE : 0;
+
+        for (unsigned j = Max(start, valid); j < head; ++j)
+        {
+            const MP_TIMELINE_EVENT& event = events[j - start];
+            if (event.frame >= firstFrame && event.frame <= lastFrame)
+                thread.events.Push(event);
+        }
+    }
+}
+
+bool MagicParticleTimeline::Write(Context* context, const String& fileName, const Vector<THREAD_EVENTS>& threads, unsigned firstFrame, unsigned lastFrame)
+{
+    File file(context, fileName, FILE_WRITE);
+    if (!file.IsOpen())
+    {
+        URHO3D_LOGERROR("Could not write timeline file " + fileName);
+        return false;
+    }
+
+    String json = "{\"traceEvents\":[\n";
+    bool first = true;
+    unsigned numEvents = 0;
+
+    for (unsigned i = 0; i < threads.Size(); ++i)
+    {
+        const THREAD_EVENTS& thread = threads[i];
+
+        // thread name
+        json += String(first ? "" : ",\n") + "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" + String(thread.index) +
+                ",\"args\":{\"name\":\"" + (thread.mainThread ? String("Main") : "Worker " + String(thread.index)) + "\"}}";
+        first = false;
+
+        for (unsigned j = 0; j < thread.events.Size(); ++j)
+        {
+            const MP_TIMELINE_EVENT& event = thread.events[j];
+            json += ",\n{\"name\":\"" + String(event.name) + "\",\"ph\":\"X\",\"pid\":0,\"tid\":" + String(thread.index) +
+                    ",\"ts\":" + String(event.begin) + ",\"dur\":" + String(event.end - event.begin) +
+                    ",\"args\":{\"emitter\":" + String(event.emitter) + ",\"frame\":" + String(event.frame) + "}}";
+            ++numEvents;
+        }
+    }
+
+    json += "\n]}\n";
+    file.Write(json.CString(), json.Length());
+
+    URHO3D_LOGINFO("Particle timeline of frames " + String(firstFrame) + "-" + String(lastFrame) + " (" + String(numEvents) +
+                   " phases) written to " + fileName);
+    return true;
+}
+
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+
+#include <atomic>
+#include <thread>
+
+namespace Urho3D
+{
+
+/// Timed pipeline phase of an emitter.
+struct MP_TIMELINE_EVENT
+{
+    /// Phase name (static string).
+    const char* name;
+    /// Emitter handle, 0 if not related to an emitter.
+    int emitter;
+    /// Frame number.
+    unsigned frame;
+    /// Begin timestamp (microseconds).
+    long long begin;
+    /// End timestamp (microseconds).
+    long long end;
+};
+
+///-------------------------------------------------------------------------------------------------
+/// Timeline of particle pipeline phases exported to Chrome Trace Event JSON (chrome://tracing).
+/// Phases are recorded per thread in lock-free ring buffers, only the owner thread writes to its ring.
+/// Capture a window of frames now, or keep recording and dump the last frames when a hitch occurs.
+/// Dumps copy the rings on main thread and are written on a background thread. One dump is written
+/// per hitch : the trigger is re-armed once a frame is back under the threshold, and the frame that
+/// copied the rings is not checked.
+///-------------------------------------------------------------------------------------------------
+class URHO3D_API MagicParticleTimeline : public Object
+{
+    URHO3D_OBJECT(MagicParticleTimeline, Object)
+
+public:
+    /// Construct.
+    MagicParticleTimeline(Context* context);
+    /// Destruct.
+    virtual ~MagicParticleTimeline();
+
+    /// Record next frames and write them to file.
+    void CaptureFrames(unsigned numFrames, const String& fileName);
+    /// Keep recording and write the last frames to file when a frame takes longer than threshold (milliseconds). 0 disables.
+    void SetHitchTrigger(float threshold, unsigned numFrames, const String& fileName);
+    /// Return whether phases are being recorded.
+    bool IsCapturing() const;
+    /// Return whether a dump is being written on the background thread.
+    bool IsSaving() const { return _saving.load(std::memory_order_acquire); }
+    /// Write recorded phases of a frame range to file. Return true if successful.
+    bool Save(const String& fileName, unsigned firstFrame, unsigned lastFrame);
+    /// Copy recorded phases of a frame range and write them to file on a background thread. Return false if a dump is still being written.
+    bool SaveAsync(const String& fileName, unsigned firstFrame, unsigned lastFrame);
+    /// Wait until the dump being written is done.
+    void WaitSave();
+
+    /// Return whether phases are being recorded, cheap enough to be tested in hot paths.
+    static bool IsActive();
+    /// Return current timestamp in microseconds.
+    static long long GetTimestamp();
+    /// Record a phase in the calling thread ring buffer.
+    static void Record(const char* name, int emitter, long long begin, long long end);
+
+private:
+    /// Recorded phases of a thread.
+    struct THREAD_EVENTS
+    {
+        /// Thread id.
+        unsigned index;
+        /// Thread is main thread.
+        bool mainThread;
+        /// Phases of the copied frame range.
+        PODVector<MP_TIMELINE_EVENT> events;
+    };
+
+    /// Handle frame begin : advance frame number, check capture window and hitch trigger.
+    void HandleBeginFrame(StringHash eventType, VariantMap& eventData);
+    /// Update active flag from capture settings.
+    void UpdateActive();
+    /// Copy recorded phases of a frame range from the rings of all threads.
+    static void Snapshot(unsigned firstFrame, unsigned lastFrame, Vector<THREAD_EVENTS>& threads);
+    /// Write copied phases to file. May be called from the background thread.
+    static bool Write(Context* context, const String& fileName, const Vector<THREAD_EVENTS>& threads, unsigned firstFrame, unsigned lastFrame);
+
+    /// Frames left to capture.
+    unsigned _captureFrames;
+    /// First captured frame.
+    unsigned _captureStart;
+    /// Capture file name.
+    String _captureFileName;
+    /// Hitch threshold (milliseconds).
+    float _hitchThreshold;
+    /// Frames written on hitch.
+    unsigned _hitchFrames;
+    /// Hitch file name.
+    String _hitchFileName;
+    /// Number of hitch dumps, appended to file name.
+    unsigned _numHitches;
+    /// Hitch trigger is armed, a frame was under threshold since last dump.
+    bool _hitchArmed;
+    /// Frame that copied the rings of last dump, not checked for hitch.
+    unsigned _saveFrame;
+    /// Background thread writing a dump.
+    std::thread _saveThread;
+    /// A dump is being written.
+    std::atomic<bool> _saving;
+};
+
+///-------------------------------------------------------------------------------------------------
+/// Record a phase from construction to destruction when the timeline is active.
+///-------------------------------------------------------------------------------------------------
+class MagicTimelineScope
+{
+public:
+    /// Construct and start timing.
+    MagicTimelineScope(const char* name, int emitter = 0) :
+        _name(name),
+        _emitter(emitter),
+        _begin(MagicParticleTimeline::IsActive() ? MagicParticleTimeline::GetTimestamp() : -1)
+    {
+    }
+
+    /// Destruct and record.
+    ~MagicTimelineScope()
+    {
+        if (_begin >= 0)
+            MagicParticleTimeline::Record(_name, _emitter, _begin, MagicParticleTimeline::GetTimestamp());
+    }
+
+private:
+    /// Phase name.
+    const char* _name;
+    /// Emitter handle.
+    int _emitter;
+    /// Begin timestamp, -1 if timeline was not active.
+    long long _begin;
+};
+
+#define MP_TIMELINE_SCOPE(name, emitter) MagicTimelineScope mpTimelineScope(name, emitter)
+
+}
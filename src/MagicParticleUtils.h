@@ -0,0 +1,47 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+#include "Magic.h"
+#include "MagicTrace.h"
+
+namespace Urho3D
+{
+
+#ifdef ASSERT_DEBUG
+    #define MP_ASSERT(X) assert(X)
+#else
+    #define MP_ASSERT(X)
+#endif
+
+// scale conversion factors between magic particle 3D and Urho3D (1:100)
+#define SCALE_URHO3D_TO_MAGIC 100.0f
+#define SCALE_MAGIC_TO_URHO3D 0.01f
+
+// vertices addressed by 16 bits indices, larger fills are split in chunks of this size
+#define MP_MAX_VERTICES_16 65536
+
+//----------------------------------------------------------------------------------------------------
+
+static inline Vector3 MagicToUrho3D(const MAGIC_POSITION& pos)
+{
+    return Vector3(pos.x, pos.y, pos.z) * SCALE_MAGIC_TO_URHO3D;
+}
+
+/*static inline Quaternion MagicToUrho3D(const MAGIC_DIRECTION& dir)
+{
+    return Quaternion(-dir.w, -dir.x, -dir.y, dir.z);
+}*/
+
+static inline MAGIC_POSITION Urho3DToMagic(const Vector3& pos)
+{
+    MAGIC_POSITION position = { pos.x_ * SCALE_URHO3D_TO_MAGIC, pos.y_ * SCALE_URHO3D_TO_MAGIC, pos.z_ * SCALE_URHO3D_TO_MAGIC};
+    return position;
+}
+
+static inline MAGIC_DIRECTION Urho3DToMagic(const Quaternion& rot)
+{
+    MAGIC_DIRECTION direction = { -rot.x_, -rot.y_, -rot.z_, rot.w_ };
+    return direction;
+}
+
+}
@@ -0,0 +1,149 @@
+#include "MagicParticleView.h"
+#include "MagicParticleUtils.h"
+#include "MagicParticleTimeline.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+unsigned MagicViewList::Add(Camera* camera, unsigned frameNumber, float distance)
+{
+    unsigned slot = NO_VIEW;
+
+    for (unsigned i = 0; i < _views.Size(); ++i)
+    {
+        MP_VIEW& view = _views[i];
+        if (view.camera.Get() == camera)
+        {
+            slot = i;
+            break;
+        }
+
+        // first free slot : camera gone, or not rendering this drawable anymore
+        if (slot == NO_VIEW && (view.camera.Expired() || view.frameNumber + VIEW_TIMEOUT < frameNumber))
+            slot = i;
+    }
+
+    if (slot == NO_VIEW)
+    {
+        slot = _views.Size();
+        _views.Resize(slot + 1);
+    }
+
+    MP_VIEW& view = _views[slot];
+    if (view.camera.Get() != camera)
+    {
+        // geometry of the slot belongs to the previous camera
+        view.camera = camera;
+        view.filled = false;
+    }
+    view.frameNumber = frameNumber;
+    view.distance = distance;
+
+    return slot;
+}
+
+unsigned MagicViewList::Find(Camera* camera) const
+{
+    for (unsigned i = 0; i < _views.Size(); ++i)
+    {
+        if (_views[i].camera.Get() == camera)
+            return i;
+    }
+
+    return NO_VIEW;
+}
+
+bool MagicViewList::IsActive(unsigned slot, unsigned frameNumber) const
+{
+    const MP_VIEW& view = _views[slot];
+    return !view.camera.Expired() && view.frameNumber + 1 >= frameNumber;
+}
+
+bool MagicViewList::IsOccluded(Drawable* drawable, unsigned frameNumber) const
+{
+    // cameras of views rendered in previous frame, headless has none
+    Renderer* renderer = drawable->GetSubsystem<Renderer>();
+    if (!renderer)
+        return false;
+
+    const BoundingBox& worldBox = drawable->GetWorldBoundingBox();
+    float drawDistance = drawable->GetDrawDistance();
+
+    // no timeout : a culled drawable does not register views, their frame number stops when it is hidden
+    for (unsigned i = 0; i < _views.Size(); ++i)
+    {
+        Camera* camera = _views[i].camera;
+        if (!camera || IsActive(i, frameNumber))
+            continue;
+
+        // culled by view mask or draw distance, not hidden
+        if (!(camera->GetViewMask() & drawable->GetViewMask()))
+            continue;
+        if (drawDistance > 0.0f && camera->GetDistance(worldBox.Center()) > drawDistance)
+            continue;
+
+        bool rendering = false;
+        for (unsigned j = 0; j < renderer->GetNumViews() && !rendering; ++j)
+            rendering = renderer->GetView(j) && renderer->GetView(j)->GetCamera() == camera;
+        if (!rendering)
+            continue;
+
+        // in frustum but not rendered : hidden by occluders
+        if (camera->GetFrustum().IsInsideFast(worldBox) != OUTSIDE)
+            return true;
+    }
+
+    return false;
+}
+
+bool MagicViewList::IsInFrustum(unsigned slot, const BoundingBox& worldBox) const
+{
+    Camera* camera = _views[slot].camera;
+    return camera && camera->GetFrustum().IsInsideFast(worldBox) != OUTSIDE;
+}
+
+unsigned MagicViewList::GetNearest(unsigned frameNumber) const
+{
+    unsigned nearest = NO_VIEW;
+
+    for (unsigned i = 0; i < _views.Size(); ++i)
+    {
+        if (IsActive(i, frameNumber) && (nearest == NO_VIEW || _views[i].distance < _views[nearest].distance))
+            nearest = i;
+    }
+
+    return nearest;
+}
+
+Vector3 MagicViewList::GetCameraPosition(unsigned slot) const
+{
+    Camera* camera = _views[slot].camera;
+    return camera ? camera->GetNode()->GetWorldPosition() : Vector3::ZERO;
+}
+
+bool MagicViewList::GetMagicCamera(unsigned slot, MAGIC_CAMERA& magicCamera) const
+{
+    Camera* camera = _views[slot].camera;
+    if (!camera)
+        return false;
+
+    Node* cameraNode = camera->GetNode();
+
+    magicCamera.pos = Urho3DToMagic(cameraNode->GetWorldPosition());
+    magicCamera.dir = Urho3DToMagic(cameraNode->GetWorldDirection());
+    magicCamera.mode = MAGIC_CAMERA_FREE;
+    return true;
+}
+
+void MagicViewList::SetMagicCamera(unsigned slot) const
+{
+    MAGIC_CAMERA magicCamera;
+    if (!GetMagicCamera(slot, magicCamera))
+        return;
+
+    MP_TIMELINE_SCOPE("CameraPush", 0);
+    Magic_SetCamera(&magicCamera);
+}
+
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+#include "Magic.h"
+
+namespace Urho3D
+{
+
+/// Camera rendering a Magic drawable.
+struct MP_VIEW
+{
+    /// Camera, slot can be reused when expired.
+    WeakPtr<Camera> camera;
+    /// Last frame the drawable was in view.
+    unsigned frameNumber;
+    /// Distance from camera at last frame.
+    float distance;
+    /// Geometry slot filled for this camera since the slot was assigned.
+    bool filled;
+
+    MP_VIEW() : frameNumber(0), distance(0.0f), filled(false) { }
+};
+
+///-------------------------------------------------------------------------------------------------
+/// Cameras rendering a Magic drawable (split-screen, reflections, minimap...).
+/// Each view owns a geometry slot in emitter instances : particles are simulated once per frame,
+/// then filled and uploaded once per view that rendered the drawable in previous frame.
+/// Views are registered from UpdateBatches, which Urho calls once per view and drawable.
+///-------------------------------------------------------------------------------------------------
+class MagicViewList
+{
+public:
+    /// Invalid slot.
+    static const unsigned NO_VIEW = M_MAX_UNSIGNED;
+    /// Frames after which a view not rendering the drawable gives its slot to another camera.
+    static const unsigned VIEW_TIMEOUT = 60;
+
+    /// Register camera rendering the drawable in current frame. Return its slot.
+    unsigned Add(Camera* camera, unsigned frameNumber, float distance);
+    /// Return slot of camera, NO_VIEW if it has none.
+    unsigned Find(Camera* camera) const;
+    /// Return whether view at slot rendered the drawable in previous or current frame.
+    bool IsActive(unsigned slot, unsigned frameNumber) const;
+    /// Return whether the drawable was culled in previous frame while inside the frustum of a camera that rendered it before and still renders a view,
+    /// within its draw distance and view mask (occlusion).
+    bool IsOccluded(Drawable* drawable, unsigned frameNumber) const;
+    /// Return whether world box is inside the frustum of the camera of view at slot, as it is placed now.
+    bool IsInFrustum(unsigned slot, const BoundingBox& worldBox) const;
+    /// Return active view nearest to the drawable, NO_VIEW if none.
+    unsigned GetNearest(unsigned frameNumber) const;
+    /// Return number of slots.
+    unsigned Size() const { return _views.Size(); }
+    /// Return view at slot.
+    const MP_VIEW& Get(unsigned slot) const { return _views[slot]; }
+    /// Return world position of camera at slot.
+    Vector3 GetCameraPosition(unsigned slot) const;
+    /// Mark geometry slot as filled for its camera.
+    void SetFilled(unsigned slot) { _views[slot].filled = true; }
+    /// Return whether geometry slot is filled for its camera.
+    bool IsFilled(unsigned slot) const { return _views[slot].filled; }
+    /// Return Magic camera of view at slot. Return false if camera is gone.
+    bool GetMagicCamera(unsigned slot, MAGIC_CAMERA& magicCamera) const;
+    /// Push camera of view at slot to Magic.
+    void SetMagicCamera(unsigned slot) const;
+    /// Remove all views.
+    void Clear() { _views.Clear(); }
+
+private:
+    /// Views.
+    Vector<MP_VIEW> _views;
+};
+
+}
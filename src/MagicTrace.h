@@ -0,0 +1,141 @@
+#pragma once
+
+#include <Urho3D/Urho3DAll.h>
+#include "Magic.h"
+
+///-------------------------------------------------------------------------------------------------
+/// Record/replay of Magic API outputs.
+///
+/// MAGIC_RECORD_WRAP : Magic_* calls having outputs are routed to MP_Record_* wrappers which call the
+///                     Magic library and write the outputs (render arrays, vertices, render states,
+///                     bounding boxes, materials...) to a trace file.
+/// MAGIC_REPLAY_WRAP : the Magic library is replaced by an implementation of the Magic_* entry points
+///                     serving the outputs back from a trace file, so the wrapper (buffer mapping,
+///                     states translation, materials lookup, uploads and batching) runs on platforms
+///                     without Magic binaries.
+///
+/// Outputs are queued per call and per handle (emitter, file...). Replay must run the same scene
+/// with the same frame times as the recording, and snapshots must be disabled in both.
+/// Every Magic_* function called by the wrapper must have a replay implementation.
+///-------------------------------------------------------------------------------------------------
+
+namespace Urho3D
+{
+
+/// Trace file identifier and version.
+static const char MP_TRACE_FILE_ID[] = "MPTR";
+static const unsigned MP_TRACE_FILE_VERSION = 2;
+
+/// Recorded calls.
+enum MP_TRACE_CALL
+{
+    MP_TRACE_UPDATE = 0,
+    MP_TRACE_GETBBOX,
+    MP_TRACE_PREPARERENDERARRAYS,
+    MP_TRACE_GETRENDERARRAYDATA,
+    MP_TRACE_FILLRENDERARRAYS,
+    MP_TRACE_GETVERTICES,
+    MP_TRACE_GETNEXTRENDERSTATE,
+    MP_TRACE_OPENFILEINMEMORY,
+    MP_TRACE_FINDFIRST,
+    MP_TRACE_FINDNEXT,
+    MP_TRACE_LOADEMITTER,
+    MP_TRACE_HASTEXTURES,
+    MP_TRACE_GETNEXTATLASCHANGE,
+    MP_TRACE_GETMATERIALCOUNT,
+    MP_TRACE_GETMATERIAL,
+    MP_TRACE_GETEMITTERNAME,
+    MP_TRACE_DUPLICATEEMITTER,
+    MP_TRACE_ISINTERVAL1,
+    MP_TRACE_GETLOOPMODE,
+    MP_TRACE_GETEMITTERPOSITIONMODE,
+    MP_TRACE_GETPOSITION,
+    MP_TRACE_GETEMITTERPOSITION,
+    MP_TRACE_GETSORTINGMODE,
+    MP_TRACE_GETNEXTEVENT,
+    MP_TRACE_CREATEOBSTACLE,
+    MP_TRACE_GETEMITTERCOUNT,
+    MP_TRACE_GETPARTICLESTYPECOUNT,
+    MP_TRACE_GETORIENTATION,
+    MP_TRACE_CALL_MAX
+};
+
+#if defined(MAGIC_RECORD_WRAP) || defined(MAGIC_REPLAY_WRAP)
+/// Open trace file, for writing when recording, for reading when replaying. Must be called before loading effects.
+bool MagicTraceOpen(Context* context, const String& fileName);
+/// Flush and close trace file.
+void MagicTraceClose();
+#endif
+
+}
+
+#if defined(MAGIC_RECORD_WRAP) && defined(MAGIC_REPLAY_WRAP)
+    #error "MAGIC_RECORD_WRAP and MAGIC_REPLAY_WRAP are exclusive"
+#endif
+
+#ifdef MAGIC_RECORD_WRAP
+
+bool MP_Record_Update(HM_EMITTER hmEmitter, double time);
+int MP_Record_GetBBox(HM_EMITTER hmEmitter, MAGIC_BBOX* bbox);
+void* MP_Record_PrepareRenderArrays(HM_EMITTER hmEmitter, MAGIC_RENDERING_START* start, int max_arrays_streams, MAGIC_ARGB_ENUM argb_format, bool index32);
+int MP_Record_GetRenderArrayData(void* context, int index, MAGIC_ARRAY_INFO* info);
+int MP_Record_SetRenderArrayData(void* context, int index, void* buffer, int offset, int stride);
+void MP_Record_FillRenderArrays(void* context);
+int MP_Record_GetVertices(void* context, MAGIC_RENDER_VERTICES* vrts);
+int MP_Record_GetNextRenderState(void* context, MAGIC_RENDER_STATE* state);
+HM_FILE MP_Record_OpenFileInMemory(const char* buffer);
+const char* MP_Record_FindFirst(HM_FILE hmFile, MAGIC_FIND_DATA* data, int mode);
+const char* MP_Record_FindNext(HM_FILE hmFile, MAGIC_FIND_DATA* data);
+HM_EMITTER MP_Record_LoadEmitter(HM_FILE hmFile, const char* name);
+bool MP_Record_HasTextures(HM_FILE hmFile);
+int MP_Record_GetNextAtlasChange(MAGIC_CHANGE_ATLAS* change);
+int MP_Record_GetMaterialCount();
+int MP_Record_GetMaterial(int index, MAGIC_MATERIAL* material);
+const char* MP_Record_GetEmitterName(HM_EMITTER hmEmitter);
+HM_EMITTER MP_Record_DuplicateEmitter(HM_EMITTER hmEmitter);
+bool MP_Record_IsInterval1(HM_EMITTER hmEmitter);
+MAGIC_LOOP_ENUM MP_Record_GetLoopMode(HM_EMITTER hmEmitter);
+bool MP_Record_GetEmitterPositionMode(HM_EMITTER hmEmitter);
+double MP_Record_GetPosition(HM_EMITTER hmEmitter);
+int MP_Record_GetEmitterPosition(HM_EMITTER hmEmitter, MAGIC_POSITION* pos);
+MAGIC_SORT_ENUM MP_Record_GetSortingMode(HM_EMITTER hmEmitter);
+int MP_Record_GetNextEvent(MAGIC_EVENT* evt);
+HM_OBSTACLE MP_Record_CreateObstacle(MAGIC_OBSTACLE* data, MAGIC_POSITION* position, int cell);
+int MP_Record_GetEmitterCount(HM_EMITTER hmEmitter);
+int MP_Record_GetParticlesTypeCount(HM_EMITTER hmEmitter);
+int MP_Record_GetOrientation(MAGIC_ORIENTATION* orientation);
+
+// route wrapper calls to the recorder, except in the recorder itself
+#ifndef MP_TRACE_RECORDER
+    #define Magic_Update MP_Record_Update
+    #define Magic_GetBBox MP_Record_GetBBox
+    #define Magic_PrepareRenderArrays MP_Record_PrepareRenderArrays
+    #define Magic_GetRenderArrayData MP_Record_GetRenderArrayData
+    #define Magic_SetRenderArrayData MP_Record_SetRenderArrayData
+    #define Magic_FillRenderArrays MP_Record_FillRenderArrays
+    #define Magic_GetVertices MP_Record_GetVertices
+    #define Magic_GetNextRenderState MP_Record_GetNextRenderState
+    #define Magic_OpenFileInMemory MP_Record_OpenFileInMemory
+    #define Magic_FindFirst MP_Record_FindFirst
+    #define Magic_FindNext MP_Record_FindNext
+    #define Magic_LoadEmitter MP_Record_LoadEmitter
+    #define Magic_HasTextures MP_Record_HasTextures
+    #define Magic_GetNextAtlasChange MP_Record_GetNextAtlasChange
+    #define Magic_GetMaterialCount MP_Record_GetMaterialCount
+    #define Magic_GetMaterial MP_Record_GetMaterial
+    #define Magic_GetEmitterName MP_Record_GetEmitterName
+    #define Magic_DuplicateEmitter MP_Record_DuplicateEmitter
+    #define Magic_IsInterval1 MP_Record_IsInterval1
+    #define Magic_GetLoopMode MP_Record_GetLoopMode
+    #define Magic_GetEmitterPositionMode MP_Record_GetEmitterPositionMode
+    #define Magic_GetPosition MP_Record_GetPosition
+    #define Magic_GetEmitterPosition MP_Record_GetEmitterPosition
+    #define Magic_GetSortingMode MP_Record_GetSortingMode
+    #define Magic_GetNextEvent MP_Record_GetNextEvent
+    #define Magic_CreateObstacle MP_Record_CreateObstacle
+    #define Magic_GetEmitterCount MP_Record_GetEmitterCount
+    #define Magic_GetParticlesTypeCount MP_Record_GetParticlesTypeCount
+    #define Magic_GetOrientation MP_Record_GetOrientation
+#endif
+
+#endif
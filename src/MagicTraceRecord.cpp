@@ -0,0 +1,519 @@
+#ifdef MAGIC_RECORD_WRAP
+
+#define MP_TRACE_RECORDER
+#include "MagicTrace.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+/// Render arrays set by the wrapper for a rendering context.
+struct MP_RECORD_CONTEXT
+{
+    HM_EMITTER emitter;
+    void* buffer[2];
+    int offset[2];
+    int stride[2];
+    int length[2];
+};
+
+/// Size of pending records flushed to file.
+static const unsigned MP_TRACE_FLUSH_SIZE = 4 * 1024 * 1024;
+
+/// Trace file.
+static SharedPtr<File> traceFile;
+/// Pending records.
+static PODVector<unsigned char> traceBuffer;
+/// Rendering contexts, by pointer returned from Magic_PrepareRenderArrays.
+static HashMap<void*, MP_RECORD_CONTEXT> traceContexts;
+/// Records may come from worker threads.
+static Mutex traceMutex;
+
+//----------------------------------------------------------------------------------------------------
+
+/// Append raw bytes to pending records.
+static void TraceWrite(const void* data, unsigned size)
+{
+    unsigned pos = traceBuffer.Size();
+    traceBuffer.Resize(pos + size);
+    if (size)
+        memcpy(&traceBuffer[pos], data, size);
+}
+
+template <class T> static void TraceWrite(const T& value)
+{
+    TraceWrite(&value, sizeof(T));
+}
+
+/// Append string, null strings are written with 0xffffffff length.
+static void TraceWriteString(const char* str)
+{
+    unsigned length = str ? (unsigned)strlen(str) : 0xffffffff;
+    TraceWrite(length);
+    if (str)
+        TraceWrite(str, length + 1);
+}
+
+/// Start a record : call, handle and payload size patched by TraceEnd.
+static unsigned TraceBegin(MP_TRACE_CALL call, int handle)
+{
+    TraceWrite((unsigned char)call);
+    TraceWrite(handle);
+    TraceWrite((unsigned)0);
+    return traceBuffer.Size();
+}
+
+/// End a record started at payload position.
+static void TraceEnd(unsigned payload)
+{
+    unsigned size = traceBuffer.Size() - payload;
+    memcpy(&traceBuffer[payload - sizeof(unsigned)], &size, sizeof(unsigned));
+
+    if (traceBuffer.Size() >= MP_TRACE_FLUSH_SIZE && traceFile)
+    {
+        traceFile->Write(&traceBuffer[0], traceBuffer.Size());
+        traceBuffer.Clear();
+    }
+}
+
+/// Write a record holding a single value.
+template <class T> static void TraceRecord(MP_TRACE_CALL call, int handle, const T& value)
+{
+    if (!traceFile)
+        return;
+
+    MutexLock lock(traceMutex);
+    unsigned payload = TraceBegin(call, handle);
+    TraceWrite(value);
+    TraceEnd(payload);
+}
+
+/// Return emitter of a rendering context.
+static HM_EMITTER TraceContextEmitter(void* context)
+{
+    HashMap<void*, MP_RECORD_CONTEXT>::Iterator it = traceContexts.Find(context);
+    return it != traceContexts.End() ? it->second_.emitter : 0;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+bool MagicTraceOpen(Context* context, const String& fileName)
+{
+    MagicTraceClose();
+
+    traceFile = new File(context, fileName, FILE_WRITE);
+    if (!traceFile->IsOpen())
+    {
+        URHO3D_LOGERROR("Could not open trace file " + fileName);
+        traceFile.Reset();
+        return false;
+    }
+
+    traceFile->WriteFileID(MP_TRACE_FILE_ID);
+    traceFile->WriteUInt(MP_TRACE_FILE_VERSION);
+
+    URHO3D_LOGINFO("Recording Magic trace to " + fileName);
+    return true;
+}
+
+void MagicTraceClose()
+{
+    MutexLock lock(traceMutex);
+
+    if (traceFile && traceBuffer.Size())
+        traceFile->Write(&traceBuffer[0], traceBuffer.Size());
+
+    traceBuffer.Clear();
+    traceContexts.Clear();
+    traceFile.Reset();
+}
+
+}
+
+using namespace Urho3D;
+
+//----------------------------------------------------------------------------------------------------
+// simulation
+//----------------------------------------------------------------------------------------------------
+
+bool MP_Record_Update(HM_EMITTER hmEmitter, double time)
+{
+    bool result = Magic_Update(hmEmitter, time);
+    TraceRecord(MP_TRACE_UPDATE, hmEmitter, result);
+    return result;
+}
+
+int MP_Record_GetBBox(HM_EMITTER hmEmitter, MAGIC_BBOX* bbox)
+{
+    int result = Magic_GetBBox(hmEmitter, bbox);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+        unsigned payload = TraceBegin(MP_TRACE_GETBBOX, hmEmitter);
+        TraceWrite(result);
+        TraceWrite(*bbox);
+        TraceEnd(payload);
+    }
+
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------
+// rendering
+//----------------------------------------------------------------------------------------------------
+
+void* MP_Record_PrepareRenderArrays(HM_EMITTER hmEmitter, MAGIC_RENDERING_START* start, int max_arrays_streams, MAGIC_ARGB_ENUM argb_format, bool index32)
+{
+    void* context = Magic_PrepareRenderArrays(hmEmitter, start, max_arrays_streams, argb_format, index32);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+
+        MP_RECORD_CONTEXT& ctx = traceContexts[context];
+        memset(&ctx, 0, sizeof(MP_RECORD_CONTEXT));
+        ctx.emitter = hmEmitter;
+
+        unsigned payload = TraceBegin(MP_TRACE_PREPARERENDERARRAYS, hmEmitter);
+        TraceWrite(*start);
+        TraceWrite((unsigned char)(context != 0));
+        TraceEnd(payload);
+    }
+
+    return context;
+}
+
+int MP_Record_GetRenderArrayData(void* context, int index, MAGIC_ARRAY_INFO* info)
+{
+    int result = Magic_GetRenderArrayData(context, index, info);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+
+        HM_EMITTER emitter = TraceContextEmitter(context);
+        if (index >= 0 && index < 2)
+            traceContexts[context].length[index] = info->length;
+
+        unsigned payload = TraceBegin(MP_TRACE_GETRENDERARRAYDATA, emitter);
+        TraceWrite(result);
+        TraceWrite(*info);
+        TraceEnd(payload);
+    }
+
+    return result;
+}
+
+int MP_Record_SetRenderArrayData(void* context, int index, void* buffer, int offset, int stride)
+{
+    if (traceFile && index >= 0 && index < 2)
+    {
+        MutexLock lock(traceMutex);
+
+        MP_RECORD_CONTEXT& ctx = traceContexts[context];
+        ctx.buffer[index] = buffer;
+        ctx.offset[index] = offset;
+        ctx.stride[index] = stride;
+    }
+
+    return Magic_SetRenderArrayData(context, index, buffer, offset, stride);
+}
+
+void MP_Record_FillRenderArrays(void* context)
+{
+    Magic_FillRenderArrays(context);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+
+        const MP_RECORD_CONTEXT& ctx = traceContexts[context];
+        unsigned payload = TraceBegin(MP_TRACE_FILLRENDERARRAYS, ctx.emitter);
+        for (unsigned i = 0; i < 2; ++i)
+        {
+            unsigned size = ctx.buffer[i] ? ctx.length[i] * ctx.stride[i] : 0;
+            TraceWrite(size);
+            TraceWrite((const char*)ctx.buffer[i] + ctx.offset[i], size);
+        }
+        TraceEnd(payload);
+    }
+}
+
+int MP_Record_GetVertices(void* context, MAGIC_RENDER_VERTICES* vrts)
+{
+    int result = Magic_GetVertices(context, vrts);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+        unsigned payload = TraceBegin(MP_TRACE_GETVERTICES, TraceContextEmitter(context));
+        TraceWrite(result);
+        TraceWrite(*vrts);
+        TraceEnd(payload);
+    }
+
+    return result;
+}
+
+int MP_Record_GetNextRenderState(void* context, MAGIC_RENDER_STATE* state)
+{
+    int result = Magic_GetNextRenderState(context, state);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+        unsigned payload = TraceBegin(MP_TRACE_GETNEXTRENDERSTATE, TraceContextEmitter(context));
+        TraceWrite(result);
+        TraceWrite(*state);
+        TraceEnd(payload);
+    }
+
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------
+// loading
+//----------------------------------------------------------------------------------------------------
+
+HM_FILE MP_Record_OpenFileInMemory(const char* buffer)
+{
+    HM_FILE result = Magic_OpenFileInMemory(buffer);
+    TraceRecord(MP_TRACE_OPENFILEINMEMORY, 0, result);
+    return result;
+}
+
+/// Record found name and find data.
+static void TraceFind(MP_TRACE_CALL call, HM_FILE hmFile, const char* name, const MAGIC_FIND_DATA* data)
+{
+    if (!traceFile)
+        return;
+
+    MutexLock lock(traceMutex);
+    unsigned payload = TraceBegin(call, hmFile);
+    TraceWriteString(name);
+    TraceWrite(data->type);
+    TraceWrite(data->animate);
+    TraceEnd(payload);
+}
+
+const char* MP_Record_FindFirst(HM_FILE hmFile, MAGIC_FIND_DATA* data, int mode)
+{
+    const char* name = Magic_FindFirst(hmFile, data, mode);
+    TraceFind(MP_TRACE_FINDFIRST, hmFile, name, data);
+    return name;
+}
+
+const char* MP_Record_FindNext(HM_FILE hmFile, MAGIC_FIND_DATA* data)
+{
+    const char* name = Magic_FindNext(hmFile, data);
+    TraceFind(MP_TRACE_FINDNEXT, hmFile, name, data);
+    return name;
+}
+
+HM_EMITTER MP_Record_LoadEmitter(HM_FILE hmFile, const char* name)
+{
+    HM_EMITTER result = Magic_LoadEmitter(hmFile, name);
+    TraceRecord(MP_TRACE_LOADEMITTER, hmFile, result);
+    return result;
+}
+
+bool MP_Record_HasTextures(HM_FILE hmFile)
+{
+    bool result = Magic_HasTextures(hmFile);
+    TraceRecord(MP_TRACE_HASTEXTURES, hmFile, result);
+    return result;
+}
+
+int MP_Record_GetNextAtlasChange(MAGIC_CHANGE_ATLAS* change)
+{
+    int result = Magic_GetNextAtlasChange(change);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+        unsigned payload = TraceBegin(MP_TRACE_GETNEXTATLASCHANGE, 0);
+        TraceWrite(result);
+        if (result == MAGIC_SUCCESS)
+        {
+            TraceWrite(change->type);
+            TraceWrite(change->index);
+            TraceWrite(change->emitter);
+            TraceWrite(change->x);
+            TraceWrite(change->y);
+            TraceWrite(change->width);
+            TraceWrite(change->height);
+            TraceWrite(change->ptc_id);
+            TraceWriteString(change->file);
+            TraceWriteString(change->path);
+
+            unsigned length = change->data ? change->length : 0;
+            TraceWrite(length);
+            TraceWrite(change->data, length);
+        }
+        TraceEnd(payload);
+    }
+
+    return result;
+}
+
+int MP_Record_GetMaterialCount()
+{
+    int result = Magic_GetMaterialCount();
+    TraceRecord(MP_TRACE_GETMATERIALCOUNT, 0, result);
+    return result;
+}
+
+int MP_Record_GetMaterial(int index, MAGIC_MATERIAL* material)
+{
+    int result = Magic_GetMaterial(index, material);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+        unsigned payload = TraceBegin(MP_TRACE_GETMATERIAL, index);
+        TraceWrite(result);
+        TraceWrite(material->blending);
+        TraceWrite(material->textures);
+        TraceWrite(material->flags);
+        TraceWrite(material->format);
+        for (int i = 0; i < material->textures; ++i)
+            TraceWrite(material->states[i]);
+        TraceEnd(payload);
+    }
+
+    return result;
+}
+
+const char* MP_Record_GetEmitterName(HM_EMITTER hmEmitter)
+{
+    const char* name = Magic_GetEmitterName(hmEmitter);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+        unsigned payload = TraceBegin(MP_TRACE_GETEMITTERNAME, hmEmitter);
+        TraceWriteString(name);
+        TraceEnd(payload);
+    }
+
+    return name;
+}
+
+//----------------------------------------------------------------------------------------------------
+// emitter state
+//----------------------------------------------------------------------------------------------------
+
+HM_EMITTER MP_Record_DuplicateEmitter(HM_EMITTER hmEmitter)
+{
+    HM_EMITTER result = Magic_DuplicateEmitter(hmEmitter);
+    TraceRecord(MP_TRACE_DUPLICATEEMITTER, hmEmitter, result);
+    return result;
+}
+
+bool MP_Record_IsInterval1(HM_EMITTER hmEmitter)
+{
+    bool result = Magic_IsInterval1(hmEmitter);
+    TraceRecord(MP_TRACE_ISINTERVAL1, hmEmitter, result);
+    return result;
+}
+
+MAGIC_LOOP_ENUM MP_Record_GetLoopMode(HM_EMITTER hmEmitter)
+{
+    MAGIC_LOOP_ENUM result = Magic_GetLoopMode(hmEmitter);
+    TraceRecord(MP_TRACE_GETLOOPMODE, hmEmitter, result);
+    return result;
+}
+
+bool MP_Record_GetEmitterPositionMode(HM_EMITTER hmEmitter)
+{
+    bool result = Magic_GetEmitterPositionMode(hmEmitter);
+    TraceRecord(MP_TRACE_GETEMITTERPOSITIONMODE, hmEmitter, result);
+    return result;
+}
+
+double MP_Record_GetPosition(HM_EMITTER hmEmitter)
+{
+    double result = Magic_GetPosition(hmEmitter);
+    TraceRecord(MP_TRACE_GETPOSITION, hmEmitter, result);
+    return result;
+}
+
+int MP_Record_GetEmitterPosition(HM_EMITTER hmEmitter, MAGIC_POSITION* pos)
+{
+    int result = Magic_GetEmitterPosition(hmEmitter, pos);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+        unsigned payload = TraceBegin(MP_TRACE_GETEMITTERPOSITION, hmEmitter);
+        TraceWrite(result);
+        TraceWrite(*pos);
+        TraceEnd(payload);
+    }
+
+    return result;
+}
+
+MAGIC_SORT_ENUM MP_Record_GetSortingMode(HM_EMITTER hmEmitter)
+{
+    MAGIC_SORT_ENUM result = Magic_GetSortingMode(hmEmitter);
+    TraceRecord(MP_TRACE_GETSORTINGMODE, hmEmitter, result);
+    return result;
+}
+
+int MP_Record_GetNextEvent(MAGIC_EVENT* evt)
+{
+    int result = Magic_GetNextEvent(evt);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+        unsigned payload = TraceBegin(MP_TRACE_GETNEXTEVENT, 0);
+        TraceWrite(result);
+        if (result == MAGIC_SUCCESS)
+            TraceWrite(*evt);
+        TraceEnd(payload);
+    }
+
+    return result;
+}
+
+HM_OBSTACLE MP_Record_CreateObstacle(MAGIC_OBSTACLE* data, MAGIC_POSITION* position, int cell)
+{
+    HM_OBSTACLE result = Magic_CreateObstacle(data, position, cell);
+    TraceRecord(MP_TRACE_CREATEOBSTACLE, 0, result);
+    return result;
+}
+
+int MP_Record_GetEmitterCount(HM_EMITTER hmEmitter)
+{
+    int result = Magic_GetEmitterCount(hmEmitter);
+    TraceRecord(MP_TRACE_GETEMITTERCOUNT, hmEmitter, result);
+    return result;
+}
+
+int MP_Record_GetParticlesTypeCount(HM_EMITTER hmEmitter)
+{
+    int result = Magic_GetParticlesTypeCount(hmEmitter);
+    TraceRecord(MP_TRACE_GETPARTICLESTYPECOUNT, hmEmitter, result);
+    return result;
+}
+
+int MP_Record_GetOrientation(MAGIC_ORIENTATION* orientation)
+{
+    int result = Magic_GetOrientation(orientation);
+
+    if (traceFile)
+    {
+        MutexLock lock(traceMutex);
+        unsigned payload = TraceBegin(MP_TRACE_GETORIENTATION, 0);
+        TraceWrite(result);
+        TraceWrite(orientation->orientation);
+        TraceEnd(payload);
+    }
+
+    return result;
+}
+
+#endif
@@ -0,0 +1,494 @@
+#ifdef MAGIC_REPLAY_WRAP
+
+#include "MagicTrace.h"
+#include <Urho3D/Urho3DAll.h>
+
+namespace Urho3D
+{
+
+/// Recorded payloads of one call for one handle.
+struct MP_REPLAY_QUEUE
+{
+    PODVector<unsigned> payloads;
+    unsigned next;
+};
+
+/// Render arrays set by the wrapper, returned as rendering context.
+struct MP_REPLAY_CONTEXT
+{
+    HM_EMITTER emitter;
+    void* buffer[2];
+    int offset[2];
+};
+
+/// Reader over a recorded payload. Reading past the end or from an empty queue returns zeros.
+struct MP_REPLAY_READER
+{
+    const unsigned char* ptr;
+    const unsigned char* end;
+
+    MP_REPLAY_READER() : ptr(0), end(0) {}
+
+    template <class T> T Read()
+    {
+        T value;
+        memset(&value, 0, sizeof(T));
+        if (ptr && ptr + sizeof(T) <= end)
+        {
+            memcpy(&value, ptr, sizeof(T));
+            ptr += sizeof(T);
+        }
+        return value;
+    }
+
+    const char* ReadString()
+    {
+        unsigned length = Read<unsigned>();
+        if (!ptr || length == 0xffffffff || ptr + length + 1 > end)
+            return 0;
+
+        const char* str = (const char*)ptr;
+        ptr += length + 1;
+        return str;
+    }
+
+    const unsigned char* ReadBytes(unsigned size)
+    {
+        if (!ptr || ptr + size > end)
+            return 0;
+
+        const unsigned char* data = ptr;
+        ptr += size;
+        return data;
+    }
+};
+
+/// Whole trace file content, records point into it.
+static PODVector<unsigned char> replayData;
+/// Payload queues, by call and handle.
+static HashMap<unsigned long long, MP_REPLAY_QUEUE> replayQueues;
+/// Rendering contexts, by emitter.
+static HashMap<HM_EMITTER, MP_REPLAY_CONTEXT> replayContexts;
+/// Texture states of replayed materials.
+static Vector<PODVector<MAGIC_TEXTURE_STATES> > replayStates;
+/// Replay may be called from worker threads.
+static Mutex replayMutex;
+
+//----------------------------------------------------------------------------------------------------
+
+static unsigned long long ReplayKey(MP_TRACE_CALL call, int handle)
+{
+    return ((unsigned long long)call << 32) | (unsigned)handle;
+}
+
+/// Return reader on next recorded payload of call for handle.
+static MP_REPLAY_READER ReplayNext(MP_TRACE_CALL call, int handle)
+{
+    MutexLock lock(replayMutex);
+
+    MP_REPLAY_READER reader;
+    HashMap<unsigned long long, MP_REPLAY_QUEUE>::Iterator it = replayQueues.Find(ReplayKey(call, handle));
+    if (it == replayQueues.End() || it->second_.next >= it->second_.payloads.Size())
+        return reader;
+
+    unsigned payload = it->second_.payloads[it->second_.next++];
+    unsigned size;
+    memcpy(&size, &replayData[payload - sizeof(unsigned)], sizeof(unsigned));
+
+    reader.ptr = &replayData[payload];
+    reader.end = reader.ptr + size;
+    return reader;
+}
+
+/// Return emitter of a rendering context.
+static HM_EMITTER ReplayContextEmitter(void* context)
+{
+    return context ? ((MP_REPLAY_CONTEXT*)context)->emitter : 0;
+}
+
+//----------------------------------------------------------------------------------------------------
+
+bool MagicTraceOpen(Context* context, const String& fileName)
+{
+    MagicTraceClose();
+
+    File file(context, fileName, FILE_READ);
+    if (!file.IsOpen() || file.ReadFileID() != MP_TRACE_FILE_ID || file.ReadUInt() != MP_TRACE_FILE_VERSION)
+    {
+        URHO3D_LOGERROR("Could not open trace file " + fileName);
+        return false;
+    }
+
+    unsigned size = file.GetSize() - file.GetPosition();
+    replayData.Resize(size);
+    if (size && file.Read(&replayData[0], size) != size)
+    {
+        URHO3D_LOGERROR("Could not read trace file " + fileName);
+        replayData.Clear();
+        return false;
+    }
+
+    // index records : call (1 byte), handle (4 bytes), payload size (4 bytes), payload
+    const unsigned headerSize = 1 + sizeof(int) + sizeof(unsigned);
+    unsigned pos = 0;
+    unsigned numRecords = 0;
+    while (pos + headerSize <= size)
+    {
+        unsigned char call = replayData[pos];
+        int handle;
+        unsigned payloadSize;
+        memcpy(&handle, &replayData[pos + 1], sizeof(int));
+        memcpy(&payloadSize, &replayData[pos + 1 + sizeof(int)], sizeof(unsigned));
+
+        unsigned payload = pos + headerSize;
+        if (call >= MP_TRACE_CALL_MAX || payload + payloadSize > size)
+        {
+            URHO3D_LOGERROR("Corrupted trace file " + fileName);
+            break;
+        }
+
+        MP_REPLAY_QUEUE& queue = replayQueues[ReplayKey((MP_TRACE_CALL)call, handle)];
+        queue.payloads.Push(payload);
+        queue.next = 0;
+
+        pos = payload + payloadSize;
+        ++numRecords;
+    }
+
+    URHO3D_LOGINFO("Replaying Magic trace " + fileName + " (" + String(numRecords) + " records)");
+    return true;
+}
+
+void MagicTraceClose()
+{
+    MutexLock lock(replayMutex);
+
+    replayQueues.Clear();
+    replayContexts.Clear();
+    replayStates.Clear();
+    replayData.Clear();
+}
+
+}
+
+using namespace Urho3D;
+
+//----------------------------------------------------------------------------------------------------
+// simulation
+//----------------------------------------------------------------------------------------------------
+
+bool Magic_Update(HM_EMITTER hmEmitter, double time)
+{
+    return ReplayNext(MP_TRACE_UPDATE, hmEmitter).Read<bool>();
+}
+
+int Magic_GetBBox(HM_EMITTER hmEmitter, MAGIC_BBOX* bbox)
+{
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_GETBBOX, hmEmitter);
+    int result = reader.Read<int>();
+    *bbox = reader.Read<MAGIC_BBOX>();
+    return result;
+}
+
+//----------------------------------------------------------------------------------------------------
+// rendering
+//----------------------------------------------------------------------------------------------------
+
+void* Magic_PrepareRenderArrays(HM_EMITTER hmEmitter, MAGIC_RENDERING_START* start, int max_arrays_streams, MAGIC_ARGB_ENUM argb_format, bool index32)
+{
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_PREPARERENDERARRAYS, hmEmitter);
+    *start = reader.Read<MAGIC_RENDERING_START>();
+    if (!reader.Read<unsigned char>())
+        return 0;
+
+    MutexLock lock(replayMutex);
+    MP_REPLAY_CONTEXT& context = replayContexts[hmEmitter];
+    memset(&context, 0, sizeof(MP_REPLAY_CONTEXT));
+    context.emitter = hmEmitter;
+    return &context;
+}
+
+int Magic_GetRenderArrayData(void* context, int index, MAGIC_ARRAY_INFO* info)
+{
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_GETRENDERARRAYDATA, ReplayContextEmitter(context));
+    int result = reader.Read<int>();
+    *info = reader.Read<MAGIC_ARRAY_INFO>();
+    return result;
+}
+
+int Magic_SetRenderArrayData(void* context, int index, void* buffer, int offset, int stride)
+{
+    if (!context || index < 0 || index >= 2)
+        return MAGIC_ERROR;
+
+    MP_REPLAY_CONTEXT* ctx = (MP_REPLAY_CONTEXT*)context;
+    ctx->buffer[index] = buffer;
+    ctx->offset[index] = offset;
+    return MAGIC_SUCCESS;
+}
+
+void Magic_FillRenderArrays(void* context)
+{
+    if (!context)
+        return;
+
+    MP_REPLAY_CONTEXT* ctx = (MP_REPLAY_CONTEXT*)context;
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_FILLRENDERARRAYS, ctx->emitter);
+    for (unsigned i = 0; i < 2; ++i)
+    {
+        unsigned size = reader.Read<unsigned>();
+        const unsigned char* data = reader.ReadBytes(size);
+        if (data && ctx->buffer[i])
+            memcpy((char*)ctx->buffer[i] + ctx->offset[i], data, size);
+    }
+}
+
+int Magic_GetVertices(void* context, MAGIC_RENDER_VERTICES* vrts)
+{
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_GETVERTICES, ReplayContextEmitter(context));
+    int result = reader.Read<int>();
+    *vrts = reader.Read<MAGIC_RENDER_VERTICES>();
+    return reader.ptr ? result : MAGIC_ERROR;
+}
+
+int Magic_GetNextRenderState(void* context, MAGIC_RENDER_STATE* state)
+{
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_GETNEXTRENDERSTATE, ReplayContextEmitter(context));
+    int result = reader.Read<int>();
+    *state = reader.Read<MAGIC_RENDER_STATE>();
+    return reader.ptr ? result : MAGIC_ERROR;
+}
+
+//----------------------------------------------------------------------------------------------------
+// loading
+//----------------------------------------------------------------------------------------------------
+
+HM_FILE Magic_OpenFileInMemory(const char* buffer)
+{
+    return ReplayNext(MP_TRACE_OPENFILEINMEMORY, 0).Read<HM_FILE>();
+}
+
+int Magic_CloseFile(HM_FILE hmFile)
+{
+    return MAGIC_SUCCESS;
+}
+
+int Magic_SetCurrentFolder(HM_FILE hmFile, const char* path)
+{
+    return MAGIC_SUCCESS;
+}
+
+/// Replay found name and find data.
+static const char* ReplayFind(MP_TRACE_CALL call, HM_FILE hmFile, MAGIC_FIND_DATA* data)
+{
+    MP_REPLAY_READER reader = ReplayNext(call, hmFile);
+    const char* name = reader.ReadString();
+    data->type = reader.Read<int>();
+    data->animate = reader.Read<int>();
+    data->name = name;
+    return name;
+}
+
+const char* Magic_FindFirst(HM_FILE hmFile, MAGIC_FIND_DATA* data, int mode)
+{
+    return ReplayFind(MP_TRACE_FINDFIRST, hmFile, data);
+}
+
+const char* Magic_FindNext(HM_FILE hmFile, MAGIC_FIND_DATA* data)
+{
+    return ReplayFind(MP_TRACE_FINDNEXT, hmFile, data);
+}
+
+HM_EMITTER Magic_LoadEmitter(HM_FILE hmFile, const char* name)
+{
+    return ReplayNext(MP_TRACE_LOADEMITTER, hmFile).Read<HM_EMITTER>();
+}
+
+bool Magic_HasTextures(HM_FILE hmFile)
+{
+    return ReplayNext(MP_TRACE_HASTEXTURES, hmFile).Read<bool>();
+}
+
+float Magic_CreateAtlasesForEmitters(int width, int height, int count, HM_EMITTER* emitters, int step, float scale_step)
+{
+    return 1.0f;
+}
+
+void Magic_SetStartingScaleForAtlas(float scale)
+{
+}
+
+int Magic_GetNextAtlasChange(MAGIC_CHANGE_ATLAS* change)
+{
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_GETNEXTATLASCHANGE, 0);
+    int result = reader.ptr ? reader.Read<int>() : MAGIC_ERROR;
+    if (result == MAGIC_SUCCESS)
+    {
+        change->type = reader.Read<MAGIC_CHANGE_ATLAS_ENUM>();
+        change->index = reader.Read<int>();
+        change->emitter = reader.Read<HM_EMITTER>();
+        change->x = reader.Read<int>();
+        change->y = reader.Read<int>();
+        change->width = reader.Read<int>();
+        change->height = reader.Read<int>();
+        change->ptc_id = reader.Read<unsigned>();
+        change->file = reader.ReadString();
+        change->path = reader.ReadString();
+        change->length = reader.Read<unsigned>();
+        change->data = change->length ? (const char*)reader.ReadBytes(change->length) : 0;
+    }
+    return result;
+}
+
+int Magic_GetNextEvent(MAGIC_EVENT* evt)
+{
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_GETNEXTEVENT, 0);
+    int result = reader.ptr ? reader.Read<int>() : MAGIC_ERROR;
+    if (result == MAGIC_SUCCESS)
+        *evt = reader.Read<MAGIC_EVENT>();
+    return result;
+}
+
+HM_OBSTACLE Magic_CreateObstacle(MAGIC_OBSTACLE* data, MAGIC_POSITION* position, int cell)
+{
+    return ReplayNext(MP_TRACE_CREATEOBSTACLE, 0).Read<HM_OBSTACLE>();
+}
+
+int Magic_GetEmitterCount(HM_EMITTER hmEmitter)
+{
+    return ReplayNext(MP_TRACE_GETEMITTERCOUNT, hmEmitter).Read<int>();
+}
+
+int Magic_GetParticlesTypeCount(HM_EMITTER hmEmitter)
+{
+    return ReplayNext(MP_TRACE_GETPARTICLESTYPECOUNT, hmEmitter).Read<int>();
+}
+
+int Magic_GetOrientation(MAGIC_ORIENTATION* orientation)
+{
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_GETORIENTATION, 0);
+    int result = reader.Read<int>();
+    orientation->orientation = reader.Read<MAGIC_ORIENTATION_ENUM>();
+    return result;
+}
+
+void Magic_SetRenderStateFilter(bool* filters, bool optimization)
+{
+}
+
+int Magic_GetMaterialCount()
+{
+    return ReplayNext(MP_TRACE_GETMATERIALCOUNT, 0).Read<int>();
+}
+
+int Magic_GetMaterial(int index, MAGIC_MATERIAL* material)
+{
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_GETMATERIAL, index);
+    int result = reader.Read<int>();
+    material->blending = reader.Read<int>();
+    material->textures = reader.Read<int>();
+    material->flags = reader.Read<int>();
+    material->format = reader.Read<MAGIC_VERTEX_FORMAT>();
+
+    MutexLock lock(replayMutex);
+    replayStates.Resize(replayStates.Size() + 1);
+    PODVector<MAGIC_TEXTURE_STATES>& states = replayStates.Back();
+    states.Resize(Max(material->textures, 0));
+    for (unsigned i = 0; i < states.Size(); ++i)
+        states[i] = reader.Read<MAGIC_TEXTURE_STATES>();
+    material->states = states.Size() ? &states[0] : 0;
+
+    return result;
+}
+
+const char* Magic_GetEmitterName(HM_EMITTER hmEmitter)
+{
+    const char* name = ReplayNext(MP_TRACE_GETEMITTERNAME, hmEmitter).ReadString();
+    return name ? name : "";
+}
+
+//----------------------------------------------------------------------------------------------------
+// emitter state
+//----------------------------------------------------------------------------------------------------
+
+HM_EMITTER Magic_DuplicateEmitter(HM_EMITTER hmEmitter)
+{
+    return ReplayNext(MP_TRACE_DUPLICATEEMITTER, hmEmitter).Read<HM_EMITTER>();
+}
+
+int Magic_UnloadEmitter(HM_EMITTER hmEmitter)
+{
+    MutexLock lock(replayMutex);
+    replayContexts.Erase(hmEmitter);
+    return MAGIC_SUCCESS;
+}
+
+bool Magic_IsInterval1(HM_EMITTER hmEmitter)
+{
+    return ReplayNext(MP_TRACE_ISINTERVAL1, hmEmitter).Read<bool>();
+}
+
+MAGIC_LOOP_ENUM Magic_GetLoopMode(HM_EMITTER hmEmitter)
+{
+    return ReplayNext(MP_TRACE_GETLOOPMODE, hmEmitter).Read<MAGIC_LOOP_ENUM>();
+}
+
+bool Magic_GetEmitterPositionMode(HM_EMITTER hmEmitter)
+{
+    return ReplayNext(MP_TRACE_GETEMITTERPOSITIONMODE, hmEmitter).Read<bool>();
+}
+
+double Magic_GetPosition(HM_EMITTER hmEmitter)
+{
+    return ReplayNext(MP_TRACE_GETPOSITION, hmEmitter).Read<double>();
+}
+
+int Magic_GetEmitterPosition(HM_EMITTER hmEmitter, MAGIC_POSITION* pos)
+{
+    MP_REPLAY_READER reader = ReplayNext(MP_TRACE_GETEMITTERPOSITION, hmEmitter);
+    int result = reader.Read<int>();
+    *pos = reader.Read<MAGIC_POSITION>();
+    return result;
+}
+
+MAGIC_SORT_ENUM Magic_GetSortingMode(HM_EMITTER hmEmitter)
+{
+    return ReplayNext(MP_TRACE_GETSORTINGMODE, hmEmitter).Read<MAGIC_SORT_ENUM>();
+}
+
+// inputs only, nothing to replay
+
+int Magic_SetAxis(MAGIC_AXIS_ENUM axis_index) { return MAGIC_SUCCESS; }
+int Magic_SetCamera(MAGIC_CAMERA* camera) { return MAGIC_SUCCESS; }
+int Magic_Stop(HM_EMITTER hmEmitter) { return MAGIC_SUCCESS; }
+int Magic_Restart(HM_EMITTER hmEmitter) { return MAGIC_SUCCESS; }
+int Magic_SetInterrupt(HM_EMITTER hmEmitter, bool interrupt) { return MAGIC_SUCCESS; }
+int Magic_SetPosition(HM_EMITTER hmEmitter, double position) { return MAGIC_SUCCESS; }
+int Magic_EmitterToInterval1(HM_EMITTER hmEmitter, float speed_factor, const char* file) { return MAGIC_SUCCESS; }
+int Magic_SetInterpolationMode(HM_EMITTER hmEmitter, bool mode) { return MAGIC_SUCCESS; }
+int Magic_SetRandomMode(HM_EMITTER hmEmitter, bool mode) { return MAGIC_SUCCESS; }
+int Magic_SetLoopMode(HM_EMITTER hmEmitter, MAGIC_LOOP_ENUM mode) { return MAGIC_SUCCESS; }
+int Magic_SetScale(HM_EMITTER hmEmitter, float scale) { return MAGIC_SUCCESS; }
+int Magic_SetEmitterPosition(HM_EMITTER hmEmitter, MAGIC_POSITION* pos) { return MAGIC_SUCCESS; }
+int Magic_SetEmitterPositionMode(HM_EMITTER hmEmitter, bool mode) { return MAGIC_SUCCESS; }
+int Magic_SetEmitterDirection(HM_EMITTER hmEmitter, MAGIC_DIRECTION* direction) { return MAGIC_SUCCESS; }
+int Magic_SetEmitterDirectionMode(HM_EMITTER hmEmitter, bool mode) { return MAGIC_SUCCESS; }
+int Magic_SetBBoxPeriod(HM_EMITTER hmEmitter, int period) { return MAGIC_SUCCESS; }
+int Magic_SetSortingMode(HM_EMITTER hmEmitter, MAGIC_SORT_ENUM mode) { return MAGIC_SUCCESS; }
+int Magic_SetObstacleData(HM_OBSTACLE hmObstacle, MAGIC_OBSTACLE* data, int cell) { return MAGIC_SUCCESS; }
+int Magic_DestroyPhysicObject(MAGIC_PHYSIC_TYPE_ENUM type, int HM) { return MAGIC_SUCCESS; }
+int Magic_LockParticlesType(HM_EMITTER hmEmitter, int index) { return MAGIC_SUCCESS; }
+int Magic_UnlockParticlesType() { return MAGIC_SUCCESS; }
+
+// snapshots are not replayed
+
+int Magic_StreamOpenMemory(const char* address, unsigned int length, MAGIC_STREAM_ENUM mode) { return MAGIC_ERROR; }
+int Magic_StreamClose(HM_STREAM hmStream) { return MAGIC_ERROR; }
+unsigned int Magic_StreamGetLength(HM_STREAM hmStream) { return 0; }
+int Magic_StreamSetPosition(HM_STREAM hmStream, unsigned int position) { return MAGIC_ERROR; }
+int Magic_StreamSetMode(HM_STREAM hmStream, MAGIC_STREAM_ENUM mode) { return MAGIC_ERROR; }
+int Magic_StreamRead(HM_STREAM hmStream, char* data, unsigned int count) { return MAGIC_ERROR; }
+int Magic_SaveArrayToStream(HM_EMITTER hmEmitter, HM_STREAM hmStream) { return MAGIC_ERROR; }
+int Magic_LoadArrayFromStream(HM_EMITTER hmEmitter, HM_STREAM hmStream) { return MAGIC_ERROR; }
+
+#endif
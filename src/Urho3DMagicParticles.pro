@@ -76,6 +76,11 @@ CONFIG(debug,debug|release) {
         _WINDOWS
 }
 
+# record Magic outputs to a trace file (qmake CONFIG+=magic_record)
+magic_record: DEFINES += MAGIC_RECORD_WRAP
+# replace Magic library by a trace replay, no Magic binaries needed (qmake CONFIG+=magic_replay)
+magic_replay: DEFINES += MAGIC_REPLAY_WRAP
+
 
 #--------------------------------------------------------------------
 # libraries includes
@@ -93,10 +98,10 @@ LIBS += -L$${URHO3D}/lib
 LIBS += -L$${DESTDIR}
 win32: LIBS += -L$${MAGIC_PARTICLES}
 
-unix:!macx:: LIBS += -lmagic3d
+unix:!macx:!magic_replay: LIBS += -lmagic3d
 unix:!macx:: LIBS += -lUrho3D
 
-win32: LIBS += -lmagic3d_x64
+win32:!magic_replay: LIBS += -lmagic3d_x64
 win32: CONFIG(debug,debug|release) {
     LIBS += -lUrho3D_d
 } else {
@@ -113,12 +118,41 @@ win32:LIBS += kernel32.lib user32.lib gdi32.lib comdlg32.lib advapi32.lib shell3
 #--------------------------------------------------------------------
 
 HEADERS += \
+    MagicEmitterInstance.h \
     MagicParticleEffect.h \
     MagicParticleEmitter.h \
+    MagicParticleSystem.h \
+    MagicParticleCluster.h \
+    MagicParticleMerge.h \
+    MagicParticleUtils.h \
+    MagicParticleEvents.h \
+    MagicParticleStats.h \
+    MagicParticleTimeline.h \
+    MagicParticleView.h \
+    MagicParticleSimulation.h \
+    MagicParticleArena.h \
+    MagicParticleInstancing.h \
+    MagicParticleEventStream.h \
+    MagicParticleObstacles.h \
+    MagicTrace.h \
     Magic.h
 
 
 SOURCES += \
+    MagicEmitterInstance.cpp \
     MagicParticleEffect.cpp \
     MagicParticleEmitter.cpp \
+    MagicParticleStats.cpp \
+    MagicParticleTimeline.cpp \
+    MagicParticleView.cpp \
+    MagicParticleSimulation.cpp \
+    MagicParticleArena.cpp \
+    MagicParticleInstancing.cpp \
+    MagicParticleEventStream.cpp \
+    MagicParticleObstacles.cpp \
+    MagicParticleSystem.cpp \
+    MagicParticleCluster.cpp \
+    MagicParticleMerge.cpp \
+    MagicTraceRecord.cpp \
+    MagicTraceReplay.cpp \
     main.cpp
@@ -0,0 +1,447 @@
+#include <Urho3D/Urho3DAll.h>
+#include "../MagicParticleEffect.h"
+#include "../MagicEmitterInstance.h"
+#include "../MagicParticleUtils.h"
+#include "../MagicParticleArena.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+/// Number of heap allocations since start, all threads.
+static std::atomic<unsigned long long> allocationCount(0);
+
+void* operator new(std::size_t size)
+{
+    ++allocationCount;
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    free(p);
+}
+
+namespace Urho3D
+{
+
+/// Result of a micro-benchmark.
+struct MP_BENCH_RESULT
+{
+    /// Benchmark name.
+    String name;
+    /// Operations run.
+    unsigned long long ops;
+    /// Nanoseconds per operation.
+    double nsPerOp;
+    /// Heap allocations per operation.
+    double allocsPerOp;
+};
+
+///-------------------------------------------------------------------------------------------------
+/// Micro-benchmarks of the wrapper data paths : material hash keys, material lookup, render states
+/// dispatch, buffers mapping and growth, shaders generation.
+/// Inputs are the materials of a loaded .ptc file, or synthetic materials and render states.
+///
+/// Usage : MagicBenchmark [ptc resource] [-synthetic] [-time <ms per benchmark>] [-output <file.csv>]
+/// Synthetic inputs need no Magic binaries or textures and can run with -headless.
+///-------------------------------------------------------------------------------------------------
+class MagicBenchmark : public Application
+{
+public:
+    MagicBenchmark(Context* context) :
+        Application(context)
+        , _fileName("MagicParticles/particles3d/3d_urho.ptc")
+        , _synthetic(false)
+        , _minTime(200000)
+        , _instance(0)
+        , _numTextures(0)
+        , _sink(0)
+    {
+    }
+
+    virtual void Setup()
+    {
+        engineParameters_["WindowTitle"] = "MagicBenchmark";
+        engineParameters_["FullScreen"] = false;
+        engineParameters_["WindowWidth"] = 320;
+        engineParameters_["WindowHeight"] = 240;
+
+        MagicParticleEffect::RegisterObject(context_);
+
+        const Vector<String>& args = GetArguments();
+        for (unsigned i = 0; i < args.Size(); ++i)
+        {
+            String arg = args[i].ToLower();
+            String value = i + 1 < args.Size() ? args[i + 1] : String::EMPTY;
+
+            if (arg == "-synthetic")
+                _synthetic = true;
+            else if (arg == "-time" && !value.Empty())
+            {
+                _minTime = Max(ToUInt(value), 1U) * 1000;
+                ++i;
+            }
+            else if (arg == "-output" && !value.Empty())
+            {
+                _outputFileName = value;
+                ++i;
+            }
+            else if (!arg.StartsWith("-"))
+                _fileName = args[i];
+        }
+    }
+
+    virtual void Start()
+    {
+        if (!_synthetic)
+            _effect = GetSubsystem<ResourceCache>()->GetResource<MagicParticleEffect>(_fileName);
+
+        if (!_effect || _effect->GetMagicMaterials().Empty())
+        {
+            if (!_synthetic)
+                URHO3D_LOGWARNING("Could not load materials from " + _fileName + ", using synthetic inputs");
+            CreateSyntheticEffect();
+        }
+
+        // render paths only, no emitter is duplicated for an invalid template index
+        _instance = new MagicEmitterInstance(_effect, -1);
+        _numTextures = _effect->GetNumTextures();
+
+        CreateStateStreams();
+
+        BenchHashKey();
+        BenchGetMaterial();
+        BenchRenderStates();
+        BenchMapBuffers();
+        BenchShaders();
+
+        WriteResults();
+
+        delete _instance;
+        _instance = 0;
+
+        engine_->Exit();
+    }
+
+private:
+    /// Run function until min time is elapsed and record time and allocations per operation.
+    template <class T> void Measure(const String& name, unsigned opsPerCall, T func)
+    {
+        // warm caches and lazily created objects
+        func();
+
+        unsigned long long calls = 0;
+        unsigned long long allocations = allocationCount;
+        HiresTimer timer;
+        long long elapsed;
+
+        do
+        {
+            for (unsigned i = 0; i < 16; ++i)
+                func();
+            calls += 16;
+            elapsed = timer.GetUSec(false);
+        }
+        while (elapsed < _minTime);
+
+        allocations = allocationCount - allocations;
+
+        MP_BENCH_RESULT result;
+        result.name = name;
+        result.ops = calls * opsPerCall;
+        result.nsPerOp = result.ops ? elapsed * 1000.0 / result.ops : 0.0;
+        result.allocsPerOp = result.ops ? (double)allocations / result.ops : 0.0;
+        _results.Push(result);
+    }
+
+    /// Create an effect holding synthetic materials and textures, as a loaded .ptc would.
+    void CreateSyntheticEffect()
+    {
+        _effect = new MagicParticleEffect(context_);
+        _effect->SetName("Synthetic");
+
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            SharedPtr<Texture2D> texture(new Texture2D(context_));
+            texture->SetName("MagicBenchmark/Atlas" + String(i));
+            _effect->AddTexture(texture);
+        }
+
+        // 1 to 3 texture stages, with and without color, all blendings
+        const unsigned numMaterials = 12;
+        _syntheticStates.Resize(numMaterials * 3);
+
+        for (unsigned i = 0; i < numMaterials; ++i)
+        {
+            MAGIC_MATERIAL mat;
+            mat.blending = i % 3;
+            mat.textures = 1 + i % 3;
+            mat.states = &_syntheticStates[i * 3];
+            mat.flags = (i & 1) ? MAGIC_MATERIAL_ZENABLE | MAGIC_MATERIAL_ZWRITE : MAGIC_MATERIAL_ZENABLE;
+            mat.format.attributes = (i & 2) ? MAGIC_ATTRIBUTE_COLOR : 0;
+            mat.format.UVs = mat.textures;
+
+            for (int j = 0; j < mat.textures; ++j)
+            {
+                MAGIC_TEXTURE_STATES& state = mat.states[j];
+                state.address_u = (i + j) % 4;
+                state.address_v = (i + j + 1) % 4;
+                state.operation_rgb = j ? (i + j) % 4 : 0;
+                state.argument_rgb1 = 0;
+                state.argument_rgb2 = 1;
+                state.operation_alpha = j ? (i + j + 1) % 4 : 0;
+                state.argument_alpha1 = 0;
+                state.argument_alpha2 = 1;
+            }
+
+            _effect->AddMaterial(mat);
+        }
+    }
+
+    /// Create the render states stream Magic would emit before drawing each material.
+    void CreateStateStreams()
+    {
+        const Vector<MAGIC_MATERIAL>& materials = _effect->GetMagicMaterials();
+
+        for (unsigned i = 0; i < materials.Size(); ++i)
+        {
+            const MAGIC_MATERIAL& mat = materials[i];
+            _streamStarts.Push(_states.Size());
+
+            AddState(MAGIC_RENDER_STATE_BLENDING, Clamp(mat.blending, 0, 2), 0);
+            AddState(MAGIC_RENDER_STATE_TEXTURE_COUNT, mat.textures, 0);
+
+            for (int j = 0; j < mat.textures; ++j)
+            {
+                if (_numTextures)
+                    AddState(MAGIC_RENDER_STATE_TEXTURE, (i + j) % _numTextures, j);
+                AddState(MAGIC_RENDER_STATE_ADDRESS_U, Clamp(mat.states[j].address_u, 0, 3), j);
+                AddState(MAGIC_RENDER_STATE_ADDRESS_V, Clamp(mat.states[j].address_v, 0, 3), j);
+                AddState(MAGIC_RENDER_STATE_OPERATION_RGB, mat.states[j].operation_rgb, j);
+                AddState(MAGIC_RENDER_STATE_OPERATION_ALPHA, mat.states[j].operation_alpha, j);
+            }
+
+            AddState(MAGIC_RENDER_STATE_ZWRITE, (mat.flags & MAGIC_MATERIAL_ZWRITE) ? 0 : 1, 0);
+        }
+        _streamStarts.Push(_states.Size());
+
+        // state hash key of each material as computed while filling
+        for (unsigned i = 0; i < materials.Size(); ++i)
+            _stateKeys.Push(_instance->ApplyRenderStates(&_states[_streamStarts[i]], _streamStarts[i + 1] - _streamStarts[i]));
+    }
+
+    void AddState(MAGIC_RENDER_STATE_ENUM state, int value, int index)
+    {
+        MAGIC_RENDER_STATE s;
+        s.state = state;
+        s.value = value;
+        s.index = index;
+        _states.Push(s);
+    }
+
+    void BenchHashKey()
+    {
+        Vector<MAGIC_MATERIAL> materials = _effect->GetMagicMaterials();
+
+        Measure("getMagicMaterialHashKey", materials.Size(), [&]()
+        {
+            for (unsigned i = 0; i < materials.Size(); ++i)
+                _sink += getMagicMaterialHashKey(&materials[i]);
+        });
+    }
+
+    void BenchGetMaterial()
+    {
+        unsigned numMaterials = _effect->GetMagicMaterials().Size();
+        bool created;
+
+        // materials were all created by warmup call, lookups only
+        Measure("GetMaterial (hit)", numMaterials, [&]()
+        {
+            for (unsigned i = 0; i < numMaterials; ++i)
+                _sink += _effect->GetMaterial(i, _stateKeys[i], created) != 0;
+        });
+
+        // a new state key each time, lookup miss and material creation
+        unsigned key = 0x9e3779b9;
+        Measure("GetMaterial (create)", 1, [&]()
+        {
+            _sink += _effect->GetMaterial(key % numMaterials, key, created) != 0;
+            ++key;
+        });
+    }
+
+    void BenchRenderStates()
+    {
+        Measure("SetRenderState", _states.Size(), [&]()
+        {
+            for (unsigned i = 0; i + 1 < _streamStarts.Size(); ++i)
+                _sink += _instance->ApplyRenderStates(&_states[_streamStarts[i]], _streamStarts[i + 1] - _streamStarts[i]);
+        });
+    }
+
+    void BenchMapBuffers()
+    {
+        // particle count of an emitter over its life : grows then fades out, 4 vertices and 6 indices per particle
+        const unsigned steps = 256;
+        const int maxParticles = 2000;
+        PODVector<int> particles(steps);
+        for (unsigned i = 0; i < steps; ++i)
+            particles[i] = maxParticles * (i < steps / 2 ? i : steps - i) / (steps / 2) + 1;
+
+        MAGIC_ARRAY_INFO vertexInfo;
+        MAGIC_ARRAY_INFO indexInfo;
+        memset(&vertexInfo, 0, sizeof(MAGIC_ARRAY_INFO));
+        memset(&indexInfo, 0, sizeof(MAGIC_ARRAY_INFO));
+        vertexInfo.type = MAGIC_VERTEX_FORMAT_POSITION;
+        vertexInfo.bytes_per_one = 24;
+        indexInfo.type = MAGIC_VERTEX_FORMAT_INDEX;
+        indexInfo.bytes_per_one = sizeof(unsigned short);
+
+        // buffers already sized by a previous life
+        Measure("MapBuffers (steady)", steps, [&]()
+        {
+            for (unsigned i = 0; i < steps; ++i)
+            {
+                vertexInfo.length = particles[i] * 4;
+                indexInfo.length = particles[i] * 6;
+                _instance->MapBuffers(&vertexInfo, &indexInfo);
+            }
+        });
+
+        // fresh instance buffers, each growth reallocates
+        Measure("MapBuffers (growth)", steps, [&]()
+        {
+            _instance->GetVertexData()->Destroy();
+            _instance->GetIndexData()->Destroy();
+            for (unsigned i = 0; i < steps; ++i)
+            {
+                vertexInfo.length = particles[i] * 4;
+                indexInfo.length = particles[i] * 6;
+                _instance->MapBuffers(&vertexInfo, &indexInfo);
+            }
+        });
+
+        // frame arena, one step per frame
+        MagicParticleArena* arena = GetSubsystem<MagicParticleArena>();
+        arena->SetEnabled(true);
+        Measure("MapBuffers (arena)", steps, [&]()
+        {
+            for (unsigned i = 0; i < steps; ++i)
+            {
+                arena->NextFrame();
+                vertexInfo.length = particles[i] * 4;
+                indexInfo.length = particles[i] * 6;
+                _instance->MapBuffers(&vertexInfo, &indexInfo);
+            }
+        });
+        arena->SetEnabled(false);
+    }
+
+    void BenchShaders()
+    {
+        Vector<MAGIC_MATERIAL> materials = _effect->GetMagicMaterials();
+
+        Measure("VsGenerate", materials.Size(), [&]()
+        {
+            for (unsigned i = 0; i < materials.Size(); ++i)
+                _sink += VsGenerate(&materials[i], "VERTEX_SHADER").Length();
+        });
+
+        Measure("PsGenerate", materials.Size(), [&]()
+        {
+            for (unsigned i = 0; i < materials.Size(); ++i)
+                _sink += PsGenerate(&materials[i], "PIXEL_SHADER").Length();
+        });
+    }
+
+    void WriteResults()
+    {
+        String csv = "benchmark,ops,ns_per_op,allocs_per_op\n";
+
+        PrintLine("Inputs : " + _effect->GetName() + ", " + String(_effect->GetMagicMaterials().Size()) + " materials, " +
+                  String(_states.Size()) + " render states");
+        PrintLine(String::EMPTY);
+
+        String header;
+        header.AppendWithFormat("%-24s %12s %12s %14s", "Benchmark", "ops", "ns/op", "allocs/op");
+        PrintLine(header);
+
+        for (unsigned i = 0; i < _results.Size(); ++i)
+        {
+            const MP_BENCH_RESULT& r = _results[i];
+
+            String line;
+            line.AppendWithFormat("%-24s %12llu %12.1f %14.3f", r.name.CString(), r.ops, r.nsPerOp, r.allocsPerOp);
+            PrintLine(line);
+
+            csv.AppendWithFormat("%s,%llu,%.3f,%.4f\n", r.name.CString(), r.ops, r.nsPerOp, r.allocsPerOp);
+        }
+
+        if (_outputFileName.Empty())
+            return;
+
+        File file(context_, _outputFileName, FILE_WRITE);
+        if (!file.IsOpen())
+        {
+            URHO3D_LOGERROR("Could not write benchmark results to " + _outputFileName);
+            return;
+        }
+        file.Write(csv.CString(), csv.Length());
+    }
+
+    /// Effect resource name.
+    String _fileName;
+    /// Use synthetic inputs.
+    bool _synthetic;
+    /// Min time per benchmark (microseconds).
+    long long _minTime;
+    /// CSV output file name.
+    String _outputFileName;
+    /// Effect holding materials and textures.
+    SharedPtr<MagicParticleEffect> _effect;
+    /// Instance driving render paths.
+    MagicEmitterInstance* _instance;
+    /// Number of textures in effect.
+    unsigned _numTextures;
+    /// Texture stage states of synthetic materials.
+    PODVector<MAGIC_TEXTURE_STATES> _syntheticStates;
+    /// Render states stream of all materials.
+    PODVector<MAGIC_RENDER_STATE> _states;
+    /// Start of each material in render states stream, plus end.
+    PODVector<unsigned> _streamStarts;
+    /// State hash key of each material.
+    PODVector<unsigned> _stateKeys;
+    /// Results.
+    Vector<MP_BENCH_RESULT> _results;
+    /// Keeps benchmarked results alive.
+    volatile unsigned _sink;
+};
+
+}
+
+URHO3D_DEFINE_APPLICATION_MAIN(Urho3D::MagicBenchmark)
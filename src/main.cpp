@@ -1,6 +1,16 @@
 #include <Urho3D/Urho3DAll.h>
 #include "MagicParticleEmitter.h"
 #include "MagicParticleEffect.h"
+#include "MagicParticleSystem.h"
+#include "MagicParticleCluster.h"
+#include "MagicParticleEvents.h"
+#include "MagicTrace.h"
+#include "MagicParticleTimeline.h"
+#include "MagicParticleStats.h"
+#include "MagicParticleEventStream.h"
+#include "MagicParticleObstacles.h"
+#include "MagicParticleArena.h"
+#include "MagicParticleInstancing.h"
 
 
 /// Custom logic component for moving particles emitters.
@@ -34,10 +44,14 @@ public:
         node_->Translate(Vector3::FORWARD * moveSpeed_ * timeStep);
         node_->Roll(rotationSpeed_ * timeStep);
 
-        // kill after max life
+        // stop emitting after max life, node is removed when the last particle dies
         if(life_ > 3.0f)
         {
-            node_->Remove();
+            MagicParticleEmitter* emitter = node_->GetComponent<MagicParticleEmitter>();
+            if(emitter)
+                emitter->StopEmitting();
+            else
+                node_->Remove();
         }
         life_ += timeStep;
     }
@@ -57,6 +71,16 @@ private:
 };
 
 
+/// Benchmark frame record.
+struct BenchmarkFrame
+{
+    /// Wall clock frame time in milliseconds.
+    float time;
+    /// Particle counters of the frame.
+    MP_COUNTERS counters;
+};
+
+
 /// Main application.
 class MyApp : public Application
 {
@@ -65,6 +89,7 @@ public:
     MagicParticleEffect*            _magicEffects;
     Node*                           _heroNode;
     SharedPtr<Scene>                _scene;    
+    MagicParticleSystem*            _particleSystem;
     SharedPtr<Text>                 _textInfo;    
     Node*                           _cameraNode;
     static const int                MAX_NODES = 100;
@@ -75,6 +100,27 @@ public:
     unsigned                        _currentHeroEmitterIndex;
     unsigned                        _maxEntities;
     bool                            _enableMushrooms;
+    unsigned                        _numCollisions;
+
+    // benchmark mode
+    bool                            _benchmark;
+    unsigned                        _benchEmitters;
+    float                           _benchDuration;
+    float                           _benchWarmup;
+    float                           _benchStep;
+    unsigned                        _benchSeed;
+    bool                            _benchAutoSorting;
+    bool                            _benchSimThread;
+    bool                            _benchParallelFill;
+    unsigned                        _benchCluster;
+    bool                            _benchFrameArena;
+    unsigned                        _benchInstanced;
+    String                          _benchOutput;
+    float                           _benchTime;
+    float                           _benchExtent;
+    HiresTimer                      _benchFrameTimer;
+    HiresTimer                      _benchTotalTimer;
+    PODVector<BenchmarkFrame>       _benchFrames;
 
     MyApp(Context * context) : Application(context)
     {
@@ -84,6 +130,85 @@ public:
         _currentHeroEmitterIndex = 0;
         _maxEntities = 0;
         _enableMushrooms = false;
+        _numCollisions = 0;
+
+        _benchmark = false;
+        _benchEmitters = 64;
+        _benchDuration = 20.0f;
+        _benchWarmup = 2.0f;
+        _benchStep = 1.0f / 60.0f;
+        _benchSeed = 1;
+        _benchAutoSorting = true;
+        _benchSimThread = false;
+        _benchParallelFill = false;
+        _benchCluster = 0;
+        _benchFrameArena = false;
+        _benchInstanced = 0;
+        _benchOutput = "MagicBenchmark";
+        _benchTime = 0.0f;
+        _benchExtent = 0.0f;
+    }
+
+    /// Parse benchmark command line options :
+    /// -bench                  run benchmark instead of interactive demo (add -headless to run without window)
+    /// -benchemitters <n>      number of emitters spawned in a grid, cycling through the emitters of the file (64)
+    /// -benchduration <s>      simulated duration in seconds, warmup excluded (20)
+    /// -benchwarmup <s>        simulated duration in seconds before measuring (2)
+    /// -benchfps <n>           fixed frame and simulation rate (60)
+    /// -benchseed <n>          random seed (1)
+    /// -benchoutput <name>     results written to <name>.json and <name>.csv (MagicBenchmark)
+    /// -benchsorting <0|1>     automatic particles sorting policy, compare both to measure sorting cost (1)
+    /// -benchsimthread <0|1>   pipelined simulation on a dedicated thread (0)
+    /// -benchparallelfill <0|1> concurrent geometry fill on worker threads (0)
+    /// -benchcluster <n>       emitters per cluster drawable, grouped by grid cell, 0 for one node per emitter (0)
+    /// -benchframearena <0|1>  CPU staging buffers allocated from a frame arena (0)
+    /// -benchinstanced <n>     instanced emitters sharing <n> phase-shifted masters per emitter, 0 for own simulations (0)
+    void ParseBenchmarkArguments()
+    {
+        const Vector<String>& args = GetArguments();
+        for (unsigned i=0; i<args.Size(); ++i)
+        {
+            String arg = args[i].ToLower();
+            String value = i + 1 < args.Size() ? args[i + 1] : String::EMPTY;
+
+            if(arg == "-bench")
+            {
+                _benchmark = true;
+                continue;
+            }
+
+            if(value.Empty())
+                continue;
+            else if(arg == "-benchemitters")
+                _benchEmitters = Max(ToUInt(value), 1U);
+            else if(arg == "-benchduration")
+                _benchDuration = Max(ToFloat(value), 0.0f);
+            else if(arg == "-benchwarmup")
+                _benchWarmup = Max(ToFloat(value), 0.0f);
+            else if(arg == "-benchfps")
+                _benchStep = 1.0f / Max(ToFloat(value), 1.0f);
+            else if(arg == "-benchseed")
+                _benchSeed = ToUInt(value);
+            else if(arg == "-benchoutput")
+                _benchOutput = value;
+            else if(arg == "-benchsorting")
+                _benchAutoSorting = ToInt(value) != 0;
+            else if(arg == "-benchsimthread")
+                _benchSimThread = ToInt(value) != 0;
+            else if(arg == "-benchparallelfill")
+                _benchParallelFill = ToInt(value) != 0;
+            else if(arg == "-benchcluster")
+                _benchCluster = ToUInt(value);
+            else if(arg == "-benchframearena")
+                _benchFrameArena = ToInt(value) != 0;
+            else if(arg == "-benchinstanced")
+                _benchInstanced = ToUInt(value);
+            else
+                continue;
+
+            // skip option value
+            ++i;
+        }
     }
 
     virtual void Setup()
@@ -94,8 +219,18 @@ public:
         engineParameters_["WindowResizable"]=true;
         engineParameters_["vsync"]=false;
 
+        ParseBenchmarkArguments();
+        if(_benchmark)
+        {
+            // frames are driven by the fixed step, do not sleep between them
+            engineParameters_["FrameLimiter"]=false;
+        }
+
         MagicParticleEffect::RegisterObject(context_);
         MagicParticleEmitter::RegisterObject(context_);
+        MagicParticleSystem::RegisterObject(context_);
+        MagicParticleCluster::RegisterObject(context_);
+        MagicParticleObstacles::RegisterObject(context_);
         context_->RegisterFactory<FxMover>();
     }
 
@@ -106,6 +241,8 @@ public:
         _scene = new Scene(context_);
         _scene->CreateComponent<Octree>();
         _scene->CreateComponent<DebugRenderer>();
+        _particleSystem = _scene->CreateComponent<MagicParticleSystem>();
+        _scene->CreateComponent<MagicParticleObstacles>();
 
         // Create a Zone component for ambient lighting & fog control
         Node* zoneNode = _scene->CreateChild("Zone");
@@ -132,11 +269,30 @@ public:
         _cameraNode->SetPosition(Vector3(0.0f, 2.0f, -10.0f));
         _cameraNode->LookAt(Vector3(0.0f, 0.0f, 0.0f));
 
+#if defined(MAGIC_RECORD_WRAP) || defined(MAGIC_REPLAY_WRAP)
+        // record or replay Magic outputs, must be done before loading effects
+        MagicTraceOpen(context_, GetSubsystem<FileSystem>()->GetProgramDir() + "MagicParticles.trace");
+#endif
+
         // Load a .ptc file (use menu saved as (API)... in Magic Particles 3D to create compatible files)
         // Currently only one file per game instance is supported. Please place all your effects in this file (use merge menu to combine files if needed).
         _magicEffects = cache->GetResource<MagicParticleEffect>("MagicParticles/particles3d/3d_urho.ptc");
         _maxEntities = Min(_magicEffects->GetNumEmitters(), MAX_NODES);
 
+#if defined(MAGIC_RECORD_WRAP) || defined(MAGIC_REPLAY_WRAP)
+        // snapshots are not traced
+        _magicEffects->SetSnapshotsEnabled(false);
+#endif
+
+        // Duplicate a few instances of each emitter now, so spawning projectiles does not duplicate emitters during gameplay.
+        _magicEffects->SetPrewarmCount(2);
+
+        if(_benchmark)
+        {
+            StartBenchmark(camera);
+            return;
+        }
+
         unsigned gridX = 0;
         unsigned gridY = 0;
         float offset = 8.0f;
@@ -214,6 +370,7 @@ public:
         DebugHud* debugHud = engine_->CreateDebugHud();
         XMLFile* xmlFile = cache->GetResource<XMLFile>("UI/DefaultStyle.xml");
         debugHud->SetDefaultStyle(xmlFile);
+        GetSubsystem<MagicParticleStats>()->SetDebugHudEnabled(true);
 
         // Create viewport.
         Renderer* renderer=GetSubsystem<Renderer>();
@@ -224,6 +381,8 @@ public:
         SubscribeToEvent(E_MOUSEBUTTONDOWN,URHO3D_HANDLER(MyApp,HandleMouseButtonDown));
         SubscribeToEvent(E_UPDATE,URHO3D_HANDLER(MyApp,HandleUpdate));
         SubscribeToEvent(E_POSTRENDERUPDATE, URHO3D_HANDLER(MyApp, HandlePostRenderUpdate));
+        SubscribeToEvent(E_MAGICPARTICLEFINISHED, URHO3D_HANDLER(MyApp, HandleMagicParticleFinished));
+        SubscribeToEvent(E_MAGICPARTICLEEVENTS, URHO3D_HANDLER(MyApp, HandleMagicParticleEvents));
 
         //GetSubsystem<Input>()->SetMouseVisible(true);
     }
@@ -274,14 +433,8 @@ public:
             String s;
             accumulator = 0.0f;
 
-            // count particles in scene
-            unsigned particlesCount = 0;
-            PODVector<MagicParticleEmitter*> dest;
-            _scene->GetComponents<MagicParticleEmitter>(dest, true);
-            for(unsigned i=0; i<dest.Size(); ++i)
-            {
-                particlesCount += dest[i]->GetParticlesCount();
-            }
+            // particles drawn last frame by all emitters and one-shots
+            unsigned particlesCount = GetSubsystem<MagicParticleStats>()->GetFrameCounters().particles;
 
             // display infos
             s = "Effect file : " + _magicEffects->GetName() + "\n";
@@ -289,11 +442,18 @@ public:
             s += String(_currentHeroEmitterIndex + 1) + "/";
             s += String(_magicEffects->GetNumEmitters()) + ")\n";
             s += "Particles count = " + String(particlesCount);
+            s += "\nParticle collisions = " + String(_numCollisions) + " /s";
+            s += "\nParticles memory = " + String((unsigned)(_magicEffects->GetMemoryStats().GetTotal() / 1024)) + " KB";
+            _numCollisions = 0;
             s += "\nPress 'B' to show bounding boxes";
             s += "\nPress 'E' to show/hide all emitters";
+            s += "\nPress 'F' to toggle fixed simulation step (";
+            s += String(_magicEffects->GetFixedTimeStep() > 0.0 ? "30 Hz, not interpolated" : "frame time") + ")";
+            s += "\nPress 'C' to capture a timeline of the next 60 frames";
             s += "\nPress 'R' to link/unlink particles movements to emitter";
             s += "\nPress 'T' to change motion type";
             s += "\nPress 'Mouse left button' to spawn emitter from hero";
+            s += "\nPress 'Mouse middle button' to spawn one-shot effect around hero";
             s += "\nPress 'Mouse right button' for next emitter";
             s += "\nPress 'Right/Left' to turn hero";
 
@@ -302,8 +462,234 @@ public:
 
     }
 
+    /// Spawn the benchmark grid and start the scripted run.
+    void StartBenchmark(Camera* camera)
+    {
+        if(!_magicEffects || !_magicEffects->GetNumEmitters())
+        {
+            ErrorExit("Benchmark needs an effect file with emitters");
+            return;
+        }
+
+        // reproducible run : fixed seed, Magic stable behaviour, same fixed step for frames and simulation
+        SetRandomSeed(_benchSeed);
+        _magicEffects->SetRandomMode(false);
+        _magicEffects->SetFixedTimeStep(_benchStep * 1000.0);
+        _magicEffects->SetAutoSorting(_benchAutoSorting);
+        GetSubsystem<MagicParticleSimulation>()->SetPipelined(_benchSimThread);
+        GetSubsystem<MagicParticleSimulation>()->SetParallelFill(_benchParallelFill);
+        GetSubsystem<MagicParticleArena>()->SetEnabled(_benchFrameArena);
+        GetSubsystem<MagicParticleInstancing>()->SetNumPhases(_benchInstanced);
+        // emitters have random yaws : instanced ones share masters per 90 degrees
+        GetSubsystem<MagicParticleInstancing>()->SetRotationStep(90.0f);
+
+        const float spacing = 8.0f;
+        unsigned side = CeilToInt(Sqrt((float)_benchEmitters));
+        _benchExtent = side * spacing * 0.5f;
+
+        // clusters : square grid cells of about _benchCluster emitters
+        unsigned cellSide = _benchCluster ? CeilToInt(Sqrt((float)_benchCluster)) : 1;
+        unsigned cellsPerRow = (side + cellSide - 1) / cellSide;
+        PODVector<MagicParticleCluster*> clusters(_benchCluster ? cellsPerRow * cellsPerRow : 0);
+        for (unsigned i=0; i<clusters.Size(); ++i)
+            clusters[i] = _scene->CreateChild("BenchmarkCluster")->CreateComponent<MagicParticleCluster>();
+
+        for (unsigned i=0; i<_benchEmitters; ++i)
+        {
+            Vector3 position((i % side) * spacing - _benchExtent, 0.0f, (i / side) * spacing - _benchExtent);
+            Quaternion rotation(0.0f, Random() * 360.0f, 0.0f);
+
+            if(_benchCluster)
+            {
+                unsigned cell = (i / side) / cellSide * cellsPerRow + (i % side) / cellSide;
+                clusters[cell]->AddEmitter(_magicEffects, i % _magicEffects->GetNumEmitters(), position, rotation);
+                continue;
+            }
+
+            Node* node = _scene->CreateChild("Benchmark");
+            node->SetPosition(position);
+            node->SetRotation(rotation);
+
+            MagicParticleEmitter* em = node->CreateComponent<MagicParticleEmitter>();
+            em->SetInstanced(_benchInstanced != 0);
+            em->SetEffect(_magicEffects, i % _magicEffects->GetNumEmitters());
+            em->SetOverrideEmitterRotation(true);
+            em->SetEmitterPosition(Vector3(0,0,0));
+        }
+
+        // no renderer when headless : no view ever renders the emitters, they are simulated
+        // without fill, fill and upload counters stay at 0
+        Renderer* renderer = GetSubsystem<Renderer>();
+        if(renderer)
+        {
+            SharedPtr<Viewport> viewport(new Viewport(context_, _scene, camera));
+            renderer->SetViewport(0,viewport);
+        }
+        else
+            GetSubsystem<MagicParticleSimulation>()->SetSimulateHidden(true);
+
+        _benchFrames.Reserve((unsigned)((_benchDuration + _benchWarmup) / _benchStep) + 1);
+        engine_->SetNextTimeStep(_benchStep);
+
+        SubscribeToEvent(E_BEGINFRAME, URHO3D_HANDLER(MyApp, HandleBenchmarkBeginFrame));
+        SubscribeToEvent(E_ENDFRAME, URHO3D_HANDLER(MyApp, HandleBenchmarkEndFrame));
+        SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(MyApp, HandleBenchmarkUpdate));
+        SubscribeToEvent(E_MAGICPARTICLEFINISHED, URHO3D_HANDLER(MyApp, HandleMagicParticleFinished));
+
+        URHO3D_LOGINFO("Benchmark : " + String(_benchEmitters) + " emitters, " + String(_benchDuration) + " s at " +
+                       String(1.0f / _benchStep) + " fps, seed " + String(_benchSeed));
+    }
+
+    void HandleBenchmarkBeginFrame(StringHash eventType, VariantMap& eventData)
+    {
+        // record the frame that just ended, once warmup is over
+        long long frameTime = _benchFrameTimer.GetUSec(true);
+        if(_benchTime <= _benchWarmup)
+            return;
+
+        MagicParticleStats* stats = GetSubsystem<MagicParticleStats>();
+        if(_benchFrames.Empty())
+        {
+            // first measured frame, drop warmup from totals
+            stats->ResetTotal();
+            _benchTotalTimer.Reset();
+        }
+
+        BenchmarkFrame frame;
+        frame.time = frameTime / 1000.0f;
+        frame.counters = stats->GetFrameCounters();
+        _benchFrames.Push(frame);
+
+        if(_benchTime > _benchWarmup + _benchDuration)
+        {
+            UnsubscribeFromEvent(E_BEGINFRAME);
+            WriteBenchmarkResults();
+            engine_->Exit();
+        }
+    }
+
+    void HandleBenchmarkEndFrame(StringHash eventType, VariantMap& eventData)
+    {
+        // engine computes the next time step from elapsed time before this event, override it
+        engine_->SetNextTimeStep(_benchStep);
+    }
+
+    void HandleBenchmarkUpdate(StringHash eventType, VariantMap& eventData)
+    {
+        using namespace Update;
+
+        _benchTime += eventData[P_TIMESTEP].GetFloat();
+
+        // scripted camera : orbit the grid once, swinging from outside to inside it
+        float t = _benchTime / (_benchWarmup + _benchDuration);
+        float angle = t * 360.0f;
+        float radius = _benchExtent * (1.0f + 0.75f * Cos(angle * 2.0f)) + 5.0f;
+        float height = 4.0f + _benchExtent * 0.25f * (1.0f + Sin(angle * 3.0f));
+
+        _cameraNode->SetPosition(Vector3(Sin(angle) * radius, height, Cos(angle) * radius));
+        _cameraNode->LookAt(Vector3(0.0f, 0.0f, 0.0f));
+    }
+
+    /// Return percentile of sorted frame times.
+    static float GetPercentile(const PODVector<float>& sorted, float percent)
+    {
+        if(sorted.Empty())
+            return 0.0f;
+        unsigned index = Min((unsigned)(percent / 100.0f * sorted.Size()), sorted.Size() - 1);
+        return sorted[index];
+    }
+
+    void WriteBenchmarkResults()
+    {
+        MagicParticleStats* stats = GetSubsystem<MagicParticleStats>();
+        const MP_COUNTERS& total = stats->GetTotalCounters();
+        float wallTime = _benchTotalTimer.GetUSec(false) / 1000000.0f;
+        unsigned numFrames = _benchFrames.Size();
+
+        PODVector<float> times(numFrames);
+        float sum = 0.0f;
+        for (unsigned i=0; i<numFrames; ++i)
+        {
+            times[i] = _benchFrames[i].time;
+            sum += times[i];
+        }
+        Sort(times.Begin(), times.End());
+
+        // summary
+        String json = "{\n";
+        json += "  \"effect\": \"" + _magicEffects->GetName() + "\",\n";
+        json += "  \"headless\": " + String(GetSubsystem<Renderer>() == 0) + ",\n";
+        json += "  \"emitters\": " + String(_benchEmitters) + ",\n";
+        json += "  \"duration\": " + String(_benchDuration) + ",\n";
+        json += "  \"step\": " + String(_benchStep * 1000.0f) + ",\n";
+        json += "  \"seed\": " + String(_benchSeed) + ",\n";
+        json += "  \"autoSorting\": " + String(_benchAutoSorting) + ",\n";
+        json += "  \"simThread\": " + String(_benchSimThread) + ",\n";
+        json += "  \"parallelFill\": " + String(_benchParallelFill) + ",\n";
+        json += "  \"cluster\": " + String(_benchCluster) + ",\n";
+        json += "  \"frameArena\": " + String(_benchFrameArena) + ",\n";
+        json += "  \"instanced\": " + String(_benchInstanced) + ",\n";
+        json += "  \"frames\": " + String(numFrames) + ",\n";
+        json += "  \"wallTime\": " + String(wallTime) + ",\n";
+        json += "  \"frameTime\": { \"mean\": " + String(numFrames ? sum / numFrames : 0.0f) +
+                ", \"p50\": " + String(GetPercentile(times, 50.0f)) +
+                ", \"p90\": " + String(GetPercentile(times, 90.0f)) +
+                ", \"p95\": " + String(GetPercentile(times, 95.0f)) +
+                ", \"p99\": " + String(GetPercentile(times, 99.0f)) +
+                ", \"max\": " + String(times.Empty() ? 0.0f : times.Back()) + " },\n";
+        json += "  \"particlesPerFrame\": " + String(numFrames ? (float)total.particles / numFrames : 0.0f) + ",\n";
+        json += "  \"particlesPerSecond\": " + String(wallTime > 0.0f ? (float)total.particles / wallTime : 0.0f) + ",\n";
+        json += "  \"counters\": { \"particles\": " + String(total.particles) +
+                ", \"vertices\": " + String(total.vertices) +
+                ", \"indices\": " + String(total.indices) +
+                ", \"batches\": " + String(total.batches) +
+                ", \"bytesUploaded\": " + String(total.bytesUploaded) +
+                ", \"materialsCreated\": " + String(total.materialsCreated) +
+                ", \"sortSkipped\": " + String(total.sortSkipped) +
+                ", \"occluded\": " + String(total.occluded) +
+                ", \"fillsSkipped\": " + String(total.fillsSkipped) +
+                ", \"updateTime\": " + String(total.updateTime) +
+                ", \"fillTime\": " + String(total.fillTime) +
+                ", \"stateTime\": " + String(total.stateTime) +
+                ", \"uploadTime\": " + String(total.uploadTime) + " },\n";
+        json += "  \"loadTime\": " + String(_magicEffects->GetLoadTime()) + "\n";
+        json += "}\n";
+
+        // per frame
+        String csv = "frame,time_ms,particles,sort_skipped,vertices,indices,batches,bytes_uploaded,update_us,fill_us,state_us,upload_us\n";
+        for (unsigned i=0; i<numFrames; ++i)
+        {
+            const BenchmarkFrame& frame = _benchFrames[i];
+            csv += String(i) + "," + String(frame.time) + "," + String(frame.counters.particles) + "," +
+                   String(frame.counters.sortSkipped) + "," +
+                   String(frame.counters.vertices) + "," + String(frame.counters.indices) + "," +
+                   String(frame.counters.batches) + "," + String(frame.counters.bytesUploaded) + "," +
+                   String(frame.counters.updateTime) + "," + String(frame.counters.fillTime) + "," +
+                   String(frame.counters.stateTime) + "," + String(frame.counters.uploadTime) + "\n";
+        }
+
+        String files[] = { _benchOutput + ".json", _benchOutput + ".csv" };
+        String contents[] = { json, csv };
+        for (unsigned i=0; i<2; ++i)
+        {
+            File file(context_, files[i], FILE_WRITE);
+            if(!file.IsOpen())
+            {
+                URHO3D_LOGERROR("Could not write benchmark results to " + files[i]);
+                continue;
+            }
+            file.Write(contents[i].CString(), contents[i].Length());
+        }
+
+        URHO3D_LOGINFO("Benchmark : " + String(numFrames) + " frames, p50 " + String(GetPercentile(times, 50.0f)) +
+                       " ms, p99 " + String(GetPercentile(times, 99.0f)) + " ms, results written to " + _benchOutput);
+    }
+
     virtual void Stop()
     {
+#if defined(MAGIC_RECORD_WRAP) || defined(MAGIC_REPLAY_WRAP)
+        MagicTraceClose();
+#endif
     }
 
     void HandleKeyDown(StringHash eventType,VariantMap& eventData)
@@ -325,6 +711,17 @@ public:
             if(_motionDemo >= 3)
                 _motionDemo = 0;
         }
+        else if(key == KEY_F)
+        {
+            // toggle 30 Hz fixed simulation step : reproducible, but each step is drawn for several frames at higher frame rates
+            _magicEffects->SetFixedTimeStep(_magicEffects->GetFixedTimeStep() > 0.0 ? 0.0 : 1000.0 / 30.0);
+        }
+        else if(key == KEY_C)
+        {
+            // capture particle pipeline phases of next frames (open in chrome://tracing)
+            String fileName = GetSubsystem<FileSystem>()->GetProgramDir() + "MagicTimeline.json";
+            GetSubsystem<MagicParticleTimeline>()->CaptureFrames(60, fileName);
+        }
         else if(key == KEY_R)
         {
             _linkParticlesMovementsToEmitter = !_linkParticlesMovementsToEmitter;
@@ -363,6 +760,12 @@ public:
             FxMover* mover = projectile->CreateComponent<FxMover>();
             mover->SetParameters(18, 0);
         }
+        else if(button == MOUSEB_MIDDLE)
+        {
+            // fire-and-forget effect, no node or component needed
+            Vector3 offset(Random(10.0f) - 5.0f, 0.0f, Random(10.0f) - 5.0f);
+            _particleSystem->SpawnOneShot(_magicEffects, _currentHeroEmitterIndex, _heroNode->GetPosition() + offset);
+        }
         else if(button == MOUSEB_RIGHT)
         {
             // get next emitter for hero
@@ -420,6 +823,35 @@ public:
         }
     }
 
+    void HandleMagicParticleFinished(StringHash eventType, VariantMap& eventData)
+    {
+        using namespace MagicParticleFinished;
+
+        // recycle projectiles once their particles are all dead
+        Node* node = static_cast<Node*>(eventData[P_NODE].GetPtr());
+        if(node && node->GetComponent<FxMover>())
+            node->Remove();
+
+        // keep benchmark load constant, non looping emitters start over
+        MagicParticleEmitter* emitter = static_cast<MagicParticleEmitter*>(eventData[P_EMITTER].GetPtr());
+        if(_benchmark && emitter)
+            emitter->Restart();
+    }
+
+    void HandleMagicParticleEvents(StringHash eventType, VariantMap& eventData)
+    {
+        using namespace MagicParticleEvents;
+
+        // all particle events of the frame at once
+        MagicParticleEventStream* stream = static_cast<MagicParticleEventStream*>(eventData[P_STREAM].GetPtr());
+        const PODVector<unsigned char>& types = stream->GetTypes();
+        for (unsigned i = 0; i < types.Size(); ++i)
+        {
+            if (types[i] == MAGIC_EVENT_COLLISION)
+                ++_numCollisions;
+        }
+    }
+
     void HandlePostRenderUpdate(StringHash eventType, VariantMap& eventData)
     {        
         if (_drawDebug)